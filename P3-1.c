@@ -14,40 +14,284 @@ NN April 2011                      Phillip Johnston  */
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <getopt.h>
 #include "utils.h"
 #include "rollers.h"
+#include "workers.h"
+#include "pack.h"
+#include "avi.h"
+#include "delta.h"
+#include "reader.h"
+#include "writer.h"
+#include "stream.h"
 #include "mmm.h"
 
 
 //Function Declarations
-void LoadOriginalImage(int N);
+int LoadOriginalImage(int N);
 void GrabForegroundImage(int N);
 void GrabDensityMap(int N);
 void GrabBlobAnnotatedMap(int N);
 void WriteOutResultsStack(int N);
 void WriteOutOutputImage(int N);
+void LoadFullImage(int N);
+int DecodeFrame(Decoder *D, int N, FrmBuf *Frame);
+void ModelBackground(FrmBuf *Frame);
+void ModelForeground(FrmBuf *Frame, unsigned char *Mask);
+void ModelDecimate(int N);
+void ModelBudget();
+void Usage(char *Name);
 
 //Globals
 
 /* Declarations */
 int  	        MCDth = 33, Cth = 4, DecRate = 2; //TODO: Set these to appropriate values
+#define		DEC_TRAIN	0	//Decimate only while training the model (default)
+#define		DEC_FULL	1	//Also decimate the whole model every DecRate frames
+#define		DEC_SLICE	2	//Also decimate a 1/DecRate slice of the model every frame
+int		DecMode = DEC_TRAIN;	//Decimation mode (--decimate)
+int		CompactRate = 0;	//Compact the cell list model every CompactRate frames, 0 never (--compact)
+int		MaxModes = 0;		//Most cells or modes per pixel, 0 for the default (--max-modes)
+long		CellBudget = 0;		//Most cells in the cell list model, 0 for no limit (--cell-budget)
 Cell            **BGM;
+ModeBGM         *MBGM = NULL;	//Mode array model, used instead of BGM with --bgm soa
+int		UseSIMD = SIMD_NONE;	//Vectorized foreground extraction kernel (--simd)
+Workers		*Pool = NULL;		//Worker pool for the background model (--threads)
+Reader		*Input = NULL;		//Read-ahead frame decoder for the main loop (--prefetch)
+Writer		*Output = NULL;		//Asynchronous JPEG encoders for the output frames (--encoders)
+Decoder		*InCodec;		//JPEG decoder reused for every input frame
+Encoder		*OutCodec;		//JPEG encoder reused for every output frame
+int		Scale = 1;		//Frames are decoded and processed at 1/Scale (--scale)
+int		FastDecode = FALSE;	//Fast IDCT and upsampling for every decode (--fast-decode)
+Decoder		*FullCodec = NULL;	//Full resolution decoder for compositing, with --scale
+FrmBuf		*fullFB = NULL;		//Full resolution frame, decoded only when a blob is composited
+Stream		*InStream = NULL;	//Y4M or raw RGB24 input, used instead of InSeq/%05d.jpg (--input)
+Encode_Profile	RSProfile, OutProfile;	//Encoder settings for the results stack and the composite (--rs-profile, --out-profile)
+Pack		*InPack = NULL;		//Sequence pack, used instead of InSeq/%05d.jpg (--pack)
+Stream		*OutStream = NULL;	//Y4M or raw RGB24 output, used instead of trials/00/out%05d.jpg (--output)
+AVI		*OutAVI = NULL;		//Motion JPEG file, used instead of trials/00/rs%05d.jpg and out%05d.jpg (--avi)
+int		RSTrack, OutTrack = -1;	//AVI streams of the results stack and the composite
+Delta		*OutDelta = NULL;	//Park once, then only the composited patches, used instead of trials/00/out%05d.jpg (--delta)
+unsigned char	*FGMask = NULL;		//Foreground mask, used instead of a blacked out frame with --mask
 FrmBuf          *FB, *wFB, *dFB, *oFB, *woFB, *rsFB;
+FrmBuf		*rsPane[4];		//Views of the results stack panes: original, foreground, density, blobs
+Frame_Scope	*Scratch;		//Buffers of the current frame, recycled at the end of each iteration
 int             *DensityMap;
-int		Bth = 20, Wsize = 7, NumBlobs = 0;
+int		Bth = 20, Wsize = 7, Hsize = 7, NumBlobs = 0;	//Density window is Wsize wide, Hsize high
+Integral	*SAT = NULL;		//Summed area table, used for density with --sat
 Blob            *Blobs;
 
 
 //BEGIN MAIN LOOP
 int main(int argc, char *argv[]) {
-   char                 Path[128], cFile[128] = {0}, *SeqName;
-   int			Start, End, Step, N;
+   char                 Path[128], cFile[128] = {0}, *SeqName, *LoadBGM = NULL, *SaveBGM = NULL, *InName = NULL, *OutName = NULL, *PackName = NULL, *AVIName = NULL, *DeltaName = NULL;
+   int			Start, End, Step, N, i;
    int			height, width; //Declare variables to use with initializations of buffers
-
-   if (argc !=5) {
-      fprintf(stderr, "usage: %s seqname start end step\n", argv[0]);
+   int			Opt, UseModes = FALSE, UseMask = FALSE, UseSAT = FALSE, NumThreads = 1;
+   int			Prefetch = 0, NumDecoders = 1, NumEncoders = 0;
+   int			InFormat = STREAM_Y4M, InWidth = 0, InHeight = 0, Used = 0, OutFormat = STREAM_Y4M;
+   static struct option	Options[] = {
+      {"bgm", required_argument, NULL, 'b'},
+      {"simd", optional_argument, NULL, 'v'},
+      {"threads", required_argument, NULL, 't'},
+      {"mask", no_argument, NULL, 'm'},
+      {"sat", no_argument, NULL, 's'},
+      {"window", required_argument, NULL, 'w'},
+      {"decimate", required_argument, NULL, 'd'},
+      {"load-bgm", required_argument, NULL, 'l'},
+      {"save-bgm", required_argument, NULL, 'o'},
+      {"prefetch", required_argument, NULL, 'p'},
+      {"decoders", required_argument, NULL, 'j'},
+      {"encoders", required_argument, NULL, 'e'},
+      {"scale", required_argument, NULL, 'z'},
+      {"fast-decode", no_argument, NULL, 'f'},
+      {"input", required_argument, NULL, 'i'},
+      {"output", required_argument, NULL, 'O'},
+      {"pack", required_argument, NULL, 'k'},
+      {"rs-profile", required_argument, NULL, 'R'},
+      {"out-profile", required_argument, NULL, 'P'},
+      {"avi", required_argument, NULL, 'a'},
+      {"delta", required_argument, NULL, 'D'},
+      {"compact", required_argument, NULL, 'C'},
+      {"max-modes", required_argument, NULL, 'M'},
+      {"cell-budget", required_argument, NULL, 'B'},
+      {NULL, 0, NULL, 0}
+   };
+
+   RSProfile = OutProfile = *Find_Encode_Profile("default");
+   while ((Opt = getopt_long(argc, argv, "", Options, NULL)) != -1) {
+      switch (Opt) {
+      case 'b':					//background model layout
+	 if (strcmp(optarg, "soa") == 0)
+	    UseModes = TRUE;
+	 else if (strcmp(optarg, "list") != 0) {
+	    fprintf(stderr, "%s is not a valid background model (list, soa)\n", optarg);
+	    exit(1);
+	 }
+	 break;
+      case 'v':					//vectorized foreground kernel, needs mode array model
+	 if (optarg == NULL)
+	    UseSIMD = Mode_SIMD_Level();
+	 else if (strcmp(optarg, "sse4") == 0)
+	    UseSIMD = SIMD_SSE4;
+	 else if (strcmp(optarg, "avx2") == 0)
+	    UseSIMD = SIMD_AVX2;
+	 else {
+	    fprintf(stderr, "%s is not a valid SIMD kernel (sse4, avx2)\n", optarg);
+	    exit(1);
+	 }
+	 UseModes = TRUE;
+	 break;
+      case 't':					//number of background model threads
+	 if (sscanf(optarg, "%d", &NumThreads) != 1 || NumThreads < 1 || NumThreads > MAXBANDS) {
+	    fprintf(stderr, "%s is not a valid thread count (1-%d)\n", optarg, MAXBANDS);
+	    exit(1);
+	 }
+	 break;
+      case 'm':					//fused foreground mask for the density stage
+	 UseMask = TRUE;
+	 break;
+      case 's':					//summed area table density
+	 UseSAT = TRUE;
+	 break;
+      case 'w':					//density window, W or WxH
+	 N = sscanf(optarg, "%dx%d", &Wsize, &Hsize);
+	 if (N == 1)
+	    Hsize = Wsize;
+	 if (N < 1 || Wsize < 1 || Hsize < 1) {
+	    fprintf(stderr, "%s is not a valid density window (W or WxH)\n", optarg);
+	    exit(1);
+	 }
+	 break;
+      case 'd':					//decimation in the main loop
+	 if (strcmp(optarg, "full") == 0)
+	    DecMode = DEC_FULL;
+	 else if (strcmp(optarg, "slice") == 0)
+	    DecMode = DEC_SLICE;
+	 else {
+	    fprintf(stderr, "%s is not a valid decimation mode (full, slice)\n", optarg);
+	    exit(1);
+	 }
+	 break;
+      case 'l':					//start from a saved background model snapshot
+	 LoadBGM = optarg;
+	 break;
+      case 'o':					//save the background model snapshot at the end
+	 SaveBGM = optarg;
+	 break;
+      case 'p':					//decode this many frames ahead of the main loop
+	 if (sscanf(optarg, "%d", &Prefetch) != 1 || Prefetch < 2) {
+	    fprintf(stderr, "%s is not a valid prefetch depth (2 or more frames)\n", optarg);
+	    exit(1);
+	 }
+	 break;
+      case 'j':					//number of prefetch decoder threads
+	 if (sscanf(optarg, "%d", &NumDecoders) != 1 || NumDecoders < 1 || NumDecoders > MAXREADERS) {
+	    fprintf(stderr, "%s is not a valid decoder count (1-%d)\n", optarg, MAXREADERS);
+	    exit(1);
+	 }
+	 break;
+      case 'e':					//number of output encoder threads, 0 to encode in line
+	 if (sscanf(optarg, "%d", &NumEncoders) != 1 || NumEncoders < 0 || NumEncoders > MAXWRITERS) {
+	    fprintf(stderr, "%s is not a valid encoder count (0-%d)\n", optarg, MAXWRITERS);
+	    exit(1);
+	 }
+	 break;
+      case 'z':					//process the frames decoded at 1/Scale
+	 if (sscanf(optarg, "%d", &Scale) != 1 || (Scale != 1 && Scale != 2 && Scale != 4 && Scale != 8)) {
+	    fprintf(stderr, "%s is not a valid processing scale (1, 2, 4, 8)\n", optarg);
+	    exit(1);
+	 }
+	 break;
+      case 'f':					//fast IDCT, no fancy upsampling
+	 FastDecode = TRUE;
+	 break;
+      case 'i':					//read frames from a stream, y4m:PATH or rgb:WxH:PATH
+	 if (strncmp(optarg, "y4m:", 4) == 0 && optarg[4])
+	    InName = optarg + 4;
+	 else if (sscanf(optarg, "rgb:%dx%d:%n", &InWidth, &InHeight, &Used) == 2 && Used > 0 &&
+		  InWidth > 0 && InHeight > 0 && optarg[Used]) {
+	    InFormat = STREAM_RGB;
+	    InName = optarg + Used;
+	 } else {
+	    fprintf(stderr, "%s is not a valid input stream (y4m:PATH, rgb:WxH:PATH, - for stdin)\n", optarg);
+	    exit(1);
+	 }
+	 break;
+      case 'O':					//stream the composited frames, y4m:PATH or rgb:PATH
+	 if (strncmp(optarg, "y4m:", 4) == 0 && optarg[4])
+	    OutName = optarg + 4;
+	 else if (strncmp(optarg, "rgb:", 4) == 0 && optarg[4]) {
+	    OutFormat = STREAM_RGB;
+	    OutName = optarg + 4;
+	 } else {
+	    fprintf(stderr, "%s is not a valid output stream (y4m:PATH, rgb:PATH, - for stdout)\n", optarg);
+	    exit(1);
+	 }
+	 break;
+      case 'k':					//decode the frames from a pack made by mkpack
+	 PackName = optarg;
+	 break;
+      case 'R':					//encode profile of the results stack, NAME[:QUALITY]
+      case 'P':					//encode profile of the composite, NAME[:QUALITY]
+	 if (!Parse_Encode_Profile(optarg, (Opt == 'R') ? &RSProfile : &OutProfile)) {
+	    fprintf(stderr, "%s is not a valid encode profile (default, preview, archive, with optional :QUALITY)\n", optarg);
+	    exit(1);
+	 }
+	 break;
+      case 'a':					//one Motion JPEG file for every output frame
+	 AVIName = optarg;
+	 break;
+      case 'C':					//relocate the cell lists in pixel order every N frames
+	 if (sscanf(optarg, "%d", &CompactRate) != 1 || CompactRate < 0) {
+	    fprintf(stderr, "%s is not a valid compaction interval (frames, 0 for never)\n", optarg);
+	    exit(1);
+	 }
+	 break;
+      case 'M':					//cap the cells (or modes) per pixel, the weakest is replaced
+	 if (sscanf(optarg, "%d", &MaxModes) != 1 || MaxModes < 1 || MaxModes > 255) {
+	    fprintf(stderr, "%s is not a valid mode limit (1 to 255)\n", optarg);
+	    exit(1);
+	 }
+	 break;
+      case 'B':					//decimate more often while the model holds too many cells
+	 if (sscanf(optarg, "%ld", &CellBudget) != 1 || CellBudget < 0) {
+	    fprintf(stderr, "%s is not a valid cell budget (cells, 0 for no limit)\n", optarg);
+	    exit(1);
+	 }
+	 break;
+      case 'D':					//store the composited patches only, replay rebuilds the frames
+	 DeltaName = optarg;
+	 break;
+      default:
+	 Usage(argv[0]);
+      }
+   }
+   if (UseSIMD > Mode_SIMD_Level())
+      fprintf(stderr, "warning: requested SIMD kernel not supported on this CPU, falling back\n");
+   if (argc - optind != 4) {
+      Usage(argv[0]);
+   }
+   if (OutName && DeltaName) {
+      fprintf(stderr, "--output and --delta both store the composited frames, use one\n");
+      exit(1);
+   }
+   if (InName && PackName) {
+      fprintf(stderr, "--input and --pack both give the frames, use one\n");
       exit(1);
    }
+   if (InName && (Prefetch || Scale > 1)) {
+      fprintf(stderr, "--prefetch and --scale decode JPEG files, they cannot be used with --input\n");
+      exit(1);
+   }
+   if (Wsize != Hsize || Wsize > 31)		//the roller wheels only handle square windows up to 31
+      UseSAT = TRUE;
+   if (NumThreads > 1)
+      Pool = Create_Workers(NumThreads);
+   if (NumEncoders > 0)
+      Output = Create_Writer(NumEncoders, 2 * NumEncoders + 2);	//two files per frame, so keep a frame ahead
+   argv += optind - 1;				//positional arguments follow the options
    SeqName = argv[1];
    if (sscanf(argv[2], "%d", &Start) != 1 || Start < 0 ||
        sscanf(argv[3], "%d", &End) != 1 || End < Start ||
@@ -70,37 +314,137 @@ int main(int argc, char *argv[]) {
    /* Get information to allocate frame buffers */
    sprintf(cFile, "InSeq/%05d.jpg", Start + 1);
    
+   InCodec = Create_Decoder();
+   Set_Decoder_Scale(InCodec, Scale, FastDecode);
    //Let's get the image row/column information
-   Read_Header(cFile, &width, &height);
+   if (InName) {
+      InStream = Open_Stream(InName, InFormat, InWidth, InHeight);
+      width = InStream->Width;
+      height = InStream->Height;
+   } else if (PackName) {
+      InPack = Open_Pack(PackName);			//One mmap, however long the sequence
+      Pack_Entry *First = Find_Pack_Frame(InPack, Start + 1);
+      if (First == NULL) {
+         fprintf(stderr, "%s does not hold frame %d\n", PackName, Start + 1);
+         exit(1);
+      }
+      width = First->Width;
+      height = First->Height;
+   } else if (!Read_Header(InCodec, cFile, &width, &height))
+      exit(1);
+   if (Scale > 1) {				//Composite from a full resolution decode, process the scaled one
+      fullFB = Alloc_Frame(width, height);
+      width = Scaled_Size(width, Scale);
+      height = Scaled_Size(height, Scale);
+   }
    if(DEBUG){
 	   printf("Image width: %d, Image height: %d\n", width, height);
 	   printf("Results stack width: %d, height: %d\n", width, height*4);
    }
 
    /* Allocate Frame Buffers */
+   Scratch = Create_Frame_Scope();
    rsFB = Alloc_Frame(width, height * 4);				//Results Stack
-   wFB = Alloc_Frame(width, height);					//Working Frame Buffer
-   Read_Header("park.jpg", &width, &height);				// Get the width and heigh
-   woFB = Alloc_Frame(width, height);					//Output Image
+   for (i = 0; i < 4; i++)						//Each stage writes straight into its pane
+      rsPane[i] = View_Frame(rsFB, i * height, height);
+   wFB = rsPane[0];							//Working Frame Buffer, sizes the buffers below
+   if (!Read_Header(InCodec, "park.jpg", &width, &height))		// Get the width and heigh
+      exit(1);
    oFB = Create_Frame("park.jpg");					//Set oFB equal to the park img
+   if (OutName)					//Composited frames are the size of the park image
+      OutStream = Open_Output_Stream(OutName, OutFormat, width, height, InStream ? InStream->Rate : Y4MRATE);
+   if (DeltaName) {				//Composite on one frame, restoring the park under the last patches
+      OutDelta = Create_Delta(DeltaName, oFB);
+      woFB = Duplicate_Frame(oFB);		//Output Image, kept for the whole run
+   }
+   if (AVIName) {				//The results stack, then the composite unless it is streamed
+      int Rate = 30, RateScale = 1;
+      if (InStream)
+         sscanf(InStream->Rate, "%d:%d", &Rate, &RateScale);
+      OutAVI = Create_AVI(AVIName, Rate, RateScale);
+      RSTrack = Add_AVI_Stream(OutAVI, rsFB->Width, rsFB->Height);
+      if (!OutStream && !OutDelta)
+         OutTrack = Add_AVI_Stream(OutAVI, oFB->Width, oFB->Height);
+   }
+   if (UseSAT)
+      SAT = Create_Integral(wFB->Width, wFB->Height);			//Allocated once, rebuilt per frame
+   if (UseMask) {
+      FGMask = (unsigned char *) malloc(wFB->Width * wFB->Height);	//Foreground mask, one byte per pixel
+      if (FGMask == NULL) {
+         fprintf(stderr, "Unable to allocate foreground mask\n");
+         exit(1);
+      }
+   }
+
+   if (Scale > 1) {
+      FullCodec = Create_Decoder();
+      Set_Decoder_Scale(FullCodec, 1, FastDecode);
+   }
+   OutCodec = Create_Encoder(QUALITY);
 
    /* Process Background */
-   FB = Create_Frame(cFile);
-   BGM = Create_Initial_BGM(FB);
+   if (InStream) {
+      FB = Alloc_Frame(InStream->Width, InStream->Height);
+      Keep_Stream_Frames(InStream, TRUE);	//The main loop reads the training frames again
+      if (!Read_Stream(InStream, Start + 1, FB)) {
+         fprintf(stderr, "%s ends before frame %d\n", InName, Start + 1);
+         exit(1);
+      }
+   } else if (InPack) {
+      FB = Alloc_Frame(wFB->Width, wFB->Height);	//The working frame has the decoded size
+      if (FB == NULL || !DecodeFrame(InCodec, Start + 1, FB))
+         exit(1);
+   } else
+      FB = Decode_Frame(InCodec, cFile);
+   if (FB == NULL)
+      exit(1);
+   if (CellBudget && !UseModes && CellBudget < (long) FB->Width * FB->Height) {	//Every pixel keeps at least one cell
+      fprintf(stderr, "--cell-budget %ld is below one cell per pixel (%d)\n", CellBudget, FB->Width * FB->Height);
+      exit(1);
+   }
+   if (!UseModes)				//Cells added beyond this replace the weakest
+      MaxSetCells = MaxModes;
+   if (LoadBGM) {				//A saved model is already trained
+      if (UseModes)
+         MBGM = Restore_Mode_BGM(LoadBGM, &width, &height);
+      else
+         BGM = Restore_BGM(LoadBGM, &width, &height);
+      if (BGM && MaxModes)			//a saved model may hold more cells than allowed now
+         Bound_BGM(BGM, width * height, MaxModes);
+      if (MBGM && MaxModes)			//or more modes
+         Bound_Mode_BGM(MBGM, MaxModes);
+      if (width != FB->Width || height != FB->Height) {
+         fprintf(stderr, "%s holds a %dx%d model, frames are %dx%d\n", LoadBGM, width, height, FB->Width, FB->Height);
+         exit(1);
+      }
+   } else if (UseModes)
+      MBGM = Create_Initial_Mode_BGM(FB, MaxModes ? MaxModes : MAXMODES);
+   else
+      BGM = Create_Initial_BGM(FB);
    
    //Hopefully 3 frames is enough to pick the foreground
    //And hopefully I"m actually supposed to do this...
-   for (N = Start + 1; N <= 3; N += Step) { 
-	   sprintf(cFile, "InSeq/%05d.jpg", N);	//Load the path into cFile
-	   Load_Image(cFile, FB);		//Load the image into FB
+   for (N = Start + 1; N <= 3 && LoadBGM == NULL; N += Step) { 
+	   if (InStream) {
+		   if (!Read_Stream(InStream, N, FB)) {
+			   fprintf(stderr, "%s ends before frame %d\n", InName, N);
+			   exit(1);
+		   }
+	   } else if (!DecodeFrame(InCodec, N, FB))	//Load the image into FB
+		   exit(1);
 
 	   //From examples given in library
-	   Process_Frame_BG(BGM, FB, MCDth, Cth);
-	   if (N % DecRate == 0) {
-		   Decimate_BGM(BGM, Cth, FB->Width * FB->Height);
-	   }
+	   ModelBackground(FB);
+	   ModelDecimate(N);
+   }
+   if (InStream)				//The training frames are read once more, then dropped
+      Keep_Stream_Frames(InStream, FALSE);
+   if (Prefetch)				//decode the main loop frames ahead, into recycled buffers
+      Input = Create_Reader("InSeq/%05d.jpg", InPack, Start + 1, End, Step, FB->Width, FB->Height, Scale, FastDecode, Prefetch, NumDecoders);
+   if (!Input) {				//From here on frames are decoded straight into the results stack
+      Free_Frame(FB);
+      FB = rsPane[0];
    }
-
 
    /* Process Image Results Set */
    for (N = Start + 1; N < End + 1; N += Step) {            // for each frame in sequence
@@ -109,11 +453,18 @@ int main(int argc, char *argv[]) {
 
       if(DEBUG)
     	  printf("\tLoading Original Image...\n");
-      LoadOriginalImage(N);
+      if (!LoadOriginalImage(N))		//The input stream ended
+         break;
 
       if(DEBUG)
     	  printf("\tGrabbing foreground image...\n");
       GrabForegroundImage(N);
+      if (DecMode != DEC_TRAIN)
+         ModelDecimate(N);
+      if (CellBudget && BGM)
+         ModelBudget();
+      if (CompactRate && BGM && ((N - Start - 1) / Step + 1) % CompactRate == 0)
+         Compact_BGM(BGM, FB->Width * FB->Height);	//Each pixel's cells together again, in pixel order
 
       if(DEBUG)
     	  printf("\tGrabbing density map...\n");
@@ -126,71 +477,221 @@ int main(int argc, char *argv[]) {
       //Write out the resulting images
       WriteOutResultsStack(N);
       WriteOutOutputImage(N);
+      Release_Frame_Scope(Scratch);		//Every buffer of this frame goes back to the free list
    }
+   if (SaveBGM) {
+      if (MBGM)
+         Save_Mode_BGM(SaveBGM, MBGM, FB->Width, FB->Height);
+      else
+         Save_BGM(SaveBGM, BGM, FB->Width, FB->Height);
+   }
+   if (Input)
+      Free_Reader(Input);
+   if (InStream)
+      Close_Stream(InStream);
+   if (OutStream)
+      Close_Stream(OutStream);			//Flushes the last frames
+   if (OutDelta)
+      Close_Delta(OutDelta);			//Writes the index
+   if (InPack)
+      Close_Pack(InPack);
+   if (Output)
+      Free_Writer(Output);			//Waits for the last files to be written
+   if (OutAVI && !Close_AVI(OutAVI))		//Writes the index, after the writer is done with it
+      exit(1);
+   Free_Decoder(InCodec);
+   if (FullCodec)
+      Free_Decoder(FullCodec);
+   Free_Encoder(OutCodec);
+   if (Pool)
+      Free_Workers(Pool);			//Joins the worker threads
+   Free_Frame_Scope(Scratch);
    exit(0);
 }
 
 /*
-Load the original image into FB.  Then copy it to the results stack
+Print the command line usage and exit.
 */
 
-void LoadOriginalImage(int N) {
-   char file[128] = {0};
-   sprintf(file, "InSeq/%05d.jpg", N);		//Put the path in file
+void Usage(char *Name) {
+	fprintf(stderr, "usage: %s [--bgm list|soa] [--simd[=sse4|avx2]] [--threads N] [--mask] [--sat] [--window W[xH]] [--decimate full|slice] [--load-bgm file] [--save-bgm file] [--prefetch N] [--decoders N] [--encoders N] [--scale 1|2|4|8] [--fast-decode] [--input y4m:PATH|rgb:WxH:PATH] [--output y4m:PATH|rgb:PATH] [--pack file] [--rs-profile P[:Q]] [--out-profile P[:Q]] [--avi file] [--delta file] [--compact N] [--max-modes N] [--cell-budget N] seqname start end step\n", Name);
+	exit(1);
+}
 
-   //Load the image into FB
-   FB = Create_Frame(file);
+/*
+Run a frame through the background model, replacing it with the predominant background.
+*/
 
-   //Before we finish, let's copy the original image into the top of the results buffer
-   Copy_Image(FB, rsFB, 0); //0 offset for top of the image.
+void ModelBackground(FrmBuf *Frame) {
+	if (MBGM && Pool)
+		Process_Frame_BG_Modes_Threaded(Pool, MBGM, Frame, MCDth, Cth);
+	else if (MBGM)
+		Process_Frame_BG_Modes(MBGM, Frame, MCDth, Cth);
+	else if (Pool)
+		Process_Frame_BG_Threaded(Pool, BGM, Frame, MCDth, Cth);
+	else
+		Process_Frame_BG(BGM, Frame, MCDth, Cth);
+}
+
+/*
+Run a frame through the background model, blacking out the background pixels.
+If a mask is given, the frame is left alone and the foreground mask is written instead.
+*/
 
+void ModelForeground(FrmBuf *Frame, unsigned char *Mask) {
+	if (MBGM && Pool)
+		Process_Frame_FG_Modes_Threaded(Pool, MBGM, Frame, Mask, MCDth, Cth, UseSIMD);
+	else if (MBGM && Mask)
+		Process_Frame_FG_Modes_Mask(MBGM, Frame, Mask, MCDth, Cth, UseSIMD);
+	else if (MBGM && UseSIMD)
+		Process_Frame_FG_Modes_SIMD(MBGM, Frame, MCDth, Cth, UseSIMD);
+	else if (MBGM)
+		Process_Frame_FG_Modes(MBGM, Frame, MCDth, Cth);
+	else if (Pool)
+		Process_Frame_FG_Threaded(Pool, BGM, Frame, Mask, MCDth, Cth);
+	else if (Mask)
+		Process_Frame_FG_Mask(BGM, Frame, Mask, MCDth, Cth);
+	else
+		Process_Frame_FG(BGM, Frame, MCDth, Cth);
 }
 
+/*
+Decimate the background model for frame N. The whole model is decimated every DecRate frames,
+or with --decimate slice, slice N % DecRate of it every frame so the cost is the same on every frame.
+*/
+
+void ModelDecimate(int N) {
+	int Slice = N % DecRate;
+
+	if (DecMode != DEC_SLICE) {
+		if (Slice != 0)
+			return;
+		if (MBGM && Pool)
+			Decimate_Mode_BGM_Threaded(Pool, MBGM, Cth);
+		else if (MBGM)
+			Decimate_Mode_BGM(MBGM, Cth);
+		else if (Pool)
+			Decimate_BGM_Threaded(Pool, BGM, Cth, FB->Width, FB->Height);
+		else
+			Decimate_BGM(BGM, Cth, FB->Width * FB->Height);
+	} else if (MBGM && Pool)
+		Decimate_Mode_BGM_Slice_Threaded(Pool, MBGM, Cth, Slice, DecRate);
+	else if (MBGM)
+		Decimate_Mode_BGM_Slice(MBGM, Cth, Slice, DecRate);
+	else if (Pool)
+		Decimate_BGM_Slice_Threaded(Pool, BGM, Cth, FB->Width, FB->Height, Slice, DecRate);
+	else
+		Decimate_BGM_Slice(BGM, Cth, FB->Width * FB->Height, Slice, DecRate);
+}
+
+//Decimate the whole cell list model until it fits in CellBudget cells
+//Stops early if a pass frees nothing (every pixel is down to its last cell)
+void ModelBudget() {
+	int Freed = 1;
+
+	while (Live_Cells() > CellBudget && Freed > 0) {
+		if (Pool)
+			Freed = Decimate_BGM_Threaded(Pool, BGM, Cth, FB->Width, FB->Height);
+		else
+			Freed = Decimate_BGM(BGM, Cth, FB->Width * FB->Height);
+	}
+}
 
 /*
-Extract the foreground from the image.  Copy this to the results stack.
+Load the original image into FB, the top pane of the results stack.
+With --prefetch, the frame was already decoded by the reader; FB stays valid until the next frame is read.
+With --input, the frame is read from the stream; returns FALSE when the stream has ended.
+*/
+
+int LoadOriginalImage(int N) {
+   //Load the image into FB, which is the top of the results stack
+   if (Input) {
+      FB = Read_Frame(Input, &N);		//Frames come in order, so N is unchanged
+      Copy_Image(FB, rsPane[0], 0);		//The reader recycles its own buffers, so this one is copied
+   } else if (InStream) {
+      if (!Read_Stream(InStream, N, FB))
+         return (FALSE);
+   } else if (!DecodeFrame(InCodec, N, FB))	//Decoded into the same buffer every frame
+      exit(1);
+   return (TRUE);
+}
+
+
+/*
+Extract the foreground from the image, in its pane of the results stack.
 */
 void GrabForegroundImage(int N) {
-	//Copy the original image into the current frame for processing
-	wFB = Duplicate_Frame(FB);
+	wFB = rsPane[1];	//Below the original image
 	
 	//Process the foreground of the image
-	Process_Frame_FG(BGM, wFB, MCDth, Cth);
-
-	Copy_Image(wFB, rsFB, 1); //140 offset for below original image
+	if (FGMask) {
+		ModelForeground(FB, FGMask);	//FB is left as is, only the mask is written
+		Mask_Image(FB, FGMask, wFB);	//Black out the background for the results stack
+	} else {
+		Copy_Image(FB, wFB, 0);	//Copy the original image into the pane for processing
+		ModelForeground(wFB, NULL);
+	}
 }
 
 /*
 Using the extracted foreground, create a density map of the current frame.
-Copy this to the results stack.
+It is painted straight into its pane of the results stack.
 */
 
 void GrabDensityMap(int N) {
-	dFB = Duplicate_Frame(wFB);	//Duplicate foreground-extracted image
-	DensityMap = (int *) malloc(dFB->Width * dFB->Height * sizeof(int)); //Alloc the density map
-	Area_Image_Density(dFB, DensityMap, Wsize);
-	Paint_Frame(dFB, Wsize*Wsize, DensityMap);
-	Copy_Image(dFB, rsFB, 2); //28 for below foreground image
+	dFB = rsPane[2];	//Below the foreground image, every pixel is painted
+	DensityMap = (int *) Scope_Alloc(Scratch, dFB->Width * dFB->Height * sizeof(int)); //Alloc the density map, until the end of the frame
+	if (SAT) {
+		if (FGMask)
+			Build_Integral_Mask(SAT, FGMask);
+		else
+			Build_Integral(SAT, wFB);
+		Integral_Density(SAT, DensityMap, Wsize, Hsize);
+	} else if (FGMask)
+		Area_Mask_Density(FGMask, dFB->Width, dFB->Height, DensityMap, Wsize);
+	else
+		Area_Image_Density_Work(wFB, DensityMap, Wsize, (int *) Scope_Alloc(Scratch, AREAWORK(wFB->Width, Wsize) * sizeof(int)));
+	Paint_Frame(dFB, Wsize*Hsize, DensityMap);
 }
 
 /*
 Annotate the blob bounds and centers of mass from the density map.
-Copy this result to the results stack.
+They are drawn on a copy of the density map in the bottom pane of the results stack.
 */
 
 void GrabBlobAnnotatedMap(int N) {
-	wFB = Duplicate_Frame(dFB);
+	wFB = rsPane[3];	//Below the density map
+	Copy_Image(dFB, wFB, 0);
 	Blobs = Blob_Finder(DensityMap, wFB->Width, wFB->Height, Bth);
 	//Blobs = Blob_Finder_Map(DensityMap, wFB->Width, wFB->Height, Bth);
 	Mark_Blob_CoM(Blobs, wFB);
 	Mark_Blob_BB(Blobs, wFB);
 	Mark_Blob_ID_Map(DensityMap, NumBlobs);
-	Copy_Image(wFB, rsFB, 3); //420 offset for top below density map
 
 	if(DEBUG)
 		Print_Blobs(Blobs);
-		
-	free(DensityMap);	//Let's free it when we're done
+}
+
+/*
+Decode frame N with decoder D into Frame, from InSeq/%05d.jpg or with --pack, from the pack.
+*/
+
+int DecodeFrame(Decoder *D, int N, FrmBuf *Frame) {
+   char file[128] = {0};
+
+   if (InPack)
+      return (Decode_Pack_Frame(D, InPack, N, Frame));
+   sprintf(file, "InSeq/%05d.jpg", N);
+   return (Decode_Image(D, file, Frame));
+}
+
+/*
+With --scale, decode frame N again at full resolution into fullFB, for compositing.
+*/
+
+void LoadFullImage(int N) {
+   if (!DecodeFrame(FullCodec, N, fullFB))
+      exit(1);
 }
 
 /*
@@ -204,55 +705,114 @@ void WriteOutResultsStack(int N) {
 	if(DEBUG)
 		printf("Outputting results to file: %s \n", file);
 
-	Store_Image(file, rsFB);
+	if (OutAVI && Output)
+		Write_AVI_Frame(Output, OutAVI, RSTrack, Duplicate_Frame(rsFB), &RSProfile);
+	else if (OutAVI) {
+		Set_Encoder_Profile(OutCodec, &RSProfile);
+		if (!Store_AVI_Frame(OutAVI, RSTrack, OutCodec, rsFB))
+			exit(1);
+	} else if (Output)
+		Write_Frame(Output, file, Duplicate_Frame(rsFB), &RSProfile);	//rsFB is reused next frame, so hand off a copy
+	else {
+		Set_Encoder_Profile(OutCodec, &RSProfile);
+		if (!Write_Image(OutCodec, file, rsFB))
+			exit(1);
+	}
 }
 
 /*
 Goes through the blobs, checks the pixel coloring of the density map, and copies the appropriate pixels from the original image ot the park.
+With --scale, blobs are found at 1/Scale, so their bounds are scaled back up and the pixels come from a full resolution decode.
 
-Writes out the result once all the blobs have been processed
+Writes out the result once all the blobs have been processed, or with --output, streams it.
 */
 
 void WriteOutOutputImage(int N) {
-	woFB = Duplicate_Frame(oFB);	//Copy the park frame buffer to the working output frame buffer
+	if (OutDelta) {
+		Restore_Delta_Frame(OutDelta, woFB);	//Only the last patches differ from the park
+		Begin_Delta_Frame(OutDelta, N);
+	} else
+		woFB = Duplicate_Frame(oFB);	//Copy the park frame buffer to the working output frame buffer
 	int i,j;
 	Pixel *P;
 	Blob *CurrentBlob = Blobs;
+	FrmBuf *Src = FB;	//Composite source, full resolution
+	int Xmax, Ymax;
 	
 	///Let's go through all the blobs that we found
 	while(CurrentBlob != NULL) {
 	
 		//In order to get rid of some of the blobs and other nuisance objects from
 		//the background, we are going to check if the area is large enough to warrant copying.
-		if(CurrentBlob->Count > 750) { //Arbitary pixel area size
+		if(CurrentBlob->Count * Scale * Scale > 750) { //Arbitary pixel area size, at full resolution
+			if (Src == FB && fullFB) {	//Only decode the full frame when something is composited
+				LoadFullImage(N);
+				Src = fullFB;
+			}
+			Xmax = CurrentBlob->Xmax * Scale;
+			Ymax = CurrentBlob->Ymax * Scale;
+			if (Xmax > Src->Width)	//The scaled frame rounds up
+				Xmax = Src->Width;
+			if (Ymax > Src->Height)
+				Ymax = Src->Height;
 			//Iterate over the x coordinates of the blob
-			for(i = CurrentBlob->Xmin; i < CurrentBlob->Xmax; i++) {
+			for(i = CurrentBlob->Xmin * Scale; i < Xmax; i++) {
 				//And then the y coordinates
-				for (j = CurrentBlob->Ymin; j < CurrentBlob->Ymax; j++) {
+				for (j = CurrentBlob->Ymin * Scale; j < Ymax; j++) {
 					//Grab the current pixel...
-					P = (Pixel *) &(dFB->Frm[(j*dFB->Width+i)*3]);
+					P = (Pixel *) &(dFB->Frm[((j/Scale)*dFB->Width+i/Scale)*3]);
 					//Arbitrary total pixel coloring threshold.  
 					//If the total on the density map is above this threshold,
 					//We copy the pixel from the original image to the output image
 					if(P->R + P->G + P->B > 175) {
-						P = (Pixel *) &(FB->Frm[(j*wFB->Width+i) * 3]);
+						P = (Pixel *) &(Src->Frm[(j*Src->Width+i) * 3]);
 						Mark_Pixel(i, j + 250, *P, woFB);		
 						//Vertical offset by 250 to put in the appropriate 
 						//location in the park image
 					}
 				}
 			}
+			if (OutDelta)	//Mark_Pixel draws a pixel around each one too
+				Add_Delta_Patch(OutDelta, CurrentBlob->Xmin * Scale - 1, CurrentBlob->Ymin * Scale + 250 - 1,
+						Xmax - CurrentBlob->Xmin * Scale + 2, Ymax - CurrentBlob->Ymin * Scale + 2);
 		}
 		CurrentBlob = CurrentBlob->Next; //Go to the next blob
 	}
 
+	if (OutDelta) {
+		End_Delta_Frame(OutDelta, woFB);	//Only the pixels that differ from the park, no encode
+		Free_Blobs(Blobs);
+		return;
+	}
+
+	if (OutStream) {
+		Write_Stream(OutStream, woFB);	//Straight from woFB, no JPEG round trip
+		Scope_Frame(Scratch, woFB);
+		Free_Blobs(Blobs);
+		return;
+	}
+
 	char file[128] = {0}; //Allocate the path variable
 	sprintf(file, "trials/00/out%05d.jpg", N); //Format the path properly
 
 	if(DEBUG)
 		printf("Outputting results to file: %s \n", file);
 
-	Store_Image(file, woFB);	//Write the final output.
+	if (OutAVI && Output)
+		Write_AVI_Frame(Output, OutAVI, OutTrack, woFB, &OutProfile);
+	else if (OutAVI) {
+		Set_Encoder_Profile(OutCodec, &OutProfile);
+		if (!Store_AVI_Frame(OutAVI, OutTrack, OutCodec, woFB))
+			exit(1);
+		Scope_Frame(Scratch, woFB);
+	} else if (Output)
+		Write_Frame(Output, file, woFB, &OutProfile);	//The writer owns woFB now and recycles it
+	else {
+		Set_Encoder_Profile(OutCodec, &OutProfile);
+		if (!Write_Image(OutCodec, file, woFB))	//Write the final output.
+			exit(1);
+		Scope_Frame(Scratch, woFB);	//Recycled with the rest of the frame
+	}
 
 	Free_Blobs(Blobs);	//We're done using the blobs; free them
 }
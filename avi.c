@@ -0,0 +1,491 @@
+/*                     Motion JPEG Files
+
+This library appends JPEG frames of one or more video streams to a
+single Motion JPEG AVI file.
+
+Part of the Virtual Blue-Screen program (P3-1).
+
+Documentation:
+
+An AVI file is created with a frame rate and one or more video
+streams, each with its own frame size (for instance the results stack
+and the composite of a run). Encoded JPEG frames are appended as they
+come, each as a chunk of its stream; frames of different streams may
+be interleaved in any order. The file is written through a large stdio
+buffer, and disk space is preallocated well ahead of the data, so the
+file grows in large contiguous extents. The index and the frame counts
+are written when the file is closed.
+
+The file follows OpenDML (AVI 2.0), so it is not limited to 1 GB: the
+data is split into RIFF segments ("AVI " then "AVIX") of at most
+AVISEGMENT bytes, each with a standard index per stream (ix00, ix01,
+...), found through a super index (indx) in each stream header. The
+first segment also has a legacy idx1 index, so AVI 1.0 players can
+play it. Every frame is a key frame.
+
+Key Usage Functions:
+
+Create_AVI(): Creates an AVI file with a frame rate.
+
+Add_AVI_Stream(): Adds a Motion JPEG video stream of a frame size,
+before the first frame is appended.
+
+Append_AVI_Frame(): Appends an encoded JPEG frame to a stream.
+
+Store_AVI_Frame(): Encodes a frame buffer with an encoder context and
+appends it to a stream, like Store_Image for a single file.
+
+Close_AVI(): Writes the indexes, closes the file and deallocates it.
+
+Example:
+
+   AVI                  *A;
+
+   A = Create_AVI("trials/00/run.avi", 30, 1);
+   Add_AVI_Stream(A, rsFB->Width, rsFB->Height);
+   for (...)
+      if (!Store_AVI_Frame(A, 0, E, rsFB))
+         exit(1);
+   if (!Close_AVI(A))
+      exit(1);
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "utils.h"
+#include "avi.h"
+
+#define                 AVIF_HASINDEX 0x10
+#define                 AVIIF_KEYFRAME 0x10
+#define                 AVI_INDEX_OF_INDEXES 0
+#define                 AVI_INDEX_OF_CHUNKS 1
+
+/*              Put
+
+This routine writes a little endian integer of Bytes bytes. */
+
+static void Put(AVI *A, uint64_t Value, int Bytes) {
+
+   int                  I;
+
+   for (I = 0; I < Bytes; I++)
+      putc((Value >> (8 * I)) & 0xFF, A->FP);
+   A->Pos += Bytes;
+}
+
+/*              Put Tag
+
+This routine writes a four character code. */
+
+static void Put_Tag(AVI *A, char *Tag) {
+
+   fwrite(Tag, 1, 4, A->FP);
+   A->Pos += 4;
+}
+
+/*              Stream Tag
+
+This routine forms the four character code of a stream's chunks, such
+as "00dc" or "ix01", into Tag (five bytes). Streams are numbered
+below AVISTREAMS, so always two digits. */
+
+static void Stream_Tag(char *Tag, char *Kind, unsigned int Stream) {
+
+   if (Kind[0] == 'i')
+      snprintf(Tag, 5, "ix%02u", Stream % 100);
+   else
+      snprintf(Tag, 5, "%02u%.2s", Stream % 100, Kind);
+}
+
+/*              Patch
+
+This routine overwrites a little endian integer already written at
+offset At, and returns to the end of the file. */
+
+static void Patch(AVI *A, int64_t At, uint64_t Value, int Bytes) {
+
+   int64_t              End = A->Pos;
+
+   fseeko(A->FP, At, SEEK_SET);
+   Put(A, Value, Bytes);
+   fseeko(A->FP, End, SEEK_SET);
+   A->Pos = End;
+}
+
+/*              Reserve
+
+This routine makes sure disk space is preallocated past the next Bytes
+bytes, extending the allocation by AVIPREALLOC at a time. Files that
+cannot be preallocated (pipes, some file systems) are written as is. */
+
+static void Reserve(AVI *A, int64_t Bytes) {
+
+   if (A->Pos + Bytes <= A->Allocated)
+      return;
+   if (posix_fallocate(fileno(A->FP), A->Allocated, A->Pos + Bytes + AVIPREALLOC - A->Allocated) == 0)
+      A->Allocated = A->Pos + Bytes + AVIPREALLOC;
+   else
+      A->Allocated = INT64_MAX;                         /* stop trying */
+}
+
+/*              Create AVI
+
+This routine creates a Motion JPEG AVI file playing at Rate / Scale
+frames per second. If the file cannot be created, an error message is
+printed and execution terminates. */
+
+AVI *Create_AVI(char *Name, int Rate, int Scale) {
+
+   AVI                  *A;
+
+   A = (AVI *) calloc(1, sizeof(AVI));
+   if (A == NULL || (A->Name = strdup(Name)) == NULL) {
+      fprintf(stderr, "Unable to allocate AVI file\n");
+      exit(1);
+   }
+   A->FP = fopen(Name, "wb");
+   if (A->FP == NULL) {
+      fprintf(stderr, "ERROR: %s cannot be created\n", Name);
+      exit(1);
+   }
+   setvbuf(A->FP, NULL, _IOFBF, AVIBUF);
+   A->Rate = (Rate > 0) ? Rate : 30;
+   A->Scale = (Scale > 0) ? Scale : 1;
+   return (A);
+}
+
+/*              Add AVI Stream
+
+This routine adds a Motion JPEG video stream of Width x Height frames
+and returns its number. Streams must be added before the first frame
+is appended. If no more streams can be added, an error message is
+printed and execution terminates. */
+
+int Add_AVI_Stream(AVI *A, int Width, int Height) {
+
+   if (A->Started || A->NumStreams == AVISTREAMS) {
+      fprintf(stderr, "ERROR: %s: no more streams can be added\n", A->Name);
+      exit(1);
+   }
+   A->Streams[A->NumStreams].Width = Width;
+   A->Streams[A->NumStreams].Height = Height;
+   return (A->NumStreams++);
+}
+
+/*              Begin Segment
+
+This routine starts a RIFF segment and its movi list. */
+
+static void Begin_Segment(AVI *A) {
+
+   Reserve(A, 24);
+   if (A->Segment > 0) {
+      Put_Tag(A, "RIFF");
+      A->RiffPos = A->Pos;
+      Put(A, 0, 4);
+      Put_Tag(A, "AVIX");
+   }
+   Put_Tag(A, "LIST");
+   Put(A, 0, 4);
+   A->MoviPos = A->Pos;
+   Put_Tag(A, "movi");
+   A->NumEntries = 0;
+}
+
+/*              Write Headers
+
+This routine writes the file header, the stream headers and the first
+RIFF segment's movi list header. Counts and sizes are patched at
+close. */
+
+static void Write_Headers(AVI *A) {
+
+   AVI_Stream           *S;
+   char                 Tag[5];
+   int64_t              Hdrl, Strl, Odml;
+   int                  I;
+
+   A->Started = TRUE;
+   Reserve(A, 4096 + A->NumStreams * (24 + 16 * AVISEGMENTS));
+   Put_Tag(A, "RIFF");
+   A->RiffPos = A->Pos;
+   Put(A, 0, 4);
+   Put_Tag(A, "AVI ");
+   Put_Tag(A, "LIST");
+   Hdrl = A->Pos;
+   Put(A, 0, 4);
+   Put_Tag(A, "hdrl");
+   Put_Tag(A, "avih");
+   Put(A, 56, 4);
+   A->AvihPos = A->Pos;
+   Put(A, (uint64_t) 1000000 * A->Scale / A->Rate, 4);  /* microseconds per frame */
+   Put(A, 0, 4);                                        /* max bytes per second, patched */
+   Put(A, 0, 4);                                        /* padding granularity */
+   Put(A, AVIF_HASINDEX, 4);
+   Put(A, 0, 4);                                        /* frames in the first segment, patched */
+   Put(A, 0, 4);                                        /* initial frames */
+   Put(A, A->NumStreams, 4);
+   Put(A, 0, 4);                                        /* suggested buffer size, patched */
+   Put(A, A->Streams[0].Width, 4);
+   Put(A, A->Streams[0].Height, 4);
+   Put(A, 0, 16);
+   for (I = 0; I < A->NumStreams; I++) {
+      S = &(A->Streams[I]);
+      Put_Tag(A, "LIST");
+      Strl = A->Pos;
+      Put(A, 0, 4);
+      Put_Tag(A, "strl");
+      Put_Tag(A, "strh");
+      Put(A, 56, 4);
+      S->StrhPos = A->Pos;
+      Put_Tag(A, "vids");
+      Put_Tag(A, "MJPG");
+      Put(A, 0, 4);                                     /* flags */
+      Put(A, 0, 2);                                     /* priority */
+      Put(A, 0, 2);                                     /* language */
+      Put(A, 0, 4);                                     /* initial frames */
+      Put(A, A->Scale, 4);
+      Put(A, A->Rate, 4);
+      Put(A, 0, 4);                                     /* start */
+      Put(A, 0, 4);                                     /* length, patched */
+      Put(A, 0, 4);                                     /* suggested buffer size, patched */
+      Put(A, 0xFFFFFFFF, 4);                            /* quality, default */
+      Put(A, 0, 4);                                     /* sample size, varies */
+      Put(A, 0, 2);                                     /* frame rectangle */
+      Put(A, 0, 2);
+      Put(A, S->Width, 2);
+      Put(A, S->Height, 2);
+      Put_Tag(A, "strf");                               /* BITMAPINFOHEADER */
+      Put(A, 40, 4);
+      Put(A, 40, 4);
+      Put(A, S->Width, 4);
+      Put(A, S->Height, 4);
+      Put(A, 1, 2);                                     /* planes */
+      Put(A, 24, 2);                                    /* bits per pixel */
+      Put_Tag(A, "MJPG");
+      Put(A, 3 * S->Width * S->Height, 4);
+      Put(A, 0, 16);
+      Put_Tag(A, "indx");                               /* super index, patched */
+      Put(A, 24 + 16 * AVISEGMENTS, 4);
+      S->IndxPos = A->Pos;
+      Put(A, 4, 2);                                     /* longs per entry */
+      Put(A, 0, 1);
+      Put(A, AVI_INDEX_OF_INDEXES, 1);
+      Put(A, 0, 4);                                     /* entries in use, patched */
+      Stream_Tag(Tag, "dc", I);
+      Put_Tag(A, Tag);
+      Put(A, 0, 12);
+      Put(A, 0, 16 * AVISEGMENTS);
+      Patch(A, Strl, A->Pos - Strl - 4, 4);
+   }
+   Put_Tag(A, "LIST");
+   Odml = A->Pos;
+   Put(A, 0, 4);
+   Put_Tag(A, "odml");
+   Put_Tag(A, "dmlh");
+   Put(A, 248, 4);
+   A->DmlhPos = A->Pos;
+   Put(A, 0, 248);                                      /* total frames, patched */
+   Patch(A, Odml, A->Pos - Odml - 4, 4);
+   Patch(A, Hdrl, A->Pos - Hdrl - 4, 4);
+   Begin_Segment(A);
+}
+
+/*              End Segment
+
+This routine closes the current RIFF segment: it writes a standard
+index per stream at the end of the movi list (and the legacy idx1
+index after the first one), then patches the list and segment sizes.
+It returns FALSE if the super index is full. */
+
+static int End_Segment(AVI *A) {
+
+   AVI_Stream           *S;
+   AVI_Entry            *E;
+   char                 Tag[5];
+   int64_t              Pos;
+   int                  I, K, N;
+
+   for (I = 0; I < A->NumStreams; I++) {
+      S = &(A->Streams[I]);
+      for (N = K = 0; K < A->NumEntries; K++)
+         N += (A->Entries[K].Stream == I);
+      if (N == 0)
+         continue;
+      if (S->NumIndexes == AVISEGMENTS) {
+         fprintf(stderr, "ERROR: %s: too many segments\n", A->Name);
+         return (FALSE);
+      }
+      Reserve(A, 32 + 8 * N);
+      Pos = A->Pos;
+      Stream_Tag(Tag, "ix", I);
+      Put_Tag(A, Tag);
+      Put(A, 24 + 8 * N, 4);
+      Put(A, 2, 2);                                     /* longs per entry */
+      Put(A, 0, 1);
+      Put(A, AVI_INDEX_OF_CHUNKS, 1);
+      Put(A, N, 4);
+      Stream_Tag(Tag, "dc", I);
+      Put_Tag(A, Tag);
+      Put(A, A->MoviPos, 8);                            /* base offset */
+      Put(A, 0, 4);
+      for (K = 0; K < A->NumEntries; K++) {
+         E = &(A->Entries[K]);
+         if (E->Stream != I)
+            continue;
+         Put(A, E->Pos + 8 - A->MoviPos, 4);            /* frame data, from the base */
+         Put(A, E->Size, 4);                            /* key frame: top bit clear */
+      }
+      S->Indexes[S->NumIndexes].Pos = Pos;
+      S->Indexes[S->NumIndexes].Size = A->Pos - Pos;
+      S->Indexes[S->NumIndexes].Frames = N;
+      S->NumIndexes += 1;
+   }
+   Patch(A, A->MoviPos - 4, A->Pos - A->MoviPos, 4);
+   if (A->Segment == 0) {
+      Reserve(A, 8 + 16 * A->NumEntries);
+      Put_Tag(A, "idx1");
+      Put(A, 16 * A->NumEntries, 4);
+      for (K = 0; K < A->NumEntries; K++) {
+         E = &(A->Entries[K]);
+         Stream_Tag(Tag, "dc", E->Stream);
+         Put_Tag(A, Tag);
+         Put(A, AVIIF_KEYFRAME, 4);
+         Put(A, E->Pos - A->MoviPos, 4);                /* chunk header, from 'movi' */
+         Put(A, E->Size, 4);
+         A->FirstFrames += (E->Stream == 0);
+      }
+   }
+   Patch(A, A->RiffPos, A->Pos - A->RiffPos - 4, 4);
+   A->Segment += 1;
+   A->NumEntries = 0;
+   return (TRUE);
+}
+
+/*              Append AVI Frame
+
+This routine appends Size bytes of an encoded JPEG frame to a stream,
+starting a new RIFF segment when the current one is full. It returns
+TRUE, or on error, prints a message and returns FALSE. */
+
+int Append_AVI_Frame(AVI *A, int Stream, unsigned char *Data, uint32_t Size) {
+
+   AVI_Stream           *S = &(A->Streams[Stream]);
+   char                 Tag[5];
+   int64_t              Need;
+
+   if (!A->Started)
+      Write_Headers(A);
+   Need = 8 + Size + (Size & 1) + 24 * (A->NumEntries + 1) + 32 * A->NumStreams;   /* with its index entries */
+   if (A->NumEntries > 0 && A->Pos - A->RiffPos + Need > AVISEGMENT) {
+      if (!End_Segment(A))
+         return (FALSE);
+      Begin_Segment(A);
+   }
+   if (A->NumEntries == A->MaxEntries) {
+      A->MaxEntries = A->MaxEntries ? 2 * A->MaxEntries : 1024;
+      A->Entries = (AVI_Entry *) realloc(A->Entries, A->MaxEntries * sizeof(AVI_Entry));
+      if (A->Entries == NULL) {
+         fprintf(stderr, "Unable to allocate AVI index\n");
+         exit(1);
+      }
+   }
+   Reserve(A, 8 + Size + 1);
+   A->Entries[A->NumEntries].Pos = A->Pos;
+   A->Entries[A->NumEntries].Size = Size;
+   A->Entries[A->NumEntries].Stream = Stream;
+   A->NumEntries += 1;
+   Stream_Tag(Tag, "dc", Stream);
+   Put_Tag(A, Tag);
+   Put(A, Size, 4);
+   if (fwrite(Data, 1, Size, A->FP) != Size) {
+      fprintf(stderr, "can't write %s\n", A->Name);
+      return (FALSE);
+   }
+   A->Pos += Size;
+   if (Size & 1)
+      Put(A, 0, 1);                                     /* chunks are word aligned */
+   S->Frames += 1;
+   if (Size > S->MaxSize)
+      S->MaxSize = Size;
+   return (TRUE);
+}
+
+/*              Store AVI Frame
+
+This routine encodes a frame buffer as a JPEG image with an encoder
+context and appends it to a stream. It returns TRUE, or on error,
+prints a message and returns FALSE. */
+
+int Store_AVI_Frame(AVI *A, int Stream, Encoder *E, FrmBuf *FB) {
+
+   FILE                 *FP;
+   char                 *Data = NULL;
+   size_t               Size = 0;
+   int                  OK = FALSE;
+
+   FP = open_memstream(&Data, &Size);
+   if (FP == NULL) {
+      fprintf(stderr, "can't write %s\n", A->Name);
+      return (FALSE);
+   }
+   if (Encode_Image(E, FP, FB)) {
+      fclose(FP);
+      OK = Append_AVI_Frame(A, Stream, (unsigned char *) Data, Size);
+   } else
+      fclose(FP);
+   free(Data);
+   return (OK);
+}
+
+/*              Close AVI
+
+This routine ends the last segment, patches the frame counts, sizes
+and super indexes into the headers, closes the file and deallocates
+it. It returns TRUE, or on error, prints a message and returns
+FALSE. */
+
+int Close_AVI(AVI *A) {
+
+   AVI_Stream           *S;
+   uint32_t             MaxSize = 0;
+   int                  I, K, OK;
+
+   if (!A->Started)
+      Write_Headers(A);
+   OK = End_Segment(A);
+   for (I = 0; I < A->NumStreams; I++) {
+      S = &(A->Streams[I]);
+      if (S->MaxSize > MaxSize)
+         MaxSize = S->MaxSize;
+      Patch(A, S->StrhPos + 32, S->Frames, 4);
+      Patch(A, S->StrhPos + 36, S->MaxSize + 8, 4);
+      Patch(A, S->IndxPos + 4, S->NumIndexes, 4);
+      for (K = 0; K < S->NumIndexes; K++) {
+         Patch(A, S->IndxPos + 24 + 16 * K, S->Indexes[K].Pos, 8);
+         Patch(A, S->IndxPos + 32 + 16 * K, S->Indexes[K].Size, 4);
+         Patch(A, S->IndxPos + 36 + 16 * K, S->Indexes[K].Frames, 4);
+      }
+   }
+   Patch(A, A->AvihPos + 4, (uint64_t) MaxSize * A->NumStreams * A->Rate / A->Scale, 4);
+   Patch(A, A->AvihPos + 16, A->FirstFrames, 4);
+   Patch(A, A->AvihPos + 28, MaxSize + 8, 4);
+   Patch(A, A->DmlhPos, A->Streams[0].Frames, 4);
+   if (fflush(A->FP) != 0 || ferror(A->FP))
+      OK = FALSE;
+   if (A->Allocated > A->Pos && A->Allocated != INT64_MAX && ftruncate(fileno(A->FP), A->Pos) != 0)
+      OK = FALSE;                                       /* drop the preallocated tail */
+   if (fclose(A->FP) != 0)
+      OK = FALSE;
+   if (!OK)
+      fprintf(stderr, "can't write %s\n", A->Name);
+   free(A->Entries);
+   free(A->Name);
+   free(A);
+   return (OK);
+}
@@ -0,0 +1,54 @@
+/*                     Motion JPEG Files
+
+This library appends JPEG frames of one or more video streams to a
+single Motion JPEG AVI file.
+
+Part of the Virtual Blue-Screen program (P3-1).               */
+
+#include <stdint.h>
+
+#define                 AVISTREAMS 4
+#define                 AVISEGMENTS 256           /* RIFF segments, so up to 256 GB */
+#define                 AVISEGMENT (1 << 30)      /* RIFF segment size limit */
+#define                 AVIPREALLOC (64 << 20)    /* disk space is preallocated this far ahead */
+#define                 AVIBUF (4 << 20)          /* stdio buffer size */
+
+typedef struct          AVI_Entry {
+   int64_t              Pos;                      /* chunk header, from the start of the file */
+   uint32_t             Size;                     /* JPEG bytes */
+   int                  Stream;
+}  AVI_Entry;
+
+typedef struct          AVI_Index {
+   int64_t              Pos;                      /* ix## chunk of a RIFF segment */
+   uint32_t             Size, Frames;
+}  AVI_Index;
+
+typedef struct          AVI_Stream {
+   int                  Width, Height;
+   int                  Frames;
+   uint32_t             MaxSize;                  /* largest frame */
+   int64_t              StrhPos, IndxPos;         /* headers patched at close */
+   int                  NumIndexes;
+   AVI_Index            Indexes[AVISEGMENTS];     /* one per RIFF segment (OpenDML super index) */
+}  AVI_Stream;
+
+typedef struct          AVI {
+   FILE                 *FP;
+   char                 *Name;
+   int                  Rate, Scale;              /* Rate / Scale frames per second */
+   int                  NumStreams, Started;
+   AVI_Stream           Streams[AVISTREAMS];
+   int64_t              Pos, Allocated;           /* bytes written, preallocated */
+   int64_t              RiffPos, MoviPos;         /* current segment's RIFF size, 'movi' tag */
+   int64_t              AvihPos, DmlhPos;
+   int                  Segment, FirstFrames;     /* segment number, frames in the first */
+   AVI_Entry            *Entries;                 /* frames of the current segment */
+   int                  NumEntries, MaxEntries;
+}  AVI;
+
+extern AVI *Create_AVI(char *Name, int Rate, int Scale);
+extern int Add_AVI_Stream(AVI *A, int Width, int Height);
+extern int Append_AVI_Frame(AVI *A, int Stream, unsigned char *Data, uint32_t Size);
+extern int Store_AVI_Frame(AVI *A, int Stream, Encoder *E, FrmBuf *FB);
+extern int Close_AVI(AVI *A);
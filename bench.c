@@ -0,0 +1,662 @@
+/*                  Library Benchmarks
+
+This program times library routines on synthetic frames, comparing
+each against the implementation it replaced. Results are checked for
+equality before timings are reported.
+
+Part of the Virtual Blue-Screen program (P3-1).
+
+Usage: bench [reps]
+
+Reps sets the number of timed repetitions per measurement (default
+10); the best repetition is reported.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "utils.h"
+#include "rollers.h"
+#include "workers.h"
+#include "mmm.h"
+#include "stream.h"
+
+#define                 DEFAULTREPS 10
+#define                 MATCHFRAMES 16          // frames per matching pass
+#define                 MATCHMODES 3            // colors per synthetic pixel
+#define                 MATCHEPS 33             // matching epsilon (as in P3-1)
+#define                 MATCHCTH 4              // cell threshold (as in P3-1)
+#define                 LONGFRAMES 4000         // frames per long run
+#define                 LONGDECRATE 2           // decimation rate of long runs (as in P3-1)
+#define                 LONGCHURN 200           // one palette color in LONGCHURN changes per frame
+#define                 LONGWINDOW 500          // frames timed at the start and end of a long run
+#define                 STREAMFRAMES 3000       // frames per stream run
+#define                 STREAMTRAIN 3           // frames read twice, as P3-1 trains on them
+#define                 STREAMWARMUP 100        // frames read before resident memory is taken
+
+/*              Timer
+
+This routine returns a monotonic time stamp in seconds. */
+
+static double Timer() {
+   struct timespec      TS;
+
+   clock_gettime(CLOCK_MONOTONIC, &TS);
+   return (TS.tv_sec + TS.tv_nsec * 1e-9);
+}
+
+/*              Random Foreground
+
+This routine fills a frame with random salient pixels on a blackened
+background; about one pixel in Ratio is salient. */
+
+static void Random_Foreground(FrmBuf *FB, int Ratio) {
+   int                  I;
+
+   for (I = 0; I < FB->Width * FB->Height; I++)
+      if (rand() % Ratio == 0) {
+         FB->Frm[3*I] = rand() & 255;
+         FB->Frm[3*I+1] = rand() & 255;
+         FB->Frm[3*I+2] = 1 | rand();
+      } else
+         FB->Frm[3*I] = FB->Frm[3*I+1] = FB->Frm[3*I+2] = 0;
+}
+
+/**********************************************************************
+                        Area Density
+
+Area_Image_Density scan order: column major (the original routine,
+kept here for reference) against row major.
+***********************************************************************/
+
+/*              Area Image Density Columns
+
+This is the original column major Area_Image_Density, except that the
+per row arrays cover the rows flushed past the bottom of the frame. */
+
+static void Area_Image_Density_Columns(FrmBuf *FB, int *DensityMap, int WheelSize) {
+
+   int                   *Wheels, *Sums;
+   int                   Vwheel[WheelSize];
+   int                   Vsum, Vptr, HalfWheel, WheelOff, X, Y, I, Edge;
+
+   Edge = 1 << (int) (WheelSize - 1);
+   HalfWheel = WheelSize >> 1;
+   WheelOff = HalfWheel * (FB->Width + 1);
+   Wheels = (int *) calloc(FB->Height + HalfWheel, sizeof(int));
+   Sums = (int *) calloc(FB->Height + HalfWheel, sizeof(int));
+   if (Wheels == NULL || Sums == NULL) {
+      fprintf(stderr, "ERROR: density buffers cannot be allocated\n");
+      exit(1);
+   }
+   for (X = 0; X < FB->Width + HalfWheel; X++) {
+      for (Vptr = 0; Vptr < WheelSize; Vptr++)
+         Vwheel[Vptr] = 0;
+      Vsum = Vptr = 0;
+      for (Y = 0; Y < FB->Height + HalfWheel; Y++) {
+	 I = X + Y * FB->Width;
+         Sums[Y] -= Wheels[Y] & 1;
+         Wheels[Y] >>= 1;
+         Vsum -= Vwheel[Vptr];
+         if (Y < FB->Height) {
+	    if (X < FB->Width )
+               if (FB->Frm[3*I] | FB->Frm[3*I+1] | FB->Frm[3*I+2]) {
+	          Sums[Y] += 1;
+	          Wheels[Y] |= Edge;
+               }
+            Vwheel[Vptr] = Sums[Y];
+            Vsum += Sums[Y];
+         }
+         Vptr = (Vptr + 1) % WheelSize;
+         if (X >= HalfWheel && Y >= HalfWheel)
+	    DensityMap[I - WheelOff] = Vsum;
+      }
+   }
+   free(Wheels);
+   free(Sums);
+}
+
+/*              Bench Area Density
+
+This routine times both scan orders on a random frame of the given
+size and prints the best time per frame and the speedup. */
+
+static void Bench_Area_Density(int Width, int Height, int WheelSize, int Reps) {
+   FrmBuf               *FB;
+   int                  *Old, *New;
+   double               T, Best[2] = {1e30, 1e30};
+   int                  I, R;
+
+   FB = Alloc_Frame(Width, Height);
+   Old = (int *) malloc(Width * Height * sizeof(int));
+   New = (int *) malloc(Width * Height * sizeof(int));
+   if (FB == NULL || Old == NULL || New == NULL) {
+      fprintf(stderr, "ERROR: benchmark buffers cannot be allocated\n");
+      exit(1);
+   }
+   Random_Foreground(FB, 4);
+   for (R = 0; R < Reps; R++) {
+      T = Timer();
+      Area_Image_Density_Columns(FB, Old, WheelSize);
+      T = Timer() - T;
+      if (T < Best[0])
+         Best[0] = T;
+      T = Timer();
+      Area_Image_Density(FB, New, WheelSize);
+      T = Timer() - T;
+      if (T < Best[1])
+         Best[1] = T;
+   }
+   for (I = 0; I < Width * Height; I++)
+      if (Old[I] != New[I]) {
+         fprintf(stderr, "ERROR: area density mismatch at %dx%d pixel %d\n", Width, Height, I);
+         exit(1);
+      }
+   printf("   %4dx%-4d  column major %9.3f ms   row major %9.3f ms   speedup %5.2fx\n",
+          Width, Height, Best[0] * 1e3, Best[1] * 1e3, Best[0] / Best[1]);
+   free(Old);
+   free(New);
+   Free_Frame(FB);
+}
+
+/**********************************************************************
+                        Matching
+
+Ratiometric matching: dividing each sum by its count on every compare
+(the original routines, kept here for reference) against comparing
+cached means (cell lists) or the division-free MODE_NEAR multiply
+test (mode arrays).
+***********************************************************************/
+
+/*              Ratio Match Pixel Divide
+
+This is the original Ratio_Match_Pixel, which divides on every
+compare. Cached means are left stale; only sums and counts are
+compared. */
+
+static Cell *Ratio_Match_Pixel_Divide(Pixel *P, Cell *Cells, int Epsilon) {
+
+   Cell                *ThisCell;
+
+   for (ThisCell = Cells; ThisCell != NULL; ThisCell = ThisCell->Next)
+      if (abs(P->R - ThisCell->R / ThisCell->Count) <= Epsilon &&
+          abs(P->G - ThisCell->G / ThisCell->Count) <= Epsilon &&
+          abs(P->B - ThisCell->B / ThisCell->Count) <= Epsilon) {
+         ThisCell->R += P->R;
+         ThisCell->G += P->G;
+         ThisCell->B += P->B;
+         ThisCell->Count += 1;
+         return(ThisCell);
+      }
+   return(NULL);
+}
+
+/*              Ratio Match Mode Divide
+
+This is the original Ratio_Match_Mode, which divides on every
+compare. */
+
+static int Ratio_Match_Mode_Divide(ModeBGM *BGM, int I, Pixel *P, int Epsilon) {
+
+   int                  M, J = I;
+
+   for (M = 0; M < BGM->Modes[I]; M++, J += MODE_STRIDE(BGM))
+      if (abs(P->R - MODE_R(BGM, J) / MODE_COUNT(BGM, J)) <= Epsilon &&
+          abs(P->G - MODE_G(BGM, J) / MODE_COUNT(BGM, J)) <= Epsilon &&
+          abs(P->B - MODE_B(BGM, J) / MODE_COUNT(BGM, J)) <= Epsilon) {
+         MODE_R(BGM, J) += P->R;
+         MODE_G(BGM, J) += P->G;
+         MODE_B(BGM, J) += P->B;
+         MODE_COUNT(BGM, J) += 1;
+         return (J);
+      }
+   return (-1);
+}
+
+/*              Random Modal Frames
+
+This routine fills a sequence of frames whose pixels each flicker
+between MATCHMODES random colors, with a little noise, so that every
+pixel carries several modes and most compares miss before one hits. */
+
+static void Random_Modal_Frames(FrmBuf **Seq, int NumFrames) {
+   unsigned char        *Palette;
+   int                  NumBytes = 3 * Seq[0]->Width * Seq[0]->Height;
+   int                  F, I, C, V;
+
+   Palette = (unsigned char *) malloc(NumBytes * MATCHMODES);
+   if (Palette == NULL) {
+      fprintf(stderr, "ERROR: benchmark buffers cannot be allocated\n");
+      exit(1);
+   }
+   for (I = 0; I < NumBytes * MATCHMODES; I++)
+      Palette[I] = rand() & 255;
+   for (F = 0; F < NumFrames; F++)
+      for (I = 0; I < NumBytes; I += 3) {
+         C = NumBytes * (rand() % MATCHMODES);
+         for (V = 0; V < 3; V++) {
+            Seq[F]->Frm[I+V] = Palette[C+I+V];
+            if (Palette[C+I+V] > 4 && Palette[C+I+V] < 251)
+               Seq[F]->Frm[I+V] += rand() % 9 - 4;
+         }
+      }
+   free(Palette);
+}
+
+/*              Bench Match
+
+This routine times one matching pass over a synthetic sequence with
+each matcher, for both the cell list and the mode array models, and
+prints the best time per frame and the speedup. Each matcher updates
+its own model, trained alike, and the models are compared afterwards. */
+
+static void Bench_Match(int Width, int Height, int Reps) {
+   FrmBuf               *Seq[MATCHFRAMES];
+   Cell                 **Old, **New, *OldCell, *NewCell;
+   ModeBGM              *OldModes, *NewModes;
+   Pixel                *P;
+   double               T, Best[4] = {1e30, 1e30, 1e30, 1e30};
+   int                  NumSets = Width * Height, F, I, J, R;
+
+   for (F = 0; F < MATCHFRAMES; F++)
+      if ((Seq[F] = Alloc_Frame(Width, Height)) == NULL) {
+         fprintf(stderr, "ERROR: benchmark buffers cannot be allocated\n");
+         exit(1);
+      }
+   Random_Modal_Frames(Seq, MATCHFRAMES);
+   Old = Create_Initial_BGM(Seq[0]);
+   New = Create_Initial_BGM(Seq[0]);
+   OldModes = Create_Initial_Mode_BGM(Seq[0], MAXMODES);
+   NewModes = Create_Initial_Mode_BGM(Seq[0], MAXMODES);
+   for (R = 0; R <= Reps; R++) {                                 /* pass 0 trains, untimed */
+      T = Timer();
+      for (F = 0; F < MATCHFRAMES; F++)
+         for (I = 0; I < NumSets; I++) {
+            P = (Pixel *) &(Seq[F]->Frm[3*I]);
+            if (Ratio_Match_Pixel_Divide(P, Old[I], MATCHEPS) == NULL)
+               Add_Cell(P, Old[I], MATCHCTH);
+         }
+      T = Timer() - T;
+      if (R && T < Best[0])
+         Best[0] = T;
+      T = Timer();
+      for (F = 0; F < MATCHFRAMES; F++)
+         for (I = 0; I < NumSets; I++) {
+            P = (Pixel *) &(Seq[F]->Frm[3*I]);
+            if (Ratio_Match_Pixel(P, New[I], MATCHEPS) == NULL)
+               Add_Cell(P, New[I], MATCHCTH);
+         }
+      T = Timer() - T;
+      if (R && T < Best[1])
+         Best[1] = T;
+      T = Timer();
+      for (F = 0; F < MATCHFRAMES; F++)
+         for (I = 0; I < NumSets; I++) {
+            P = (Pixel *) &(Seq[F]->Frm[3*I]);
+            if (Ratio_Match_Mode_Divide(OldModes, I, P, MATCHEPS) < 0)
+               Add_Mode(OldModes, I, P, MATCHCTH);
+         }
+      T = Timer() - T;
+      if (R && T < Best[2])
+         Best[2] = T;
+      T = Timer();
+      for (F = 0; F < MATCHFRAMES; F++)
+         for (I = 0; I < NumSets; I++) {
+            P = (Pixel *) &(Seq[F]->Frm[3*I]);
+            if (Ratio_Match_Mode(NewModes, I, P, MATCHEPS) < 0)
+               Add_Mode(NewModes, I, P, MATCHCTH);
+         }
+      T = Timer() - T;
+      if (R && T < Best[3])
+         Best[3] = T;
+   }
+   for (I = 0; I < NumSets; I++) {
+      for (OldCell = Old[I], NewCell = New[I]; OldCell && NewCell; OldCell = OldCell->Next, NewCell = NewCell->Next)
+         if (OldCell->R != NewCell->R || OldCell->G != NewCell->G || OldCell->B != NewCell->B ||
+             OldCell->Count != NewCell->Count)
+            break;
+      if (OldCell || NewCell) {
+         fprintf(stderr, "ERROR: cell list mismatch at %dx%d set %d\n", Width, Height, I);
+         exit(1);
+      }
+      if (OldModes->Modes[I] != NewModes->Modes[I]) {
+         fprintf(stderr, "ERROR: mode array mismatch at %dx%d set %d\n", Width, Height, I);
+         exit(1);
+      }
+      for (F = 0, J = I; F < NewModes->Modes[I]; F++, J += MODE_STRIDE(NewModes))
+         if (MODE_R(OldModes, J) != MODE_R(NewModes, J) || MODE_G(OldModes, J) != MODE_G(NewModes, J) ||
+             MODE_B(OldModes, J) != MODE_B(NewModes, J) || MODE_COUNT(OldModes, J) != MODE_COUNT(NewModes, J)) {
+            fprintf(stderr, "ERROR: mode array mismatch at %dx%d set %d\n", Width, Height, I);
+            exit(1);
+         }
+   }
+   printf("   %4dx%-4d  cell list  divide %9.3f ms   cached %9.3f ms   speedup %5.2fx\n",
+          Width, Height, Best[0] * 1e3 / MATCHFRAMES, Best[1] * 1e3 / MATCHFRAMES, Best[0] / Best[1]);
+   printf("   %4dx%-4d  mode array divide %9.3f ms   multiply %7.3f ms   speedup %5.2fx\n",
+          Width, Height, Best[2] * 1e3 / MATCHFRAMES, Best[3] * 1e3 / MATCHFRAMES, Best[2] / Best[3]);
+   for (I = 0; I < NumSets; I++) {
+      while (Old[I] != NULL)
+         Old[I] = Free_Cell(Old[I]);
+      while (New[I] != NULL)
+         New[I] = Free_Cell(New[I]);
+   }
+   free(Old);
+   free(New);
+   Free_Mode_BGM(OldModes);
+   Free_Mode_BGM(NewModes);
+   for (F = 0; F < MATCHFRAMES; F++)
+      Free_Frame(Seq[F]);
+}
+
+/*              Bench Models
+
+This routine times foreground extraction over a synthetic sequence
+with the cell list model, the mode array model and its vectorized
+kernel, and prints the best pass time per frame of each. Every model
+is trained alike and decimated after each pass, and the foreground
+frames of the three are compared as they are made. */
+
+static void Bench_Models(int Width, int Height, int Reps) {
+   FrmBuf               *Seq[MATCHFRAMES], *Out[3];
+   Cell                 **List;
+   ModeBGM              *Modes, *Vector;
+   double               T, Pass[3], Best[3] = {1e30, 1e30, 1e30};
+   int                  NumSets = Width * Height, Level = Mode_SIMD_Level(), F, I, R;
+
+   for (F = 0; F < MATCHFRAMES; F++)
+      if ((Seq[F] = Alloc_Frame(Width, Height)) == NULL) {
+         fprintf(stderr, "ERROR: benchmark buffers cannot be allocated\n");
+         exit(1);
+      }
+   for (I = 0; I < 3; I++)
+      if ((Out[I] = Alloc_Frame(Width, Height)) == NULL) {
+         fprintf(stderr, "ERROR: benchmark buffers cannot be allocated\n");
+         exit(1);
+      }
+   Random_Modal_Frames(Seq, MATCHFRAMES);
+   List = Create_Initial_BGM(Seq[0]);
+   Modes = Create_Initial_Mode_BGM(Seq[0], MAXMODES);
+   Vector = Create_Initial_Mode_BGM(Seq[0], MAXMODES);
+   for (R = 0; R <= Reps; R++) {                                 /* pass 0 trains, untimed */
+      Pass[0] = Pass[1] = Pass[2] = 0;
+      for (F = 0; F < MATCHFRAMES; F++) {
+         for (I = 0; I < 3; I++)
+            memcpy(Out[I]->Frm, Seq[F]->Frm, 3 * NumSets);
+         T = Timer();
+         Process_Frame_FG(List, Out[0], MATCHEPS, MATCHCTH);
+         Pass[0] += Timer() - T;
+         T = Timer();
+         Process_Frame_FG_Modes(Modes, Out[1], MATCHEPS, MATCHCTH);
+         Pass[1] += Timer() - T;
+         T = Timer();
+         Process_Frame_FG_Modes_SIMD(Vector, Out[2], MATCHEPS, MATCHCTH, Level);
+         Pass[2] += Timer() - T;
+         if (memcmp(Out[0]->Frm, Out[1]->Frm, 3 * NumSets) || memcmp(Out[0]->Frm, Out[2]->Frm, 3 * NumSets)) {
+            fprintf(stderr, "ERROR: foreground mismatch at %dx%d frame %d\n", Width, Height, F);
+            exit(1);
+         }
+      }
+      for (I = 0; I < 3; I++)
+         if (R && Pass[I] < Best[I])
+            Best[I] = Pass[I];
+      Decimate_BGM(List, MATCHCTH, NumSets);
+      Decimate_Mode_BGM(Modes, MATCHCTH);
+      Decimate_Mode_BGM(Vector, MATCHCTH);
+   }
+   printf("   %4dx%-4d  cell list %9.3f ms   mode array %9.3f ms   vectorized %9.3f ms\n",
+          Width, Height, Best[0] * 1e3 / MATCHFRAMES, Best[1] * 1e3 / MATCHFRAMES, Best[2] * 1e3 / MATCHFRAMES);
+   for (I = 0; I < NumSets; I++)
+      while (List[I] != NULL)
+         List[I] = Free_Cell(List[I]);
+   free(List);
+   Free_Mode_BGM(Modes);
+   Free_Mode_BGM(Vector);
+   for (I = 0; I < 3; I++)
+      Free_Frame(Out[I]);
+   for (F = 0; F < MATCHFRAMES; F++)
+      Free_Frame(Seq[F]);
+}
+
+/**********************************************************************
+                        Cell Compaction
+
+Long runs with the cell list model: pixels flicker between palette
+colors that slowly change, so cells keep dying in decimation and
+being reallocated from the LIFO free list, scattering each pixel's
+cells over the heap. The same run is made without and with periodic
+Compact_BGM, and the matching time per frame is compared at the start
+and at the end of the run.
+***********************************************************************/
+
+/*              Long Run
+
+This routine runs the cell list model over Frames synthetic frames,
+compacting every CompactRate frames (0 for never), and returns the
+mean Process_Frame_FG time per frame over the first and last
+LONGWINDOW frames, the total compaction time and a checksum of the
+final model. The synthetic sequence depends only on Seed. */
+
+static void Long_Run(int Width, int Height, int Frames, int CompactRate, unsigned int Seed,
+                     double *First, double *Last, double *Compact, unsigned long long *Sum) {
+   FrmBuf               *FB;
+   Cell                 **BGM, *ThisCell;
+   unsigned char        *Palette;
+   int                  NumSets = Width * Height, NumBytes = 3 * NumSets, F, I, C;
+   double               T;
+
+   srand(Seed);
+   FB = Alloc_Frame(Width, Height);
+   Palette = (unsigned char *) malloc(NumBytes * MATCHMODES);
+   if (FB == NULL || Palette == NULL) {
+      fprintf(stderr, "ERROR: benchmark buffers cannot be allocated\n");
+      exit(1);
+   }
+   for (I = 0; I < NumBytes * MATCHMODES; I++)
+      Palette[I] = rand() & 255;
+   memcpy(FB->Frm, Palette, NumBytes);
+   BGM = Create_Initial_BGM(FB);
+   Compact_BGM(BGM, NumSets);                                   /* both runs start from fresh memory */
+   *First = *Last = *Compact = 0;
+   for (F = 0; F < Frames; F++) {
+      for (I = 0; I < NumSets / LONGCHURN; I++) {
+         C = 3 * (rand() % (NumSets * MATCHMODES));
+         Palette[C] = rand() & 255;
+         Palette[C+1] = rand() & 255;
+         Palette[C+2] = rand() & 255;
+      }
+      for (I = 0; I < NumBytes; I += 3)
+         memcpy(&(FB->Frm[I]), &(Palette[NumBytes * (rand() % MATCHMODES) + I]), 3);
+      T = Timer();
+      Process_Frame_FG(BGM, FB, MATCHEPS, MATCHCTH);
+      T = Timer() - T;
+      if (F < LONGWINDOW)
+         *First += T;
+      if (F >= Frames - LONGWINDOW)
+         *Last += T;
+      if (F % LONGDECRATE == 0)
+         Decimate_BGM(BGM, MATCHCTH, NumSets);
+      if (CompactRate && (F + 1) % CompactRate == 0) {
+         T = Timer();
+         Compact_BGM(BGM, NumSets);
+         *Compact += Timer() - T;
+      }
+   }
+   *First /= LONGWINDOW;
+   *Last /= LONGWINDOW;
+   for (*Sum = I = 0; I < NumSets; I++)
+      for (ThisCell = BGM[I]; ThisCell; ThisCell = ThisCell->Next)
+         *Sum = *Sum * 31 + ThisCell->R + 7 * ThisCell->G + 13 * ThisCell->B + 17 * ThisCell->Count;
+   for (I = 0; I < NumSets; I++)
+      while (BGM[I] != NULL)
+         BGM[I] = Free_Cell(BGM[I]);
+   free(BGM);
+   free(Palette);
+   Free_Frame(FB);
+}
+
+/*              Bench Compaction
+
+This routine makes a long run without and with compaction every
+CompactRate frames, checks that both end with the same model, and
+prints the matching time per frame early and late in each run. */
+
+static void Bench_Compaction(int Width, int Height, int Frames, int CompactRate) {
+   double               First[2], Last[2], Compact[2];
+   unsigned long long   Sum[2];
+
+   Long_Run(Width, Height, Frames, 0, 1, &First[0], &Last[0], &Compact[0], &Sum[0]);
+   Long_Run(Width, Height, Frames, CompactRate, 1, &First[1], &Last[1], &Compact[1], &Sum[1]);
+   if (Sum[0] != Sum[1]) {
+      fprintf(stderr, "ERROR: compacted model mismatch at %dx%d\n", Width, Height);
+      exit(1);
+   }
+   printf("   %4dx%-4d  never      first %4d %9.3f ms   last %4d %9.3f ms\n",
+          Width, Height, LONGWINDOW, First[0] * 1e3, LONGWINDOW, Last[0] * 1e3);
+   printf("   %4dx%-4d  every %4d first %4d %9.3f ms   last %4d %9.3f ms   compaction %7.3f ms each   speedup %5.2fx\n",
+          Width, Height, CompactRate, LONGWINDOW, First[1] * 1e3, LONGWINDOW, Last[1] * 1e3,
+          Compact[1] * 1e3 / (Frames / CompactRate), Last[0] / Last[1]);
+}
+
+/**********************************************************************
+                        Stream Input
+
+A raw RGB24 stream is read as P3-1 reads --input: the training frames
+are kept and read again, then every frame is read once. The stream is
+written by a child process into a pipe, as a live feed would be, so
+it can be longer than any file. Resident memory must stay flat.
+***********************************************************************/
+
+/*              Resident Memory
+
+This routine returns the resident set size of the process, in
+kilobytes (0 if it cannot be read). The peak (getrusage) would hide
+growth below the peak of the benchmarks before. */
+
+static long Resident_Memory() {
+   FILE                 *FP;
+   long                 Size = 0, Pages = 0;
+
+   if ((FP = fopen("/proc/self/statm", "r")) != NULL) {
+      if (fscanf(FP, "%ld %ld", &Size, &Pages) != 2)
+         Pages = 0;
+      fclose(FP);
+   }
+   return (Pages * (sysconf(_SC_PAGESIZE) / 1024));
+}
+
+/*              Write Frames
+
+This routine writes Frames raw RGB24 frames to standard output, every
+byte of frame N (numbered from 1) set to N. It runs in the child. */
+
+static void Write_Frames(int Width, int Height, int Frames) {
+   unsigned char        *Frm;
+   size_t               Size = 3 * (size_t) Width * Height;
+   int                  N;
+
+   Frm = (unsigned char *) malloc(Size);
+   if (Frm == NULL)
+      _exit(1);
+   for (N = 1; N <= Frames; N++) {
+      memset(Frm, N & 255, Size);
+      if (fwrite(Frm, 1, Size, stdout) != Size)
+         _exit(1);
+   }
+   fflush(stdout);
+   free(Frm);
+}
+
+/*              Bench Stream
+
+This routine reads a piped stream of Frames frames, checks every frame
+and that no frame is kept after training, and prints the read time per
+frame and the resident memory after STREAMWARMUP frames and at the end. */
+
+static void Bench_Stream(int Width, int Height, int Frames) {
+   Stream               *S;
+   FrmBuf               *FB;
+   int                  Pipe[2], N, Kept = 0;
+   long                 Warm = 0, Last, FrameKB = 3L * Width * Height / 1024;
+   pid_t                Child;
+   double               T;
+
+   fflush(stdout);
+   if (pipe(Pipe) != 0 || (Child = fork()) < 0) {
+      fprintf(stderr, "ERROR: stream writer cannot be started\n");
+      exit(1);
+   }
+   if (Child == 0) {
+      close(Pipe[0]);
+      dup2(Pipe[1], 1);
+      close(Pipe[1]);
+      Write_Frames(Width, Height, Frames);
+      _exit(0);
+   }
+   close(Pipe[1]);
+   dup2(Pipe[0], 0);
+   close(Pipe[0]);
+   S = Open_Stream("-", STREAM_RGB, Width, Height);
+   FB = Alloc_Frame(Width, Height);
+   Keep_Stream_Frames(S, TRUE);
+   for (N = 1; N <= STREAMTRAIN; N++)
+      if (!Read_Stream(S, N, FB)) {
+         fprintf(stderr, "ERROR: stream ends before frame %d\n", N);
+         exit(1);
+      }
+   Keep_Stream_Frames(S, FALSE);
+   T = Timer();
+   for (N = 1; N <= Frames; N++) {
+      if (!Read_Stream(S, N, FB) || FB->Frm[0] != (N & 255) || FB->Frm[3 * Width * Height - 1] != (N & 255)) {
+         fprintf(stderr, "ERROR: stream frame %d mismatch\n", N);
+         exit(1);
+      }
+      if (N >= STREAMTRAIN && S->Kept != NULL)     /* the training frames are dropped once read again */
+         Kept += 1;
+      if (N == STREAMWARMUP)
+         Warm = Resident_Memory();
+   }
+   T = Timer() - T;
+   Last = Resident_Memory();
+   if (Read_Stream(S, Frames + 1, FB)) {
+      fprintf(stderr, "ERROR: stream does not end after frame %d\n", Frames);
+      exit(1);
+   }
+   Close_Stream(S);
+   Free_Frame(FB);
+   waitpid(Child, NULL, 0);
+   if (Kept || Last - Warm > FrameKB) {
+      fprintf(stderr, "ERROR: stream reading keeps frames (%d kept, %ld KB resident after %d frames, %ld KB after %d)\n",
+              Kept, Warm, STREAMWARMUP, Last, Frames);
+      exit(1);
+   }
+   printf("   %4dx%-4d  %9.3f ms per frame   resident %ld KB after %d frames, %ld KB after %d\n",
+          Width, Height, T * 1e3 / Frames, Warm, STREAMWARMUP, Last, Frames);
+}
+
+int main(int argc, char *argv[]) {
+   int                  Reps = DEFAULTREPS;
+
+   if (argc > 1 && (sscanf(argv[1], "%d", &Reps) != 1 || Reps < 1)) {
+      fprintf(stderr, "usage: %s [reps]\n", argv[0]);
+      exit(1);
+   }
+   srand(1);
+   printf("Area_Image_Density, WheelSize 7, best of %d:\n", Reps);
+   Bench_Area_Density(640, 140, 7, Reps);
+   Bench_Area_Density(1920, 1080, 7, Reps);
+   Bench_Area_Density(3840, 2160, 7, Reps);
+   printf("Ratiometric matching, %d modal frames, best of %d (per frame):\n", MATCHFRAMES, Reps);
+   Bench_Match(640, 140, Reps);
+   Bench_Match(1920, 1080, Reps);
+   printf("Foreground extraction by model, %d modal frames, best of %d (per frame):\n", MATCHFRAMES, Reps);
+   Bench_Models(640, 140, Reps);
+   Bench_Models(1920, 1080, Reps);
+   printf("Cell list matching on long runs, %d frames, decimated every %d (per frame):\n", LONGFRAMES, LONGDECRATE);
+   Bench_Compaction(640, 480, LONGFRAMES, 250);
+   printf("Raw RGB24 stream input, piped, %d frames:\n", STREAMFRAMES);
+   Bench_Stream(640, 480, STREAMFRAMES);
+   exit(0);
+}
@@ -0,0 +1,453 @@
+/*                     Delta Sequences
+
+This library stores a composited sequence as its static background
+once, then only the patches of each frame that differ from it, and
+replays the full frames.
+
+Part of the Virtual Blue-Screen program (P3-1).
+
+Documentation:
+
+A delta file is a header, the background as raw RGB, one record per
+frame and an index with one entry per record. A frame record is its
+frame number and patch count, then its patches: the rectangle, a bit
+mask of the rectangle's pixels (row by row, low bit first) that are
+stored, and the RGB values of those pixels in the same order. A pixel
+is stored only if it differs from the background, and at most once per
+frame, so a frame where nothing is composited is a record of 8 bytes.
+The file is in the byte order of the machine that wrote it.
+
+Writing follows the compositing loop: Begin_Delta_Frame starts a
+frame, Add_Delta_Patch names each rectangle that may have been drawn
+on, and End_Delta_Frame compares those rectangles of the composited
+frame with the background and writes the record. Frames are not
+encoded at all. Since only the patches differ from the background,
+Restore_Delta_Frame puts the background back over the last frame's
+patches, so the next frame can be composited on the same buffer
+without copying the whole background.
+
+Open_Delta maps a delta file with a single mmap. Reset_Delta_Frame
+fills a frame buffer with the background, and Read_Delta_Frame turns
+it into any frame of the file, restoring the patches of the frame read
+before, so replaying a sequence in order only touches the patches.
+
+Key Usage Functions:
+
+Create_Delta(): Creates a delta file with a background frame.
+
+Begin_Delta_Frame(): Starts a frame.
+
+Add_Delta_Patch(): Adds a rectangle of the frame to compare.
+
+End_Delta_Frame(): Stores the frame's pixels that differ.
+
+Restore_Delta_Frame(): Restores the background over the last frame's
+patches.
+
+Open_Delta(): Maps a delta file.
+
+Reset_Delta_Frame(): Fills a frame buffer with the background.
+
+Read_Delta_Frame(): Replays a frame of a delta file into a frame
+buffer.
+
+Close_Delta(): Writes the index of a created file, or unmaps an opened
+one, and deallocates it.
+
+Example:
+
+   D = Create_Delta("trials/00/out.delta", oFB);
+   FB = Duplicate_Frame(oFB);
+   for (...) {
+      Restore_Delta_Frame(D, FB);
+      Begin_Delta_Frame(D, N);
+      ... composite blob B on FB ...
+      Add_Delta_Patch(D, B->Xmin, B->Ymin, B->Xmax - B->Xmin, B->Ymax - B->Ymin);
+      End_Delta_Frame(D, FB);
+   }
+   Close_Delta(D);
+
+   D = Open_Delta("trials/00/out.delta");
+   Reset_Delta_Frame(D, FB);
+   for (K = 0; K < D->NumFrames; K++)
+      N = Read_Delta_Frame(D, K, FB);
+   Close_Delta(D);
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "utils.h"
+#include "delta.h"
+
+/*              Grow
+
+This routine makes room for Need elements of Unit bytes in a growing
+array. If it cannot be allocated, an error message is printed and
+execution terminates. */
+
+static void *Grow(void *Array, int *Max, int Need, size_t Unit) {
+
+   if (Need <= *Max)
+      return (Array);
+   *Max = (Need > 2 * *Max) ? Need : 2 * *Max;
+   Array = realloc(Array, *Max * Unit);
+   if (Array == NULL) {
+      fprintf(stderr, "Unable to allocate delta sequence\n");
+      exit(1);
+   }
+   return (Array);
+}
+
+/*              Allocate Delta
+
+This routine allocates an empty delta sequence. */
+
+static Delta *Allocate_Delta(char *Name) {
+
+   Delta                *D;
+
+   D = (Delta *) calloc(1, sizeof(Delta));
+   if (D == NULL || (D->Name = strdup(Name)) == NULL) {
+      fprintf(stderr, "Unable to allocate delta sequence\n");
+      exit(1);
+   }
+   return (D);
+}
+
+/*              Create Delta
+
+This routine creates a delta file and writes the header and the
+background frame. If it cannot be created, an error message is printed
+and execution terminates. */
+
+Delta *Create_Delta(char *Name, FrmBuf *Background) {
+
+   Delta                *D = Allocate_Delta(Name);
+   Delta_Header         Header;
+   size_t               Size = 3 * Background->Width * Background->Height;
+
+   D->Output = TRUE;
+   D->Width = Background->Width;
+   D->Height = Background->Height;
+   D->Background = (unsigned char *) malloc(Size);
+   D->Stored = (unsigned char *) calloc(D->Width * D->Height, 1);
+   if (D->Background == NULL || D->Stored == NULL) {
+      fprintf(stderr, "Unable to allocate delta sequence\n");
+      exit(1);
+   }
+   memcpy(D->Background, Background->Frm, Size);
+   D->FP = fopen(Name, "wb");
+   if (D->FP == NULL) {
+      fprintf(stderr, "ERROR: %s cannot be created\n", Name);
+      exit(1);
+   }
+   memset(&Header, 0, sizeof(Header));                  /* counts and index are written at close */
+   memcpy(Header.Magic, DELTAMAGIC, sizeof(Header.Magic));
+   if (fwrite(&Header, sizeof(Header), 1, D->FP) != 1 || fwrite(D->Background, 1, Size, D->FP) != Size) {
+      fprintf(stderr, "can't write %s\n", Name);
+      exit(1);
+   }
+   D->Pos = sizeof(Header) + Size;
+   return (D);
+}
+
+/*              Begin Delta Frame
+
+This routine starts frame number N of a created delta file. */
+
+void Begin_Delta_Frame(Delta *D, int N) {
+
+   D->Number = N;
+   D->NumRects = 0;
+}
+
+/*              Add Delta Patch
+
+This routine adds a W x H rectangle at (X,Y) to the current frame; its
+pixels are compared with the background when the frame ends. The
+rectangle is clipped to the frame. */
+
+void Add_Delta_Patch(Delta *D, int X, int Y, int W, int H) {
+
+   Delta_Patch          *R;
+
+   if (X < 0) {
+      W += X;
+      X = 0;
+   }
+   if (Y < 0) {
+      H += Y;
+      Y = 0;
+   }
+   if (X + W > D->Width)
+      W = D->Width - X;
+   if (Y + H > D->Height)
+      H = D->Height - Y;
+   if (W <= 0 || H <= 0)
+      return;
+   D->Rects = (Delta_Patch *) Grow(D->Rects, &D->MaxRects, D->NumRects + 1, sizeof(Delta_Patch));
+   R = &(D->Rects[D->NumRects++]);
+   R->X = X;
+   R->Y = Y;
+   R->W = W;
+   R->H = H;
+   R->Count = 0;
+}
+
+/*              Reserve Record
+
+This routine makes room for Bytes more bytes in the frame record. */
+
+static void Reserve_Record(Delta *D, size_t Bytes) {
+
+   if (D->RecordSize + Bytes <= D->MaxRecord)
+      return;
+   D->MaxRecord = 2 * (D->RecordSize + Bytes);
+   D->Record = (unsigned char *) realloc(D->Record, D->MaxRecord);
+   if (D->Record == NULL) {
+      fprintf(stderr, "Unable to allocate delta sequence\n");
+      exit(1);
+   }
+}
+
+/*              End Delta Frame
+
+This routine compares the patches of the composited frame buffer with
+the background, writes the frame record with the pixels that differ
+and adds it to the index. Patches with no such pixels are dropped. If
+the record cannot be written, an error message is printed and
+execution terminates. */
+
+void End_Delta_Frame(Delta *D, FrmBuf *FB) {
+
+   Delta_Patch          *R;
+   unsigned char        *Mask, *Pixels, *Frm = FB->Frm, *Bg = D->Background;
+   uint32_t             Count[2];
+   int                  K, X, Y, I, Bit;
+   size_t               Start;
+
+   if (FB->Width != D->Width || FB->Height != D->Height) {
+      fprintf(stderr, "ERROR: frame buffer size (%d,%d) does not match %s frame size (%d,%d)\n", \
+	      FB->Width, FB->Height, D->Name, D->Width, D->Height);
+      exit(1);
+   }
+   D->RecordSize = 0;
+   Reserve_Record(D, 2 * sizeof(uint32_t));
+   D->RecordSize = 2 * sizeof(uint32_t);                /* number and patch count */
+   D->NumDirty = 0;
+   for (K = 0; K < D->NumRects; K++) {
+      R = &(D->Rects[K]);
+      Start = D->RecordSize;
+      Reserve_Record(D, sizeof(Delta_Patch) + (R->W * R->H + 7) / 8 + 3 * R->W * R->H);
+      Mask = D->Record + Start + sizeof(Delta_Patch);
+      memset(Mask, 0, (R->W * R->H + 7) / 8);
+      Pixels = Mask + (R->W * R->H + 7) / 8;
+      R->Count = 0;
+      for (Bit = Y = 0; Y < R->H; Y++) {
+         I = (R->Y + Y) * D->Width + R->X;
+         for (X = 0; X < R->W; X++, I++, Bit++)
+            if (!D->Stored[I] && (Frm[3*I] != Bg[3*I] || Frm[3*I+1] != Bg[3*I+1] || Frm[3*I+2] != Bg[3*I+2])) {
+               D->Stored[I] = TRUE;
+               Mask[Bit >> 3] |= 1 << (Bit & 7);
+               memcpy(Pixels, Frm + 3*I, 3);
+               Pixels += 3;
+               R->Count += 1;
+            }
+      }
+      if (R->Count == 0)
+         continue;
+      memcpy(D->Record + Start, R, sizeof(Delta_Patch));
+      D->RecordSize = Pixels - D->Record;
+      D->Dirty = (Delta_Patch *) Grow(D->Dirty, &D->MaxDirty, D->NumDirty + 1, sizeof(Delta_Patch));
+      D->Dirty[D->NumDirty++] = *R;
+   }
+   for (K = 0; K < D->NumDirty; K++) {                  /* clear the stored map for the next frame */
+      R = &(D->Dirty[K]);
+      for (Y = 0; Y < R->H; Y++)
+         memset(D->Stored + (R->Y + Y) * D->Width + R->X, 0, R->W);
+   }
+   Count[0] = D->Number;
+   Count[1] = D->NumDirty;
+   memcpy(D->Record, Count, sizeof(Count));
+   D->Index = (Delta_Entry *) Grow(D->Index, &D->MaxFrames, D->NumFrames + 1, sizeof(Delta_Entry));
+   D->Index[D->NumFrames].Offset = D->Pos;
+   D->Index[D->NumFrames].Size = D->RecordSize;
+   D->Index[D->NumFrames].Number = D->Number;
+   D->NumFrames += 1;
+   if (fwrite(D->Record, 1, D->RecordSize, D->FP) != D->RecordSize) {
+      fprintf(stderr, "can't write %s\n", D->Name);
+      exit(1);
+   }
+   D->Pos += D->RecordSize;
+}
+
+/*              Restore Delta Frame
+
+This routine copies the background over the patches of the last frame
+written or read, so the frame buffer holds the background again. */
+
+void Restore_Delta_Frame(Delta *D, FrmBuf *FB) {
+
+   Delta_Patch          *R;
+   int                  K, Y, I;
+
+   for (K = 0; K < D->NumDirty; K++) {
+      R = &(D->Dirty[K]);
+      for (Y = 0; Y < R->H; Y++) {
+         I = 3 * ((R->Y + Y) * D->Width + R->X);
+         memcpy(FB->Frm + I, D->Background + I, 3 * R->W);
+      }
+   }
+   D->NumDirty = 0;
+}
+
+/*              Open Delta
+
+This routine maps a delta file read only, with a single mmap. If the
+file cannot be opened or is not a valid delta file, an error message
+is printed and execution terminates. */
+
+Delta *Open_Delta(char *Name) {
+
+   Delta                *D = Allocate_Delta(Name);
+   Delta_Header         *Header;
+   struct stat          Info;
+   uint64_t             Bytes;
+   int                  FD;
+
+   FD = open(Name, O_RDONLY);
+   if (FD < 0 || fstat(FD, &Info) != 0) {
+      fprintf(stderr, "ERROR: %s cannot be opened\n", Name);
+      exit(1);
+   }
+   D->Size = Info.st_size;
+   D->Map = (D->Size < sizeof(Delta_Header)) ? MAP_FAILED :
+      (unsigned char *) mmap(NULL, D->Size, PROT_READ, MAP_SHARED, FD, 0);
+   close(FD);
+   Header = (Delta_Header *) D->Map;
+   if (D->Map == MAP_FAILED || memcmp(Header->Magic, DELTAMAGIC, sizeof(Header->Magic)) != 0 ||
+       Header->EntrySize != sizeof(Delta_Entry)) {
+      fprintf(stderr, "ERROR: %s is not a delta sequence\n", Name);
+      exit(1);
+   }
+   Bytes = sizeof(Delta_Header) + 3 * (uint64_t) Header->Width * Header->Height;
+   if (Bytes > D->Size || Header->IndexOffset < Bytes || Header->IndexOffset > D->Size ||
+       (uint64_t) Header->NumFrames * sizeof(Delta_Entry) > D->Size - Header->IndexOffset) {
+      fprintf(stderr, "ERROR: %s is not a complete delta sequence\n", Name);
+      exit(1);
+   }
+   D->Width = Header->Width;
+   D->Height = Header->Height;
+   D->NumFrames = Header->NumFrames;
+   D->Background = D->Map + sizeof(Delta_Header);
+   D->Index = (Delta_Entry *) (D->Map + Header->IndexOffset);
+   madvise(D->Map, D->Size, MADV_SEQUENTIAL);
+   return (D);
+}
+
+/*              Reset Delta Frame
+
+This routine fills a frame buffer with the background of an opened
+delta file, to replay frames into. */
+
+void Reset_Delta_Frame(Delta *D, FrmBuf *FB) {
+
+   if (FB->Width != D->Width || FB->Height != D->Height) {
+      fprintf(stderr, "ERROR: frame buffer size (%d,%d) does not match %s frame size (%d,%d)\n", \
+	      FB->Width, FB->Height, D->Name, D->Width, D->Height);
+      exit(1);
+   }
+   memcpy(FB->Frm, D->Background, 3 * D->Width * D->Height);
+   D->NumDirty = 0;
+}
+
+/*              Read Delta Frame
+
+This routine replays the K-th frame of an opened delta file into a
+frame buffer that holds the background or the frame read before (see
+Reset_Delta_Frame), and returns its frame number. If the record is
+damaged (a patch outside the frame, or a mask that does not set as
+many pixels as the patch holds, or anything past the record), an
+error message is printed and -1 is returned. */
+
+int Read_Delta_Frame(Delta *D, int K, FrmBuf *FB) {
+
+   Delta_Entry          *E = &(D->Index[K]);
+   Delta_Patch          R;
+   unsigned char        *Rec, *End, *Mask, *Pixels;
+   uint32_t             Count[2];
+   int                  P, X, Y, Bit, Bits, Set;
+
+   Restore_Delta_Frame(D, FB);
+   if (E->Offset > D->Size || E->Size > D->Size - E->Offset || E->Size < sizeof(Count))
+      goto Damaged;
+   Rec = D->Map + E->Offset;
+   End = Rec + E->Size;
+   memcpy(Count, Rec, sizeof(Count));
+   Rec += sizeof(Count);
+   for (P = 0; P < (int) Count[1]; P++) {
+      if (End - Rec < (long) sizeof(R))
+         goto Damaged;
+      memcpy(&R, Rec, sizeof(R));
+      Mask = Rec + sizeof(R);
+      Pixels = Mask + (R.W * R.H + 7) / 8;
+      if (R.X + R.W > D->Width || R.Y + R.H > D->Height || Pixels + 3 * (size_t) R.Count > End)
+         goto Damaged;
+      for (Set = 0, Bits = R.W * R.H, Bit = 0; Bit < Bits; Bit += 8)   /* the copy follows the mask */
+         Set += __builtin_popcount(Mask[Bit >> 3] & (Bits - Bit < 8 ? (1 << (Bits - Bit)) - 1 : 0xff));
+      if (Set != (int) R.Count)
+         goto Damaged;
+      for (Bit = Y = 0; Y < R.H; Y++)
+         for (X = 0; X < R.W; X++, Bit++)
+            if (Mask[Bit >> 3] & (1 << (Bit & 7))) {
+               memcpy(FB->Frm + 3 * ((R.Y + Y) * D->Width + R.X + X), Pixels, 3);
+               Pixels += 3;
+            }
+      Rec = Pixels;
+      D->Dirty = (Delta_Patch *) Grow(D->Dirty, &D->MaxDirty, D->NumDirty + 1, sizeof(Delta_Patch));
+      D->Dirty[D->NumDirty++] = R;
+   }
+   return (Count[0]);
+
+Damaged:
+   fprintf(stderr, "ERROR: frame %d of %s is damaged\n", K, D->Name);
+   return (-1);
+}
+
+/*              Close Delta
+
+This routine closes a delta file and deallocates it. A created file
+gets its index and header first; if they cannot be written, an error
+message is printed and execution terminates. */
+
+void Close_Delta(Delta *D) {
+
+   Delta_Header         Header;
+
+   if (D->Output) {
+      memcpy(Header.Magic, DELTAMAGIC, sizeof(Header.Magic));
+      Header.Width = D->Width;
+      Header.Height = D->Height;
+      Header.NumFrames = D->NumFrames;
+      Header.EntrySize = sizeof(Delta_Entry);
+      Header.IndexOffset = D->Pos;
+      if ((D->NumFrames > 0 && fwrite(D->Index, sizeof(Delta_Entry), D->NumFrames, D->FP) != (size_t) D->NumFrames) ||
+          fseek(D->FP, 0, SEEK_SET) != 0 || fwrite(&Header, sizeof(Header), 1, D->FP) != 1 || fclose(D->FP) != 0) {
+         fprintf(stderr, "can't write %s\n", D->Name);
+         exit(1);
+      }
+      free(D->Background);
+      free(D->Index);
+      free(D->Stored);
+      free(D->Record);
+      free(D->Rects);
+   } else
+      munmap(D->Map, D->Size);
+   free(D->Dirty);
+   free(D->Name);
+   free(D);
+}
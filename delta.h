@@ -0,0 +1,61 @@
+/*                     Delta Sequences
+
+This library stores a composited sequence as its static background
+once, then only the patches of each frame that differ from it, and
+replays the full frames.
+
+Part of the Virtual Blue-Screen program (P3-1).               */
+
+#include <stdint.h>
+
+typedef struct          Delta_Header {
+   char                 Magic[8];                 /* DELTAMAGIC */
+   uint32_t             Width, Height;
+   uint32_t             NumFrames;
+   uint32_t             EntrySize;                /* sizeof(Delta_Entry), checks the layout */
+   uint64_t             IndexOffset;              /* written at close */
+}  Delta_Header;
+
+typedef struct          Delta_Entry {
+   uint64_t             Offset;                   /* frame record, from the start of the file */
+   uint32_t             Size;
+   uint32_t             Number;                   /* frame number */
+}  Delta_Entry;
+
+typedef struct          Delta_Patch {
+   uint16_t             X, Y, W, H;               /* rectangle of the frame */
+   uint32_t             Count;                    /* pixels stored, after a W x H bit mask */
+}  Delta_Patch;
+
+typedef struct          Delta {
+   FILE                 *FP;
+   char                 *Name;
+   int                  Output;                   /* written, not read */
+   int                  Width, Height, NumFrames;
+   unsigned char        *Background;              /* RGB, Width x Height */
+   unsigned char        *Map;                     /* read: the whole file, mapped read only */
+   size_t               Size;
+   Delta_Entry          *Index;                   /* write: grown as frames are added */
+   int                  MaxFrames;
+   uint64_t             Pos;                      /* write: bytes written */
+   int                  Number;                   /* write: frame being added */
+   unsigned char        *Stored;                  /* write: pixels already in a patch of the frame */
+   unsigned char        *Record;                  /* write: frame record being built */
+   size_t               RecordSize, MaxRecord;
+   Delta_Patch          *Rects;                   /* write: patches added to the frame */
+   int                  NumRects, MaxRects;
+   Delta_Patch          *Dirty;                   /* patches of the last frame, to restore */
+   int                  NumDirty, MaxDirty;
+}  Delta;
+
+#define                 DELTAMAGIC "SEQDELT1"
+
+extern Delta *Create_Delta(char *Name, FrmBuf *Background);
+extern void Begin_Delta_Frame(Delta *D, int N);
+extern void Add_Delta_Patch(Delta *D, int X, int Y, int W, int H);
+extern void End_Delta_Frame(Delta *D, FrmBuf *FB);
+extern void Restore_Delta_Frame(Delta *D, FrmBuf *FB);
+extern Delta *Open_Delta(char *Name);
+extern void Reset_Delta_Frame(Delta *D, FrmBuf *FB);
+extern int Read_Delta_Frame(Delta *D, int K, FrmBuf *FB);
+extern void Close_Delta(Delta *D);
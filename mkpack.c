@@ -0,0 +1,33 @@
+/*                  Sequence Packer
+
+This program converts a sequence directory of numbered JPEG frames
+(NNNNN.jpg) into a single indexed pack file, which P3-1 reads with
+--pack.
+
+Part of the Virtual Blue-Screen program (P3-1).
+
+Usage: mkpack seqdir packfile
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "utils.h"
+#include "pack.h"
+
+int main(int argc, char *argv[]) {
+
+   Pack                 *P;
+
+   if (argc != 3) {
+      fprintf(stderr, "usage: %s seqdir packfile\n", argv[0]);
+      exit(1);
+   }
+   Write_Pack(argv[1], argv[2]);
+   P = Open_Pack(argv[2]);
+   if (P->NumFrames > 0)
+      printf("%s: %d frames (%u-%u)\n", argv[2], P->NumFrames, P->Index[0].Number, P->Index[P->NumFrames - 1].Number);
+   else
+      printf("%s: no frames\n", argv[2]);
+   Close_Pack(P);
+   exit(0);
+}
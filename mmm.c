@@ -45,18 +45,31 @@ image, It includes its height and width plus an unsigned char array
 large enough to hold RGB values for each pixel.
 
 Cell: A ratiometric chromatic entry including color component sums and
-a count. While not directly allocated by the user, cells are allocated
+a count, plus the cached component means (sum / count) used for
+matching. While not directly allocated by the user, cells are allocated
 as scene chromatic and luminance variance increase. Heap allocated
 and explicitly managed.
 
 BGM: Background model (an array of Cell objects) created by
 Create_Initial_BGM function.
 
+ModeBGM: Mode array background model created by
+Create_Initial_Mode_BGM. It holds up to MaxModes modes per pixel in
+mode planes of packed R, G, B and Count rows instead of cell lists.
+Modes are matched against their sums and counts with a multiply
+rather than cached means. The _Modes variants of the frame processing
+functions operate on it.
+
 Key Usage Functions:
 
 Create_Initial_BGM(): Creates and returns a starting BGM based on an
 initial image.
 
+Save_BGM(), Restore_BGM(): Write a BGM to a snapshot file and rebuild
+it from one, so a restarted run starts with a trained model (see
+Snapshot Files below). Save_Mode_BGM() and Restore_Mode_BGM() do the
+same for a ModeBGM.
+
 Process_Frame_FG(): Processes a new frame adjusting the BGM for
 encountered pixels. Background pixels (i.e., pixels matched in the
 BGM) are blacked (i.e., set to (0,0,0). Foreground pixels are
@@ -66,6 +79,26 @@ Decimate_BGM(): Moderates BGM adaptively. Divide each cell's color
 component sums and count by two. If a cell's count falls below the
 cell threshold, it is removed and deallocated.
 
+Decimate_BGM_Slice(): Decimates one slice of the BGM, so decimation
+can be spread evenly over frames instead of spiking every DecRate
+frames.
+
+Bound_BGM(), Live_Cells(): Trim every set to a number of cells, and
+count the cells in use. Bound_Mode_BGM() lowers the modes per pixel of
+a ModeBGM the same way. MaxSetCells caps the cells of any set as they
+are added (the weakest is replaced, as with a ModeBGM); together with
+a cell budget checked against Live_Cells, memory stays bounded however
+long the run.
+
+Compact_BGM(): Moves every set's cells into one contiguous block, in
+pixel order, and returns all other cell memory to the heap. Run every
+few hundred frames, it undoes the scattering of cells over the heap
+that decimation and reallocation cause on long runs.
+
+Process_Frame_FG_Threaded(), Process_Frame_BG_Threaded(),
+Decimate_BGM_Threaded(): Equivalents of the above that split the frame
+into row bands over a worker pool (see workers.h).
+
    FrmBuf               *FB;
    int		        MCDth = MCDTH, Cth = CTH, DecRate = DECRATE;
    Cell                 **BGM;
@@ -73,7 +106,7 @@ cell threshold, it is removed and deallocated.
    ...
    Load_Image(Path, FB);
    ...
-   BGM = Create_Initial_BGM(FB);
+   BGM = Create_Initial_BGM(FB);     // or BGM = Restore_BGM(SnapFile, &Width, &Height);
    for (...) {
       Load_Image(Path, FB);
       Process_Frame_FG(BGM, FB, MCDth, Cth);
@@ -85,35 +118,131 @@ cell threshold, it is removed and deallocated.
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "utils.h"
+#include "workers.h"
 #include "mmm.h"
 
+/* Snapshot Files:
+
+A snapshot holds a trained model in a single file that can be mapped
+into memory and used in place. It starts with a Snapshot header
+giving the model kind, frame size and section offsets; each section
+starts on a SNAPALIGN byte boundary. Values are native ints; the
+ByteOrder field rejects snapshots from a machine of other byte order,
+and Version rejects older or newer layouts.
+
+SNAPLIST (Cell list BGM): the sets section holds the number of cells
+of each set (an int per pixel), the cells section the R, G, B and
+Count of every cell (four ints), set by set in list order.
+
+SNAPMODES (mode array BGM): the sets section holds the Modes byte
+array, the cells section the ModeRow array as laid out in memory. */
+
+/* Cell Slabs:
+
+Cells are carved from slabs of CELLSLABSIZE cells, cache line aligned
+and allocated from the heap as needed. Free lists (pools) take blocks
+of FREECELLSBLOCKSIZE consecutive cells from the current slab, so
+cells allocated together lie together, and all cell memory is known,
+so Compact_BGM can return it to the heap. Slabs are shared by all
+pools, so carving is locked. */
+
+typedef struct          Cell_Slab {
+   Cell                 *Cells;
+   int                  Size, Used;
+}  Cell_Slab;
+
 Cell                    *FreeCells = NULL;
+Cell                    *BandCells[MAXBANDS];         /* per band free cell lists (Threaded Processing) */
+static Cell_Slab        *Slabs = NULL;                /* every slab, the current one last */
+static int              NumSlabs = 0, MaxSlabs = 0;
+static pthread_mutex_t  SlabLock = PTHREAD_MUTEX_INITIALIZER;
+static long             LiveCells = 0;                /* cells allocated and not freed, in every pool */
+int                     MaxSetCells = 0;              /* most cells a set may hold, 0 for no limit */
 
-/*            Allocate Cell
+/*            Add Slab
 
-This routine returns a new cell. If none are available, it allocates a
-block from the heap and adds them to the free list. */
+This routine allocates a slab of Size cells from the heap and makes it
+the current slab. If it cannot be allocated, an error message is
+printed and execution terminates. */
 
-Cell *Allocate_Cell() {
+static Cell_Slab *Add_Slab(int Size) {
+
+   Cell_Slab            *Slab;
+   void                 *Cells;
+
+   if (NumSlabs == MaxSlabs) {
+      MaxSlabs = MaxSlabs ? 2 * MaxSlabs : 64;
+      Slabs = (Cell_Slab *) realloc(Slabs, MaxSlabs * sizeof(Cell_Slab));
+   }
+   if (Slabs == NULL || posix_memalign(&Cells, CELLSLABALIGN, (Size ? Size : 1) * sizeof(Cell)) != 0) {
+      fprintf(stderr, "Unable to allocate cell\n");
+      exit (1);
+   }
+   Slab = &(Slabs[NumSlabs++]);
+   Slab->Cells = (Cell *) Cells;
+   Slab->Size = Size;
+   Slab->Used = 0;
+   return (Slab);
+}
+
+/*            Slab Cells
+
+This routine returns N consecutive cells of the current slab, starting
+a new slab if it is full. */
+
+static Cell *Slab_Cells(int N) {
+
+   Cell_Slab            *Slab;
+   Cell                 *Cells;
+
+   pthread_mutex_lock(&SlabLock);
+   Slab = NumSlabs ? &(Slabs[NumSlabs - 1]) : NULL;
+   if (Slab == NULL || Slab->Used + N > Slab->Size)
+      Slab = Add_Slab(N > CELLSLABSIZE ? N : CELLSLABSIZE);
+   Cells = Slab->Cells + Slab->Used;
+   Slab->Used += N;
+   pthread_mutex_unlock(&SlabLock);
+   return (Cells);
+}
+
+/*            Pool Allocate Cell
+
+This routine returns a new cell from a free list (pool). If none are
+available, it takes a block of cells from the current slab and adds
+them to the free list. Separate pools let threads allocate cells
+without sharing a list. */
+
+Cell *Pool_Allocate_Cell(Cell **Pool) {
 
    Cell                 *NewCell;
 
-   if (FreeCells == NULL) {
-      FreeCells = (Cell *) malloc(FREECELLSBLOCKSIZE * sizeof(Cell));
-      if (FreeCells == NULL) {
-         fprintf(stderr, "Unable to allocate cell\n");
-         exit (1);
-      }
-      for (NewCell = FreeCells; NewCell < &(FreeCells[FREECELLSBLOCKSIZE - 1]); NewCell++)
+   if (*Pool == NULL) {
+      *Pool = Slab_Cells(FREECELLSBLOCKSIZE);
+      for (NewCell = *Pool; NewCell < &((*Pool)[FREECELLSBLOCKSIZE - 1]); NewCell++)
  	 NewCell->Next = (NewCell + 1);
-      (FreeCells[FREECELLSBLOCKSIZE - 1]).Next = NULL;
+      ((*Pool)[FREECELLSBLOCKSIZE - 1]).Next = NULL;
    }
-   NewCell = FreeCells;
-   FreeCells = FreeCells->Next;
+   NewCell = *Pool;
+   *Pool = NewCell->Next;
+   __sync_fetch_and_add(&LiveCells, 1);
    return (NewCell);
 }
 
+/*            Allocate Cell
+
+This routine returns a new cell from the global free list. */
+
+Cell *Allocate_Cell() {
+
+   return (Pool_Allocate_Cell(&FreeCells));
+}
+
 /*           Last Cell
 
 This routine returns a pointer to the last cell in the set. */
@@ -149,9 +278,9 @@ void Print_Cell(Cell *ThisCell) {
    if (ThisCell->Count > 0)
       printf("%u: [%8d (%3d), %8d (%3d), %8d (%3d), %6d, %u]\n",
              (int) ThisCell,
-	     ThisCell->R, ThisCell->R / ThisCell->Count,
-	     ThisCell->G, ThisCell->G / ThisCell->Count,
-	     ThisCell->B, ThisCell->B / ThisCell->Count,
+	     ThisCell->R, ThisCell->Rmean,
+	     ThisCell->G, ThisCell->Gmean,
+	     ThisCell->B, ThisCell->Bmean,
 	     ThisCell->Count, (int) ThisCell->Next);
    else
       printf("%u: [(%3d, %3d, %3d), %6d, %u]\n",
@@ -188,20 +317,31 @@ void Print_Free_Cells() {
    printf("\n");
 }
 
-/*           Free Cell
+/*           Pool Free Cell
 
-This routine adds the current cell to the free list. It returns the
-Cell's next pointer. */
+This routine adds the current cell to a free list (pool). It returns
+the Cell's next pointer. */
 
-Cell *Free_Cell(Cell *ThisCell) {
+Cell *Pool_Free_Cell(Cell **Pool, Cell *ThisCell) {
    Cell                 *Next;
 
    Next = ThisCell->Next;
-   ThisCell->Next = FreeCells;
-   FreeCells = ThisCell;
+   ThisCell->Next = *Pool;
+   *Pool = ThisCell;
+   __sync_fetch_and_sub(&LiveCells, 1);
    return(Next);   
 }
 
+/*           Free Cell
+
+This routine adds the current cell to the global free list. It returns
+the Cell's next pointer. */
+
+Cell *Free_Cell(Cell *ThisCell) {
+
+   return (Pool_Free_Cell(&FreeCells, ThisCell));
+}
+
 /*              TrimSort
 
 This routine sorts and prunes a Cell list based on count. The returned
@@ -269,31 +409,256 @@ Cell **Create_Initial_BGM(FrmBuf *FB) {
       BGM[I]->G = (int) FB->Frm[3*I + 1];
       BGM[I]->B = (int) FB->Frm[3*I + 2];
       BGM[I]->Count = 1;
+      BGM[I]->Rmean = FB->Frm[3*I];
+      BGM[I]->Gmean = FB->Frm[3*I + 1];
+      BGM[I]->Bmean = FB->Frm[3*I + 2];
       BGM[I]->Next = NULL;
    }
    return (BGM);
 }   
 
+/*              Snapshot Support
+
+Write_Section writes a snapshot section at the next SNAPALIGN
+boundary and returns its offset. Map_Snapshot maps a snapshot file
+read only, checks its header against the expected kind, and returns
+the mapping; section Bytes long at Offset is checked to lie within
+the file with Snapshot_Section. Valid_Snapshot_Cell checks that a
+restored cell or mode has a positive count and color sums a count of
+8 bit pixels can reach. If the file is not a valid snapshot, an error
+message is printed and execution terminates. */
+
+static long long Write_Section(FILE *FP, char *FileName, void *Data, long long Bytes) {
+
+   static char          Zeros[SNAPALIGN];
+   long long            Offset = ftell(FP);
+
+   if (Offset % SNAPALIGN)
+      fwrite(Zeros, 1, SNAPALIGN - Offset % SNAPALIGN, FP);
+   Offset = ftell(FP);
+   if (fwrite(Data, 1, Bytes, FP) != Bytes) {
+      fprintf(stderr, "ERROR: %s cannot be written\n", FileName);
+      exit(1);
+   }
+   return (Offset);
+}
+
+static FILE *Open_Snapshot(char *FileName, Snapshot *Head, int Kind, int Width, int Height, int MaxModes) {
+
+   FILE                 *FP;
+
+   FP = fopen(FileName, "wb");
+   if (FP == NULL) {
+      fprintf(stderr, "ERROR: %s cannot be opened\n", FileName);
+      exit(1);
+   }
+   memset(Head, 0, sizeof(Snapshot));
+   memcpy(Head->Magic, SNAPMAGIC, sizeof(Head->Magic));
+   Head->Version = SNAPVERSION;
+   Head->ByteOrder = SNAPBYTEORDER;
+   Head->Kind = Kind;
+   Head->Width = Width;
+   Head->Height = Height;
+   Head->MaxModes = MaxModes;
+   fwrite(Head, sizeof(Snapshot), 1, FP);                        /* offsets filled in on close */
+   return (FP);
+}
+
+static void Close_Snapshot(FILE *FP, char *FileName, Snapshot *Head) {
+
+   fseek(FP, 0, SEEK_SET);
+   if (fwrite(Head, sizeof(Snapshot), 1, FP) != 1 || fclose(FP) != 0) {
+      fprintf(stderr, "ERROR: %s cannot be written\n", FileName);
+      exit(1);
+   }
+}
+
+static Snapshot *Map_Snapshot(char *FileName, int Kind, long long *Size) {
+
+   Snapshot             *Head;
+   struct stat          Stat;
+   int                  FD;
+
+   FD = open(FileName, O_RDONLY);
+   if (FD < 0 || fstat(FD, &Stat) != 0) {
+      fprintf(stderr, "ERROR: %s cannot be opened\n", FileName);
+      exit(1);
+   }
+   *Size = Stat.st_size;
+   if (*Size < (long long) sizeof(Snapshot)) {
+      fprintf(stderr, "ERROR: %s is not a BGM snapshot\n", FileName);
+      exit(1);
+   }
+   Head = (Snapshot *) mmap(NULL, *Size, PROT_READ, MAP_PRIVATE, FD, 0);
+   close(FD);
+   if (Head == MAP_FAILED) {
+      fprintf(stderr, "ERROR: %s cannot be mapped\n", FileName);
+      exit(1);
+   }
+   if (memcmp(Head->Magic, SNAPMAGIC, sizeof(Head->Magic)) != 0 || Head->ByteOrder != SNAPBYTEORDER) {
+      fprintf(stderr, "ERROR: %s is not a BGM snapshot\n", FileName);
+      exit(1);
+   }
+   if (Head->Version != SNAPVERSION) {
+      fprintf(stderr, "ERROR: %s is a version %d snapshot, version %d expected\n", FileName, Head->Version, SNAPVERSION);
+      exit(1);
+   }
+   if (Head->Kind != Kind) {
+      fprintf(stderr, "ERROR: %s holds a %s background model\n", FileName, Head->Kind == SNAPLIST ? "cell list" : "mode array");
+      exit(1);
+   }
+   if (Head->Width < 1 || Head->Height < 1 || Head->NumCells < 0 ||
+       (long long) Head->Width * Head->Height > INT_MAX) {
+      fprintf(stderr, "ERROR: %s is corrupt\n", FileName);
+      exit(1);
+   }
+   return (Head);
+}
+
+static int Valid_Snapshot_Cell(int R, int G, int B, int Count) {
+
+   return (Count >= 1 && R >= 0 && G >= 0 && B >= 0 &&
+           R <= 255LL * Count && G <= 255LL * Count && B <= 255LL * Count);
+}
+
+static void *Snapshot_Section(Snapshot *Head, long long Size, long long Offset, long long Bytes, char *FileName) {
+
+   if (Offset < (long long) sizeof(Snapshot) || Bytes < 0 || Offset + Bytes > Size) {
+      fprintf(stderr, "ERROR: %s is truncated or corrupt\n", FileName);
+      exit(1);
+   }
+   return ((char *) Head + Offset);
+}
+
+/*              Save BGM
+
+This routine writes a background model for Width x Height frames to a
+snapshot file, preserving each set's cells in list order. If the file
+cannot be written, an error message is printed and execution
+terminates. */
+
+void Save_BGM(char *FileName, Cell **BGM, int Width, int Height) {
+
+   Snapshot             Head;
+   FILE                 *FP;
+   Cell                 *ThisCell;
+   int                  *Lengths, *Cells;
+   long long            I, J, NumCells = 0;
+
+   Lengths = (int *) malloc(Width * Height * sizeof(int));
+   if (Lengths == NULL) {
+      fprintf(stderr, "Unable to allocate BGM snapshot memory\n");
+      exit (1);
+   }
+   for (I = 0; I < Width * Height; I++) {
+      Lengths[I] = Length(BGM[I]);
+      NumCells += Lengths[I];
+   }
+   Cells = (int *) malloc(NumCells * 4 * sizeof(int));
+   if (Cells == NULL) {
+      fprintf(stderr, "Unable to allocate BGM snapshot memory\n");
+      exit (1);
+   }
+   for (I = J = 0; I < Width * Height; I++)
+      for (ThisCell = BGM[I]; ThisCell; ThisCell = ThisCell->Next) {
+         Cells[J++] = ThisCell->R;
+         Cells[J++] = ThisCell->G;
+         Cells[J++] = ThisCell->B;
+         Cells[J++] = ThisCell->Count;
+      }
+   FP = Open_Snapshot(FileName, &Head, SNAPLIST, Width, Height, 0);
+   Head.NumCells = NumCells;
+   Head.SetsOffset = Write_Section(FP, FileName, Lengths, (long long) Width * Height * sizeof(int));
+   Head.CellsOffset = Write_Section(FP, FileName, Cells, NumCells * 4 * sizeof(int));
+   Close_Snapshot(FP, FileName, &Head);
+   free(Lengths);
+   free(Cells);
+}
+
+/*              Restore BGM
+
+This routine rebuilds a background model from a snapshot file written
+by Save_BGM, returning it along with its frame size. The file is
+mapped rather than read, so restoring costs little more than
+allocating the cells. If the file is not a valid snapshot, an error
+message is printed and execution terminates. */
+
+Cell **Restore_BGM(char *FileName, int *Width, int *Height) {
+
+   Snapshot             *Head;
+   Cell                 **BGM, **Tail;
+   int                  *Lengths, *Cells, NumSets, I, J;
+   long long            Size, Total = 0;
+
+   Head = Map_Snapshot(FileName, SNAPLIST, &Size);
+   NumSets = Head->Width * Head->Height;
+   Lengths = (int *) Snapshot_Section(Head, Size, Head->SetsOffset, (long long) NumSets * sizeof(int), FileName);
+   Cells = (int *) Snapshot_Section(Head, Size, Head->CellsOffset, Head->NumCells * 4 * sizeof(int), FileName);
+   for (I = 0; I < NumSets; I++) {
+      if (Lengths[I] < 1) {
+         fprintf(stderr, "ERROR: %s is corrupt\n", FileName);
+         exit(1);
+      }
+      Total += Lengths[I];
+   }
+   if (Total != Head->NumCells) {
+      fprintf(stderr, "ERROR: %s is corrupt\n", FileName);
+      exit(1);
+   }
+   for (Total = 0; Total < Head->NumCells; Total++)
+      if (!Valid_Snapshot_Cell(Cells[4*Total], Cells[4*Total + 1], Cells[4*Total + 2], Cells[4*Total + 3])) {
+         fprintf(stderr, "ERROR: %s is corrupt\n", FileName);
+         exit(1);
+      }
+   BGM = (Cell **) malloc(NumSets * sizeof(Cell *));
+   if (BGM == NULL) {
+      fprintf(stderr, "Unable to allocate BGM memory\n");
+      exit (1);
+   }
+   for (I = 0; I < NumSets; I++) {
+      Tail = &(BGM[I]);
+      for (J = 0; J < Lengths[I]; J++, Cells += 4) {
+         *Tail = Allocate_Cell();
+         (*Tail)->R = Cells[0];
+         (*Tail)->G = Cells[1];
+         (*Tail)->B = Cells[2];
+         (*Tail)->Count = Cells[3];
+         (*Tail)->Rmean = Cells[0] / Cells[3];
+         (*Tail)->Gmean = Cells[1] / Cells[3];
+         (*Tail)->Bmean = Cells[2] / Cells[3];
+         Tail = &((*Tail)->Next);
+      }
+      *Tail = NULL;
+   }
+   *Width = Head->Width;
+   *Height = Head->Height;
+   munmap(Head, Size);
+   return (BGM);
+}
+
 /*             Ratiometric Match Pixel
 
 This routine compares the input RGB pixel value to each Cell in the
 set. If it is within epsilon in all three ratiometric color
-components, it matches and the cell is assimilated into the matched
-cell. When matched, a pointer the matching cell is
-returned. Otherwise, a NULL pointer is returned. */
+components (compared against the cached means), it matches and the
+cell is assimilated into the matched cell. When matched, a pointer the
+matching cell is returned. Otherwise, a NULL pointer is returned. */
 
 Cell *Ratio_Match_Pixel(Pixel *P, Cell *Cells, int Epsilon) {
 
    Cell                *ThisCell;
 
    for (ThisCell = Cells; ThisCell != NULL; ThisCell = ThisCell->Next)
-      if (abs(P->R - ThisCell->R / ThisCell->Count) <= Epsilon &&
-          abs(P->G - ThisCell->G / ThisCell->Count) <= Epsilon &&
-          abs(P->B - ThisCell->B / ThisCell->Count) <= Epsilon) {
+      if (abs(P->R - ThisCell->Rmean) <= Epsilon &&
+          abs(P->G - ThisCell->Gmean) <= Epsilon &&
+          abs(P->B - ThisCell->Bmean) <= Epsilon) {
          ThisCell->R += P->R;
          ThisCell->G += P->G;
          ThisCell->B += P->B;
          ThisCell->Count += 1;
+         ThisCell->Rmean = ThisCell->R / ThisCell->Count;
+         ThisCell->Gmean = ThisCell->G / ThisCell->Count;
+         ThisCell->Bmean = ThisCell->B / ThisCell->Count;
          return(ThisCell);
       }
    return(NULL);
@@ -332,13 +697,16 @@ Cell *Match_Cell(Cell *NewCell, Cell *Cells, int Epsilon) {
    Cell                *ThisCell;
 
    for (ThisCell = Cells; ThisCell != NULL; ThisCell = ThisCell->Next)
-      if (abs(NewCell->R / NewCell->Count - ThisCell->R / ThisCell->Count) <= Epsilon &&
-          abs(NewCell->G / NewCell->Count - ThisCell->G / ThisCell->Count) <= Epsilon &&
-          abs(NewCell->B / NewCell->Count - ThisCell->B / ThisCell->Count) <= Epsilon) {
+      if (abs(NewCell->Rmean - ThisCell->Rmean) <= Epsilon &&
+          abs(NewCell->Gmean - ThisCell->Gmean) <= Epsilon &&
+          abs(NewCell->Bmean - ThisCell->Bmean) <= Epsilon) {
          ThisCell->R += NewCell->R;
          ThisCell->G += NewCell->G;
          ThisCell->B += NewCell->B;
          ThisCell->Count += NewCell->Count;
+         ThisCell->Rmean = ThisCell->R / ThisCell->Count;
+         ThisCell->Gmean = ThisCell->G / ThisCell->Count;
+         ThisCell->Bmean = ThisCell->B / ThisCell->Count;
          return(ThisCell);
       }
    return(NULL);
@@ -349,30 +717,43 @@ Cell *Match_Cell(Cell *NewCell, Cell *Cells, int Epsilon) {
 This routine creates a new cell in given set. First, the last cell in
 the set is tested against the minimum cell lifetime. If the last cell
 meets the minimum cell life, a new cell object is allocated and
-appended to the cell. Otherwise the last cell data is overwritten with
-the new pixel data. A pointer to the new cell is then returned. */
+appended to the cell; if the set already holds MaxSetCells cells, the
+cell with the lowest count is replaced instead, as Add_Mode does.
+Otherwise the last cell data is overwritten with the new pixel
+data. A pointer to the new cell is then returned. New cells come from
+the given pool (Pool_Add_Cell) or the global free list (Add_Cell). */
 
-Cell *Add_Cell(Pixel *P, Cell *Set, int Cth) {
+Cell *Pool_Add_Cell(Cell **Pool, Pixel *P, Cell *Set, int Cth) {
 
    Cell                 *LastCell, *NewCell;
-
-   LastCell = Last_Cell(Set);
-   if (LastCell->Count >= Cth) {           /* if previous last cell is old enough */
-      NewCell = Allocate_Cell();           /* then make and append a new cell */
-      NewCell->R = (int) P->R;
-      NewCell->G = (int) P->G;
-      NewCell->B = (int) P->B;
-      NewCell->Count = 1;
-      NewCell->Next = NULL;
-      LastCell->Next = NewCell;
-      return (NewCell);
-   } else {                                /* else replace previous last cell */
-      LastCell->R = (int) P->R;
-      LastCell->G = (int) P->G;
-      LastCell->B = (int) P->B;
-      LastCell->Count = 1;
-      return (LastCell);
+   int                  Cells = 1;
+
+   for (LastCell = Set; LastCell->Next != NULL; LastCell = LastCell->Next)
+      Cells += 1;
+   NewCell = LastCell;                     /* replace previous last cell, unless */
+   if (LastCell->Count >= Cth) {           /* previous last cell is old enough */
+      if (MaxSetCells == 0 || Cells < MaxSetCells) {
+         NewCell = Pool_Allocate_Cell(Pool);  /* then make and append a new cell */
+         NewCell->Next = NULL;
+         LastCell->Next = NewCell;
+      } else                               /* or replace the weakest cell if none left */
+         for (LastCell = Set; LastCell != NULL; LastCell = LastCell->Next)
+            if (LastCell->Count < NewCell->Count)
+               NewCell = LastCell;
    }
+   NewCell->R = (int) P->R;
+   NewCell->G = (int) P->G;
+   NewCell->B = (int) P->B;
+   NewCell->Count = 1;
+   NewCell->Rmean = P->R;
+   NewCell->Gmean = P->G;
+   NewCell->Bmean = P->B;
+   return (NewCell);
+}
+
+Cell *Add_Cell(Pixel *P, Cell *Set, int Cth) {
+
+   return (Pool_Add_Cell(&FreeCells, P, Set, Cth));
 }
 
 /*             Predominant Cell
@@ -456,9 +837,9 @@ count is also zeroed. */
 void Color_Lock(Cell *Cells, int Clear) {
 
    while (Cells != NULL) {
-      Cells->R /= Cells->Count;
-      Cells->G /= Cells->Count;
-      Cells->B /= Cells->Count;
+      Cells->R = Cells->Rmean;
+      Cells->G = Cells->Gmean;
+      Cells->B = Cells->Bmean;
       if (Clear)
  	 Cells->Count = 0;
       else
@@ -472,16 +853,17 @@ void Color_Lock(Cell *Cells, int Clear) {
 This routine decimates (divided by two) every cell value and count in
 the background model. If the cell falls below the cell threshold, it
 is removed from the set's cell list and added to the free cell
-list. The number of removed cells is returned.
+list. The number of removed cells is returned. Decimate_Sets performs
+the work for a range of sets, freeing cells to a given pool.
 
 It would be a good idea to preserve young, growing cells if birthdates
 where available. */
 
-int Decimate_BGM(Cell **BGM, int Cth, int NumSets) {
+static int Decimate_Sets(Cell **Pool, Cell **BGM, int Cth, int First, int Last) {
    int                  I, Freed = 0;
    Cell                 *ThisCell, **TrailingNext;
 
-   for (I = 0; I < NumSets; I++) {
+   for (I = First; I < Last; I++) {
       ThisCell = BGM[I];
       TrailingNext = &(BGM[I]);
       while (ThisCell != NULL) {
@@ -490,10 +872,13 @@ int Decimate_BGM(Cell **BGM, int Cth, int NumSets) {
 	    ThisCell->G >>= 1;
 	    ThisCell->B >>= 1;
             ThisCell->Count >>= 1;
+	    ThisCell->Rmean = ThisCell->R / ThisCell->Count;     /* halving shifts the quotient */
+	    ThisCell->Gmean = ThisCell->G / ThisCell->Count;
+	    ThisCell->Bmean = ThisCell->B / ThisCell->Count;
          }
          if (ThisCell->Count < Cth && (ThisCell->Next != NULL || ThisCell != BGM[I])) {
 	    *TrailingNext = ThisCell->Next;                      /* splice out invalid cell */
-            ThisCell = Free_Cell(ThisCell);
+            ThisCell = Pool_Free_Cell(Pool, ThisCell);
             Freed += 1;
 	 } else {
 	    TrailingNext = &(ThisCell->Next);                    /* else move to next cell */
@@ -504,24 +889,137 @@ int Decimate_BGM(Cell **BGM, int Cth, int NumSets) {
    return (Freed);
 }
 
+int Decimate_BGM(Cell **BGM, int Cth, int NumSets) {
+
+   return (Decimate_Sets(&FreeCells, BGM, Cth, 0, NumSets));
+}
+
+/*              Decimate BGM Slice
+
+This routine decimates one of NumSlices slices of the sets, spreading
+the work of Decimate_BGM over several frames. Sets are dealt to the
+slices in blocks of DECSLICEBLOCK, round robin, so any range of rows
+holds an even share of every slice. Decimating slice N % NumSlices on
+every frame N decimates each set once every NumSlices frames, as
+calling Decimate_BGM every NumSlices frames does, but at a flat cost
+per frame. The number of removed cells is returned.
+Decimate_Sets_Slice performs the work for the part of a slice within
+a range of sets. */
+
+static int Decimate_Sets_Slice(Cell **Pool, Cell **BGM, int Cth, int First, int Last, int Slice, int NumSlices) {
+
+   int                  Block, Freed = 0;
+
+   for (Block = First / DECSLICEBLOCK; Block * DECSLICEBLOCK < Last; Block++)
+      if (Block % NumSlices == Slice)
+         Freed += Decimate_Sets(Pool, BGM, Cth, Block * DECSLICEBLOCK > First ? Block * DECSLICEBLOCK : First,
+                                (Block + 1) * DECSLICEBLOCK < Last ? (Block + 1) * DECSLICEBLOCK : Last);
+   return (Freed);
+}
+
+int Decimate_BGM_Slice(Cell **BGM, int Cth, int NumSets, int Slice, int NumSlices) {
+
+   return (Decimate_Sets_Slice(&FreeCells, BGM, Cth, 0, NumSets, Slice, NumSlices));
+}
+
+/*              Compact BGM
+
+This routine copies the cells of every set into a single new slab, set
+after set in pixel order and each set in list order, so matching walks
+memory forward. Every other slab is then returned to the heap and all
+free lists (the global one and the per band ones) are emptied, so the
+model must be the only cell list model in use and no other thread may
+be allocating cells. The model itself is unchanged. The number of
+cells is returned. */
+
+int Compact_BGM(Cell **BGM, int NumSets) {
+
+   Cell_Slab            *Slab;
+   Cell                 *ThisCell, *NewCell, **Tail;
+   int                  I, Total = 0, Old;
+
+   for (I = 0; I < NumSets; I++)
+      Total += Length(BGM[I]);
+   pthread_mutex_lock(&SlabLock);
+   Old = NumSlabs;
+   Slab = Add_Slab(Total);
+   for (I = 0, NewCell = Slab->Cells; I < NumSets; I++) {
+      Tail = &(BGM[I]);
+      for (ThisCell = BGM[I]; ThisCell != NULL; ThisCell = ThisCell->Next, NewCell++) {
+         *NewCell = *ThisCell;
+         *Tail = NewCell;
+         Tail = &(NewCell->Next);
+      }
+      *Tail = NULL;
+   }
+   Slab->Used = Total;
+   for (I = 0; I < Old; I++)
+      free(Slabs[I].Cells);
+   Slabs[0] = *Slab;
+   NumSlabs = 1;
+   pthread_mutex_unlock(&SlabLock);
+   FreeCells = NULL;
+   for (I = 0; I < MAXBANDS; I++)
+      BandCells[I] = NULL;
+   LiveCells = Total;
+   return (Total);
+}
+
+/*              Bound BGM
+
+This routine trims every set holding more than MaxCells cells to its
+MaxCells cells of highest count (with TrimSort, so those sets end up
+sorted by count), as when a restored model is given a lower limit. The
+number of removed cells is returned. */
+
+int Bound_BGM(Cell **BGM, int NumSets, int MaxCells) {
+
+   int                  I, Before, Freed = 0;
+
+   for (I = 0; I < NumSets; I++)
+      if ((Before = Length(BGM[I])) > MaxCells) {
+         BGM[I] = TrimSort(BGM[I], MaxCells);
+         Freed += Before - MaxCells;
+      }
+   return (Freed);
+}
+
+/*              Live Cells
+
+This routine returns the number of cells in use, by every cell list
+model, which a cell budget is checked against. */
+
+long Live_Cells() {
+
+   return (LiveCells);
+}
+
 /*              Process Frame Foreground
 
 This routine processes an image frame, blacking out background
-pixels. Foreground pixels are not modified. */
+pixels. Foreground pixels are not modified. Process_Sets_FG performs
+the work for a range of pixels, allocating cells from a given pool. If
+it is given a mask, the frame is left unchanged and the mask is
+written instead (see Process_Frame_FG_Mask). */
 
-void Process_Frame_FG(Cell **BGM, FrmBuf *FB, int Epsilon, int Cth) {
+static void Process_Sets_FG(Cell **Pool, Cell **BGM, FrmBuf *FB, unsigned char *Mask, int Epsilon, int Cth, int First, int Last) {
 
    Cell                 *Result;
    Pixel                *P;
-   int                  I;
+   int                  I, Background;
 
 
-   for (I = 0; I < FB->Width * FB->Height; I++) {
+   for (I = First; I < Last; I++) {
       P = (Pixel *) &(FB->Frm[I * 3]);
       Result = Ratio_Match_Pixel(P, BGM[I], Epsilon);
+      Background = FALSE;
       if (Result == NULL)
-	 Add_Cell(P, BGM[I], Cth);
-      else if (Result->Count >= Cth) {
+	 Pool_Add_Cell(Pool, P, BGM[I], Cth);
+      else
+	 Background = (Result->Count >= Cth);
+      if (Mask)
+	 Mask[I] = (!Background && (P->R | P->G | P->B) != 0);
+      else if (Background) {
 	 P->R = 0;
 	 P->G = 0;
 	 P->B = 0;
@@ -529,29 +1027,55 @@ void Process_Frame_FG(Cell **BGM, FrmBuf *FB, int Epsilon, int Cth) {
    }
 }
 
+void Process_Frame_FG(Cell **BGM, FrmBuf *FB, int Epsilon, int Cth) {
+
+   Process_Sets_FG(&FreeCells, BGM, FB, NULL, Epsilon, Cth, 0, FB->Width * FB->Height);
+}
+
+/*              Process Frame Foreground Mask
+
+This routine processes an image frame like Process_Frame_FG, but
+leaves the frame unchanged and writes a foreground mask of one byte
+per pixel: 1 where Process_Frame_FG would leave a non-black pixel, 0
+elsewhere. The mask feeds the density routines directly
+(e.g. Area_Mask_Density), avoiding a copy of the frame and a re-read
+of three color components per pixel. */
+
+void Process_Frame_FG_Mask(Cell **BGM, FrmBuf *FB, unsigned char *Mask, int Epsilon, int Cth) {
+
+   Process_Sets_FG(&FreeCells, BGM, FB, Mask, Epsilon, Cth, 0, FB->Width * FB->Height);
+}
+
 /*              Process Frame Background
 
 This routine processes an image frame. The returned frame contain the
-predominant cell (highest occurrence) background value. */
+predominant cell (highest occurrence) background value. Process_Sets_BG
+performs the work for a range of pixels, allocating cells from a given
+pool. */
 
-void Process_Frame_BG(Cell **BGM, FrmBuf *FB, int Epsilon, int Cth) {
+static void Process_Sets_BG(Cell **Pool, Cell **BGM, FrmBuf *FB, int Epsilon, int Cth, int First, int Last) {
 
    Cell                 *Result;
    Pixel                *P;
    int                  I, TotalCount;
 
-   for (I = 0; I < FB->Width * FB->Height; I++) {
+   for (I = First; I < Last; I++) {
       P = (Pixel *) &(FB->Frm[I * 3]);
       Result = Ratio_Match_Pixel(P, BGM[I], Epsilon);
       if (Result == NULL)
-	 Add_Cell(P, BGM[I], Cth);
+	 Pool_Add_Cell(Pool, P, BGM[I], Cth);
       Result = Predominant_Cell(BGM[I], &TotalCount);
-      P->R = Result->R / Result->Count;
-      P->G = Result->G / Result->Count;
-      P->B = Result->B / Result->Count;
+      P->R = Result->Rmean;
+      P->G = Result->Gmean;
+      P->B = Result->Bmean;
    }
 }
 
+void Process_Frame_BG(Cell **BGM, FrmBuf *FB, int Epsilon, int Cth) {
+
+   Process_Sets_BG(&FreeCells, BGM, FB, Epsilon, Cth, 0, FB->Width * FB->Height);
+}
+
 /*              Process Frame Predominance Map
 
 This routine processes an image frame. It replaces the frame image
@@ -590,9 +1114,9 @@ void Create_BG_Frame(Cell **BGM, FrmBuf *FB) {
    for (I = 0; I < FB->Width * FB->Height; I++) {
       P = (Pixel *) &(FB->Frm[I * 3]);
       Result = Predominant_Cell(BGM[I], &TotalCount);
-      P->R = Result->R / Result->Count;
-      P->G = Result->G / Result->Count;
-      P->B = Result->B / Result->Count;
+      P->R = Result->Rmean;
+      P->G = Result->Gmean;
+      P->B = Result->Bmean;
    }
 }
 
@@ -615,3 +1139,702 @@ void Create_PD_Map(Cell **BGM, FrmBuf *FB) {
       Rainbow(PDrate * 255 / 100, P);
    }
 }
+
+/**********************************************************************
+                        Mode Arrays
+
+This section implements the multimodal mean on a mode array
+background model (ModeBGM). Rather than a heap linked list of cells
+per pixel, each pixel owns a fixed number of mode slots. Pixels are
+grouped in blocks of MODEBLOCK, and the slots for mode M of pixels
+I..I+MODEBLOCK-1 form one ModeRow, holding their R, G, B and Count
+side by side, so all fields of a mode, for all neighboring pixels,
+share two cache lines. The mode M rows of all blocks form mode plane
+M. A linear pixel scan walks each plane it needs front to back, one
+stream per live mode, and never loads the rows of unused modes.
+
+Modes are kept in the same order a cell list would hold them, so
+matching, cell addition and decimation behave exactly as their Cell
+counterparts as long as a pixel never needs more than MaxModes
+modes. When a pixel's slots are full, a new mode replaces the mode
+with the lowest count.
+***********************************************************************/
+
+/*           Allocate Mode Array
+
+This routine allocates a cache line aligned array for mode slot
+data. If the array cannot be allocated, an error message is
+printed and execution terminates. */
+
+static void *Allocate_Mode_Array(size_t Size) {
+
+   void                 *Array;
+
+   if (posix_memalign(&Array, 64, Size)) {
+      fprintf(stderr, "Unable to allocate mode BGM memory\n");
+      exit (1);
+   }
+   return (Array);
+}
+
+/*           Create Initial Mode BGM
+
+This routine creates the initial mode array background model using a
+single frame from the sequence. Each pixel starts with one mode. */
+
+ModeBGM *Create_Initial_Mode_BGM(FrmBuf *FB, int MaxModes) {
+
+   ModeBGM              *BGM;
+   int                  I, J, NumSlots;
+
+   if (DEBUG)
+      printf("   building %d entry mode BGM (%d modes) ...\n", FB->Width * FB->Height, MaxModes);
+   BGM = (ModeBGM *) malloc(sizeof(ModeBGM));
+   if (BGM == NULL) {
+      fprintf(stderr, "Unable to allocate mode BGM memory\n");
+      exit (1);
+   }
+   BGM->NumSets = FB->Width * FB->Height;
+   BGM->NumBlocks = (BGM->NumSets + MODEBLOCK - 1) / MODEBLOCK;
+   BGM->MaxModes = MaxModes;
+   NumSlots = BGM->NumBlocks * MODEBLOCK * MaxModes;
+   BGM->Rows = (ModeRow *) Allocate_Mode_Array(NumSlots / MODEBLOCK * sizeof(ModeRow));
+   BGM->Modes = (unsigned char *) Allocate_Mode_Array(NumSlots / MaxModes);
+   for (I = 0; I < NumSlots; I++)
+      MODE_R(BGM, I) = MODE_G(BGM, I) = MODE_B(BGM, I) = MODE_COUNT(BGM, I) = 0;
+   for (I = 0; I < NumSlots / MaxModes; I++)
+      BGM->Modes[I] = 0;
+   for (I = 0; I < BGM->NumSets; I++) {
+      J = MODE_INDEX(BGM, I, 0);
+      MODE_R(BGM, J) = (int) FB->Frm[3*I];
+      MODE_G(BGM, J) = (int) FB->Frm[3*I + 1];
+      MODE_B(BGM, J) = (int) FB->Frm[3*I + 2];
+      MODE_COUNT(BGM, J) = 1;
+      BGM->Modes[I] = 1;
+   }
+   return (BGM);
+}
+
+/*           Free Mode BGM
+
+This routine deallocates a mode array background model. */
+
+void Free_Mode_BGM(ModeBGM *BGM) {
+
+   free(BGM->Rows);
+   free(BGM->Modes);
+   free(BGM);
+}
+
+/*           Save Mode BGM
+
+This routine writes a mode array background model for Width x Height
+frames to a snapshot file. The rows are written as laid out in
+memory, so they restore with a copy. If the file cannot be written,
+an error message is printed and execution terminates. */
+
+void Save_Mode_BGM(char *FileName, ModeBGM *BGM, int Width, int Height) {
+
+   Snapshot             Head;
+   FILE                 *FP;
+   long long            NumSlots;
+
+   if (BGM->NumSets != Width * Height) {
+      fprintf(stderr, "ERROR: mode BGM does not match %dx%d frames\n", Width, Height);
+      exit(1);
+   }
+   NumSlots = (long long) (BGM->NumSets + MODEBLOCK - 1) / MODEBLOCK * MODEBLOCK * BGM->MaxModes;
+   FP = Open_Snapshot(FileName, &Head, SNAPMODES, Width, Height, BGM->MaxModes);
+   Head.NumCells = NumSlots;
+   Head.SetsOffset = Write_Section(FP, FileName, BGM->Modes, NumSlots / BGM->MaxModes);
+   Head.CellsOffset = Write_Section(FP, FileName, BGM->Rows, NumSlots / MODEBLOCK * sizeof(ModeRow));
+   Close_Snapshot(FP, FileName, &Head);
+}
+
+/*           Restore Mode BGM
+
+This routine rebuilds a mode array background model from a snapshot
+file written by Save_Mode_BGM, returning it along with its frame
+size. The mapped rows are copied into an aligned row array. If the
+file is not a valid snapshot, an error message is printed and
+execution terminates. */
+
+ModeBGM *Restore_Mode_BGM(char *FileName, int *Width, int *Height) {
+
+   Snapshot             *Head;
+   ModeBGM              *BGM;
+   long long            Size, NumSlots, Bytes, J;
+   int                  I, M;
+
+   Head = Map_Snapshot(FileName, SNAPMODES, &Size);
+   BGM = (ModeBGM *) malloc(sizeof(ModeBGM));
+   if (BGM == NULL) {
+      fprintf(stderr, "Unable to allocate mode BGM memory\n");
+      exit (1);
+   }
+   BGM->NumSets = Head->Width * Head->Height;
+   BGM->NumBlocks = (BGM->NumSets + MODEBLOCK - 1) / MODEBLOCK;
+   BGM->MaxModes = Head->MaxModes;
+   if (BGM->MaxModes < 1 || BGM->MaxModes > 255) {
+      fprintf(stderr, "ERROR: %s is corrupt\n", FileName);
+      exit(1);
+   }
+   NumSlots = (long long) BGM->NumBlocks * MODEBLOCK * BGM->MaxModes;
+   if (NumSlots > INT_MAX) {                                     /* slots are indexed by int */
+      fprintf(stderr, "ERROR: %s holds too large a mode BGM\n", FileName);
+      exit(1);
+   }
+   if (Head->NumCells != NumSlots) {
+      fprintf(stderr, "ERROR: %s is corrupt\n", FileName);
+      exit(1);
+   }
+   Bytes = NumSlots / MODEBLOCK * sizeof(ModeRow);
+   BGM->Modes = (unsigned char *) Allocate_Mode_Array(NumSlots / BGM->MaxModes);
+   memcpy(BGM->Modes, Snapshot_Section(Head, Size, Head->SetsOffset, NumSlots / BGM->MaxModes, FileName), NumSlots / BGM->MaxModes);
+   BGM->Rows = (ModeRow *) Allocate_Mode_Array(Bytes);
+   memcpy(BGM->Rows, Snapshot_Section(Head, Size, Head->CellsOffset, Bytes, FileName), Bytes);
+   for (I = 0; I < BGM->NumSets; I++) {
+      if (BGM->Modes[I] < 1 || BGM->Modes[I] > BGM->MaxModes) {
+         fprintf(stderr, "ERROR: %s is corrupt\n", FileName);
+         exit(1);
+      }
+      for (M = 0, J = I; M < BGM->Modes[I]; M++, J += MODE_STRIDE(BGM))
+         if (!Valid_Snapshot_Cell(MODE_R(BGM, J), MODE_G(BGM, J), MODE_B(BGM, J), MODE_COUNT(BGM, J))) {
+            fprintf(stderr, "ERROR: %s is corrupt\n", FileName);
+            exit(1);
+         }
+   }
+   *Width = Head->Width;
+   *Height = Head->Height;
+   munmap(Head, Size);
+   return (BGM);
+}
+
+/*             Bound Mode BGM
+
+This routine lowers the MaxModes of a mode array BGM, as when a
+restored model is given a lower limit. Every pixel holding more than
+MaxModes modes keeps its MaxModes modes of highest count, ordered by
+decreasing count as Bound_BGM leaves a trimmed set. The surplus mode
+planes are then released. The number of removed modes is returned. */
+
+int Bound_Mode_BGM(ModeBGM *BGM, int MaxModes) {
+
+   ModeRow              *Row, *Rows;
+   int                  R[255], G[255], B[255], Count[255], Order[255];
+   int                  I, L, M, K, Freed = 0;
+
+   if (MaxModes >= BGM->MaxModes)
+      return (0);
+   for (I = 0; I < BGM->NumSets; I++) {
+      if (BGM->Modes[I] <= MaxModes)
+         continue;
+      Row = MODE_ROWS(BGM, I);
+      L = I % MODEBLOCK;
+      for (M = 0; M < BGM->Modes[I]; M++) {                   /* insertion sort as TrimSort */
+         R[M] = Row[M * BGM->NumBlocks].R[L];
+         G[M] = Row[M * BGM->NumBlocks].G[L];
+         B[M] = Row[M * BGM->NumBlocks].B[L];
+         Count[M] = Row[M * BGM->NumBlocks].Count[L];
+         for (K = M; K > 0 && Count[M] >= Count[Order[K - 1]]; K--)
+            Order[K] = Order[K - 1];
+         Order[K] = M;
+      }
+      for (K = 0; K < MaxModes; K++) {
+         Row[K * BGM->NumBlocks].R[L] = R[Order[K]];
+         Row[K * BGM->NumBlocks].G[L] = G[Order[K]];
+         Row[K * BGM->NumBlocks].B[L] = B[Order[K]];
+         Row[K * BGM->NumBlocks].Count[L] = Count[Order[K]];
+      }
+      Freed += BGM->Modes[I] - MaxModes;
+      BGM->Modes[I] = MaxModes;
+   }
+   Rows = (ModeRow *) Allocate_Mode_Array((size_t) BGM->NumBlocks * MaxModes * sizeof(ModeRow));
+   memcpy(Rows, BGM->Rows, (size_t) BGM->NumBlocks * MaxModes * sizeof(ModeRow)); /* planes 0..MaxModes-1 */
+   free(BGM->Rows);
+   BGM->Rows = Rows;
+   BGM->MaxModes = MaxModes;
+   return (Freed);
+}
+
+/*             Ratiometric Match Mode
+
+This routine compares the input RGB pixel value to each mode of pixel
+I in order. If it is within epsilon in all three ratiometric color
+components (tested by MODE_NEAR, without dividing), it matches and the
+pixel is assimilated into the matched mode. When matched, the slot
+index of the matching mode is returned. Otherwise, -1 is returned. */
+
+int Ratio_Match_Mode(ModeBGM *BGM, int I, Pixel *P, int Epsilon) {
+
+   ModeRow              *Row = MODE_ROWS(BGM, I);
+   int                  M, L = I % MODEBLOCK, J = I;
+
+   for (M = 0; M < BGM->Modes[I]; M++, Row += BGM->NumBlocks, J += MODE_STRIDE(BGM))
+      if (MODE_NEAR(Row->R[L], Row->Count[L], P->R, Epsilon) &&
+          MODE_NEAR(Row->G[L], Row->Count[L], P->G, Epsilon) &&
+          MODE_NEAR(Row->B[L], Row->Count[L], P->B, Epsilon)) {
+         Row->R[L] += P->R;
+         Row->G[L] += P->G;
+         Row->B[L] += P->B;
+         Row->Count[L] += 1;
+         return (J);
+      }
+   return (-1);
+}
+
+/*                       Add Mode
+
+This routine creates a new mode for pixel I. If the last mode meets
+the minimum cell life, a new mode is appended. If no slots remain, the
+mode with the lowest count is replaced instead. Otherwise the last
+mode is overwritten with the new pixel data. The slot index of the new
+mode is returned. */
+
+int Add_Mode(ModeBGM *BGM, int I, Pixel *P, int Cth) {
+
+   ModeRow              *Row = MODE_ROWS(BGM, I);
+   int                  M, N = BGM->Modes[I] - 1, L = I % MODEBLOCK;
+
+   if (Row[N * BGM->NumBlocks].Count[L] >= Cth) {  /* if previous last mode is old enough */
+      if (N + 1 < BGM->MaxModes) {          /* then append a new mode if room */
+         N += 1;
+         BGM->Modes[I] += 1;
+      } else                                /* else replace the weakest mode */
+         for (M = 0; M < BGM->Modes[I]; M++)
+            if (Row[M * BGM->NumBlocks].Count[L] < Row[N * BGM->NumBlocks].Count[L])
+               N = M;
+   }
+   Row += N * BGM->NumBlocks;
+   Row->R[L] = (int) P->R;
+   Row->G[L] = (int) P->G;
+   Row->B[L] = (int) P->B;
+   Row->Count[L] = 1;
+   return (MODE_INDEX(BGM, I, N));
+}
+
+/*             Predominant Mode
+
+This routine finds the mode of pixel I with the largest count and
+returns its slot index. It also returns the sum of all mode counts of
+the pixel. */
+
+int Predominant_Mode(ModeBGM *BGM, int I, int *TotalCount) {
+
+   ModeRow              *Row = MODE_ROWS(BGM, I);
+   int                  M, L = I % MODEBLOCK, Max = 0;
+
+   *TotalCount = 0;
+   for (M = 0; M < BGM->Modes[I]; M++) {
+      *TotalCount += Row[M * BGM->NumBlocks].Count[L];
+      if (Row[M * BGM->NumBlocks].Count[L] > Row[Max * BGM->NumBlocks].Count[L])
+         Max = M;
+   }
+   return (MODE_INDEX(BGM, I, Max));
+}
+
+/*              Process Frame Foreground Modes
+
+This routine processes an image frame against a mode array BGM,
+blacking out background pixels. Foreground pixels are not
+modified. Process_Modes_FG performs the work for a range of pixels;
+given a mask, it writes the mask instead of modifying the frame. */
+
+static void Process_Modes_FG(ModeBGM *BGM, FrmBuf *FB, unsigned char *Mask, int Epsilon, int Cth, int First, int Last) {
+
+   Pixel                *P;
+   int                  I, J, Background;
+
+   for (I = First; I < Last; I++) {
+      P = (Pixel *) &(FB->Frm[I * 3]);
+      J = Ratio_Match_Mode(BGM, I, P, Epsilon);
+      Background = FALSE;
+      if (J < 0)
+	 Add_Mode(BGM, I, P, Cth);
+      else
+	 Background = (MODE_COUNT(BGM, J) >= Cth);
+      if (Mask)
+	 Mask[I] = (!Background && (P->R | P->G | P->B) != 0);
+      else if (Background) {
+	 P->R = 0;
+	 P->G = 0;
+	 P->B = 0;
+      }
+   }
+}
+
+void Process_Frame_FG_Modes(ModeBGM *BGM, FrmBuf *FB, int Epsilon, int Cth) {
+
+   Process_Modes_FG(BGM, FB, NULL, Epsilon, Cth, 0, BGM->NumSets);
+}
+
+/*              Process Frame Background Modes
+
+This routine processes an image frame against a mode array BGM. The
+returned frame contains the predominant mode background
+value. Process_Modes_BG performs the work for a range of pixels. */
+
+static void Process_Modes_BG(ModeBGM *BGM, FrmBuf *FB, int Epsilon, int Cth, int First, int Last) {
+
+   Pixel                *P;
+   int                  I, J, TotalCount;
+
+   for (I = First; I < Last; I++) {
+      P = (Pixel *) &(FB->Frm[I * 3]);
+      if (Ratio_Match_Mode(BGM, I, P, Epsilon) < 0)
+	 Add_Mode(BGM, I, P, Cth);
+      J = Predominant_Mode(BGM, I, &TotalCount);
+      P->R = MODE_R(BGM, J) / MODE_COUNT(BGM, J);
+      P->G = MODE_G(BGM, J) / MODE_COUNT(BGM, J);
+      P->B = MODE_B(BGM, J) / MODE_COUNT(BGM, J);
+   }
+}
+
+void Process_Frame_BG_Modes(ModeBGM *BGM, FrmBuf *FB, int Epsilon, int Cth) {
+
+   Process_Modes_BG(BGM, FB, Epsilon, Cth, 0, BGM->NumSets);
+}
+
+/*              Create Background Frame Modes
+
+This routine creates a background frame using the value of the
+predominant mode for each pixel position. */
+
+void Create_BG_Frame_Modes(ModeBGM *BGM, FrmBuf *FB) {
+
+   Pixel                *P;
+   int                  I, J, TotalCount;
+
+   for (I = 0; I < BGM->NumSets; I++) {
+      P = (Pixel *) &(FB->Frm[I * 3]);
+      J = Predominant_Mode(BGM, I, &TotalCount);
+      P->R = MODE_R(BGM, J) / MODE_COUNT(BGM, J);
+      P->G = MODE_G(BGM, J) / MODE_COUNT(BGM, J);
+      P->B = MODE_B(BGM, J) / MODE_COUNT(BGM, J);
+   }
+}
+
+/*              Decimate Mode BGM
+
+This routine decimates (divides by two) every mode value and count in
+a mode array BGM. Modes falling below the cell threshold are removed
+and the surviving modes are compacted in order, following the same
+rules as Decimate_BGM. The number of removed modes is
+returned. Decimate_Modes performs the work for a range of pixels. */
+
+static int Decimate_Modes(ModeBGM *BGM, int Cth, int First, int Last) {
+
+   ModeRow              *Row, *Src, *Dst;
+   int                  I, L, M, Kept, Freed = 0;
+
+   for (I = First; I < Last; I++) {
+      Row = MODE_ROWS(BGM, I);
+      L = I % MODEBLOCK;
+      Kept = 0;
+      for (M = 0; M < BGM->Modes[I]; M++) {
+         Src = &(Row[M * BGM->NumBlocks]);
+	 if (Src->Count[L] >= Cth) {
+	    Src->R[L] >>= 1;
+	    Src->G[L] >>= 1;
+	    Src->B[L] >>= 1;
+	    Src->Count[L] >>= 1;
+	 }
+	 if (Src->Count[L] < Cth && (M < BGM->Modes[I] - 1 || Kept > 0))
+	    Freed += 1;                                          /* drop invalid mode */
+	 else {
+	    Dst = &(Row[Kept * BGM->NumBlocks]);                 /* else keep, compacting in order */
+	    Dst->R[L] = Src->R[L];
+	    Dst->G[L] = Src->G[L];
+	    Dst->B[L] = Src->B[L];
+	    Dst->Count[L] = Src->Count[L];
+	    Kept += 1;
+	 }
+      }
+      BGM->Modes[I] = Kept;
+   }
+   return (Freed);
+}
+
+int Decimate_Mode_BGM(ModeBGM *BGM, int Cth) {
+
+   return (Decimate_Modes(BGM, Cth, 0, BGM->NumSets));
+}
+
+/*              Decimate Mode BGM Slice
+
+This routine is the mode array equivalent of Decimate_BGM_Slice. */
+
+static int Decimate_Modes_Slice(ModeBGM *BGM, int Cth, int First, int Last, int Slice, int NumSlices) {
+
+   int                  Block, Freed = 0;
+
+   for (Block = First / DECSLICEBLOCK; Block * DECSLICEBLOCK < Last; Block++)
+      if (Block % NumSlices == Slice)
+         Freed += Decimate_Modes(BGM, Cth, Block * DECSLICEBLOCK > First ? Block * DECSLICEBLOCK : First,
+                                 (Block + 1) * DECSLICEBLOCK < Last ? (Block + 1) * DECSLICEBLOCK : Last);
+   return (Freed);
+}
+
+int Decimate_Mode_BGM_Slice(ModeBGM *BGM, int Cth, int Slice, int NumSlices) {
+
+   return (Decimate_Modes_Slice(BGM, Cth, 0, BGM->NumSets, Slice, NumSlices));
+}
+
+/*              Mode SIMD Level
+
+This routine returns the widest SIMD foreground kernel (SIMD_NONE,
+SIMD_SSE4 or SIMD_AVX2) supported by this CPU. */
+
+int Mode_SIMD_Level() {
+
+#if MODE_X86
+   if (__builtin_cpu_supports("avx2"))
+      return (SIMD_AVX2);
+   if (__builtin_cpu_supports("sse4.1"))
+      return (SIMD_SSE4);
+#endif
+   return (SIMD_NONE);
+}
+
+/*              Process Frame Foreground Modes SIMD
+
+This routine is a vectorized Process_Frame_FG_Modes. Each MODEBLOCK
+group of pixels is matched against its modes together, one lane per
+pixel and one mode slot row per step. The first matching mode per lane
+is selected by masked compares, and background pixels are blacked out
+by a byte blend. Lanes without a match fall back to Add_Mode. Level
+selects the kernel (SIMD_SSE4 or SIMD_AVX2); it is lowered to what the
+CPU supports, and SIMD_NONE runs the scalar routine. Results are
+bit-identical to Process_Frame_FG_Modes. The kernels live in
+mmmsimd.c, which the makefile builds with -O2 even in a debug build;
+unoptimized they run slower than the scalar routine. Process_Modes_FG_SIMD
+performs the work for a range of pixels starting on a MODEBLOCK
+boundary. */
+
+static void Process_Modes_FG_SIMD(ModeBGM *BGM, FrmBuf *FB, unsigned char *Mask, int Epsilon, int Cth, int Level, int First, int Last) {
+
+#if MODE_X86
+   if (Level == SIMD_AVX2)
+      Process_Blocks_FG_AVX2(BGM, FB, Mask, Epsilon, Cth, First / MODEBLOCK, Last / MODEBLOCK);
+   else if (Level == SIMD_SSE4)
+      Process_Blocks_FG_SSE4(BGM, FB, Mask, Epsilon, Cth, First / MODEBLOCK, Last / MODEBLOCK);
+   if (Level != SIMD_NONE)
+      First = Last / MODEBLOCK * MODEBLOCK;                      /* scalar partial block remains */
+#endif
+   Process_Modes_FG(BGM, FB, Mask, Epsilon, Cth, First, Last);
+}
+
+void Process_Frame_FG_Modes_SIMD(ModeBGM *BGM, FrmBuf *FB, int Epsilon, int Cth, int Level) {
+
+   if (Level > Mode_SIMD_Level())
+      Level = Mode_SIMD_Level();
+   Process_Modes_FG_SIMD(BGM, FB, NULL, Epsilon, Cth, Level, 0, BGM->NumSets);
+}
+
+/*              Process Frame Foreground Modes Mask
+
+This routine is the mode array equivalent of Process_Frame_FG_Mask:
+the frame is left unchanged and a one byte per pixel foreground mask
+is written. Level selects the kernel as in
+Process_Frame_FG_Modes_SIMD. */
+
+void Process_Frame_FG_Modes_Mask(ModeBGM *BGM, FrmBuf *FB, unsigned char *Mask, int Epsilon, int Cth, int Level) {
+
+   if (Level > Mode_SIMD_Level())
+      Level = Mode_SIMD_Level();
+   Process_Modes_FG_SIMD(BGM, FB, Mask, Epsilon, Cth, Level, 0, BGM->NumSets);
+}
+
+/**********************************************************************
+                        Threaded Processing
+
+This section runs the frame processing functions over row bands on a
+worker pool. Each pixel's model is independent, so bands need no
+locking. The only shared state is the cell free list; each band
+therefore allocates from and frees to its own pool (BandCells), and
+since a band is always run by the same thread, each pool is only ever
+touched by one thread. Mode array models need no allocation, and are
+banded by MODEBLOCK groups so the SIMD kernels see whole groups.
+***********************************************************************/
+
+typedef struct          Band_Args {
+   Cell                 **BGM;
+   ModeBGM              *MBGM;
+   FrmBuf               *FB;
+   unsigned char        *Mask;
+   int                  Epsilon, Cth, Level, Width, NumSets, Slice, NumSlices;
+   int                  Freed[MAXBANDS];
+}  Band_Args;
+
+/* Band functions: First and Last are rows for cell list models and
+MODEBLOCK groups for mode array models. The decimation functions work
+on the part of slice Slice of NumSlices within their band. */
+
+static void FG_Band(void *Arg, int Band, int First, int Last) {
+
+   Band_Args            *A = (Band_Args *) Arg;
+
+   Process_Sets_FG(&BandCells[Band], A->BGM, A->FB, A->Mask, A->Epsilon, A->Cth, First * A->Width, Last * A->Width);
+}
+
+static void BG_Band(void *Arg, int Band, int First, int Last) {
+
+   Band_Args            *A = (Band_Args *) Arg;
+
+   Process_Sets_BG(&BandCells[Band], A->BGM, A->FB, A->Epsilon, A->Cth, First * A->Width, Last * A->Width);
+}
+
+static void Decimate_Band(void *Arg, int Band, int First, int Last) {
+
+   Band_Args            *A = (Band_Args *) Arg;
+
+   A->Freed[Band] = Decimate_Sets_Slice(&BandCells[Band], A->BGM, A->Cth, First * A->Width, Last * A->Width,
+                                        A->Slice, A->NumSlices);
+}
+
+static int Mode_Band_End(Band_Args *A, int Last) {
+
+   return (Last * MODEBLOCK < A->NumSets ? Last * MODEBLOCK : A->NumSets);
+}
+
+static void FG_Modes_Band(void *Arg, int Band, int First, int Last) {
+
+   Band_Args            *A = (Band_Args *) Arg;
+
+   Process_Modes_FG_SIMD(A->MBGM, A->FB, A->Mask, A->Epsilon, A->Cth, A->Level, First * MODEBLOCK, Mode_Band_End(A, Last));
+}
+
+static void BG_Modes_Band(void *Arg, int Band, int First, int Last) {
+
+   Band_Args            *A = (Band_Args *) Arg;
+
+   Process_Modes_BG(A->MBGM, A->FB, A->Epsilon, A->Cth, First * MODEBLOCK, Mode_Band_End(A, Last));
+}
+
+static void Decimate_Modes_Band(void *Arg, int Band, int First, int Last) {
+
+   Band_Args            *A = (Band_Args *) Arg;
+
+   A->Freed[Band] = Decimate_Modes_Slice(A->MBGM, A->Cth, First * MODEBLOCK, Mode_Band_End(A, Last),
+                                         A->Slice, A->NumSlices);
+}
+
+/*              Process Frame Foreground Threaded
+
+These routines are the banded equivalents of Process_Frame_FG and
+Process_Frame_BG. Results are identical to the single threaded
+routines. Given a mask, the foreground routine writes it as
+Process_Frame_FG_Mask does instead of blacking out the frame. */
+
+void Process_Frame_FG_Threaded(Workers *W, Cell **BGM, FrmBuf *FB, unsigned char *Mask, int Epsilon, int Cth) {
+
+   Band_Args            A;
+
+   A.BGM = BGM;
+   A.FB = FB;
+   A.Mask = Mask;
+   A.Epsilon = Epsilon;
+   A.Cth = Cth;
+   A.Width = FB->Width;
+   Run_Bands(W, FG_Band, &A, FB->Height);
+}
+
+void Process_Frame_BG_Threaded(Workers *W, Cell **BGM, FrmBuf *FB, int Epsilon, int Cth) {
+
+   Band_Args            A;
+
+   A.BGM = BGM;
+   A.FB = FB;
+   A.Epsilon = Epsilon;
+   A.Cth = Cth;
+   A.Width = FB->Width;
+   Run_Bands(W, BG_Band, &A, FB->Height);
+}
+
+/*              Decimate BGM Threaded
+
+This routine is the banded equivalent of Decimate_BGM. The bands
+match those of the frame processing routines so each set's cells
+return to the pool that allocated them. The number of removed cells
+is returned. Decimate_BGM_Slice_Threaded is the banded equivalent of
+Decimate_BGM_Slice; slices are dealt in blocks, so every band takes an
+even share of a slice. */
+
+int Decimate_BGM_Threaded(Workers *W, Cell **BGM, int Cth, int Width, int Height) {
+
+   return (Decimate_BGM_Slice_Threaded(W, BGM, Cth, Width, Height, 0, 1));
+}
+
+int Decimate_BGM_Slice_Threaded(Workers *W, Cell **BGM, int Cth, int Width, int Height, int Slice, int NumSlices) {
+
+   Band_Args            A;
+   int                  Band, Freed = 0;
+
+   A.BGM = BGM;
+   A.Cth = Cth;
+   A.Width = Width;
+   A.Slice = Slice;
+   A.NumSlices = NumSlices;
+   for (Band = 0; Band < W->NumBands; Band++)
+      A.Freed[Band] = 0;
+   Run_Bands(W, Decimate_Band, &A, Height);
+   for (Band = 0; Band < W->NumBands; Band++)
+      Freed += A.Freed[Band];
+   return (Freed);
+}
+
+/*              Process Frame Modes Threaded
+
+These routines are the banded equivalents of Process_Frame_FG_Modes_SIMD
+(Level SIMD_NONE selects the scalar kernel) or, given a mask,
+Process_Frame_FG_Modes_Mask, and of Process_Frame_BG_Modes,
+Decimate_Mode_BGM and Decimate_Mode_BGM_Slice. */
+
+void Process_Frame_FG_Modes_Threaded(Workers *W, ModeBGM *BGM, FrmBuf *FB, unsigned char *Mask, int Epsilon, int Cth, int Level) {
+
+   Band_Args            A;
+
+   A.MBGM = BGM;
+   A.FB = FB;
+   A.Mask = Mask;
+   A.Epsilon = Epsilon;
+   A.Cth = Cth;
+   A.Level = Level > Mode_SIMD_Level() ? Mode_SIMD_Level() : Level;
+   A.NumSets = BGM->NumSets;
+   Run_Bands(W, FG_Modes_Band, &A, BGM->NumBlocks);
+}
+
+void Process_Frame_BG_Modes_Threaded(Workers *W, ModeBGM *BGM, FrmBuf *FB, int Epsilon, int Cth) {
+
+   Band_Args            A;
+
+   A.MBGM = BGM;
+   A.FB = FB;
+   A.Epsilon = Epsilon;
+   A.Cth = Cth;
+   A.NumSets = BGM->NumSets;
+   Run_Bands(W, BG_Modes_Band, &A, BGM->NumBlocks);
+}
+
+int Decimate_Mode_BGM_Threaded(Workers *W, ModeBGM *BGM, int Cth) {
+
+   return (Decimate_Mode_BGM_Slice_Threaded(W, BGM, Cth, 0, 1));
+}
+
+int Decimate_Mode_BGM_Slice_Threaded(Workers *W, ModeBGM *BGM, int Cth, int Slice, int NumSlices) {
+
+   Band_Args            A;
+   int                  Band, Freed = 0;
+
+   A.MBGM = BGM;
+   A.Cth = Cth;
+   A.NumSets = BGM->NumSets;
+   A.Slice = Slice;
+   A.NumSlices = NumSlices;
+   for (Band = 0; Band < W->NumBands; Band++)
+      A.Freed[Band] = 0;
+   Run_Bands(W, Decimate_Modes_Band, &A, BGM->NumBlocks);
+   for (Band = 0; Band < W->NumBands; Band++)
+      Freed += A.Freed[Band];
+   return (Freed);
+}
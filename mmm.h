@@ -7,30 +7,144 @@ separator. It operates on packed RGB images.
 
 typedef struct          Cell {
    int                  R, G, B, Count;
+   unsigned short       Rmean, Gmean, Bmean;      /* cached R / Count, ... (can pass 255) */
    struct Cell          *Next;
 }  Cell;
 
 #define                 FREECELLSBLOCKSIZE 100
+#define                 CELLSLABSIZE 8192         /* cells per slab (256 KB) */
+#define                 CELLSLABALIGN 64          /* slab alignment (cache line) */
+#define                 DECSLICEBLOCK 64          /* sets per block dealt to decimation slices */
 
 extern Cell             *FreeCells;
+extern int              MaxSetCells;
 
 extern Cell **Create_Initial_BGM(FrmBuf *FB);
+extern void Save_BGM(char *FileName, Cell **BGM, int Width, int Height);
+extern Cell **Restore_BGM(char *FileName, int *Width, int *Height);
 extern void Process_Frame_FG(Cell **BGM, FrmBuf *FB, int Epsilon, int Cth);
+extern void Process_Frame_FG_Mask(Cell **BGM, FrmBuf *FB, unsigned char *Mask, int Epsilon, int Cth);
 extern void Process_Frame_BG(Cell **BGM, FrmBuf *FB, int Epsilon, int Cth);
 extern void Process_Frame_PD_Map(Cell **BGM, FrmBuf *FB, int Epsilon, int Cth);
 extern void Create_BG_Frame(Cell **BGM, FrmBuf *FB);
 extern void Create_PD_Map(Cell **BGM, FrmBuf *FB);
 extern int Decimate_BGM(Cell **BGM, int Cth, int NumSets);
+extern int Decimate_BGM_Slice(Cell **BGM, int Cth, int NumSets, int Slice, int NumSlices);
+extern int Compact_BGM(Cell **BGM, int NumSets);
+extern int Bound_BGM(Cell **BGM, int NumSets, int MaxCells);
+extern long Live_Cells();
 extern Pixel Rainbow_Lookup(int Index);
+extern Cell *Pool_Allocate_Cell(Cell **Pool);
 extern Cell *Allocate_Cell();
 extern Cell *Last_Cell(Cell *ThisCell);
 extern int  Length(Cell *ThisCell);
+extern Cell *Pool_Free_Cell(Cell **Pool, Cell *ThisCell);
 extern Cell *Free_Cell(Cell *ThisCell);
 extern Cell *TrimSort(Cell *List, int Length);
 extern void Print_Cell(Cell *ThisCell);
 extern void Print_Set(int Index, Cell *ThisCell);
 extern Cell *Ratio_Match_Pixel(Pixel *P, Cell *Cells, int Epsilon);
 extern Cell *Scalar_Match_Pixel(Pixel *P, Cell *Cells, int Epsilon);
+extern Cell *Add_Cell(Pixel *P, Cell *Set, int Cth);
+extern Cell *Pool_Add_Cell(Cell **Pool, Pixel *P, Cell *Set, int Cth);
 extern Cell *Match_Cell(Cell *NewCell, Cell *Cells, int Epsilon);
 extern void Compute_Set_Demographics(FILE *Log, int N, Cell **BGM, int NumSets);
 extern void Color_Lock(Cell *Cells, int Clear);
+
+/* Mode array background model: a fixed-slot alternative to the Cell
+list BGM. Each pixel holds up to MaxModes modes. Pixels are grouped in
+NumBlocks blocks of MODEBLOCK, and mode M of a block is one ModeRow,
+packing the R, G, B and Count of that mode for every pixel of the
+block, one lane per pixel. Rows are stored in mode planes: plane M
+holds the mode M rows of all blocks in pixel order, so a linear pixel
+scan streams through one plane per live mode, never touches unused
+modes, and a match touches two cache lines. MODE_ROWS(BGM, I) is the
+mode 0 row of pixel I, mode M being NumBlocks rows on; its lane is
+I % MODEBLOCK. Mode M of pixel I has slot index MODE_INDEX(BGM, I, M),
+MODE_STRIDE(BGM) slots on from mode M - 1; MODE_R(BGM, J) etc. name the
+fields of slot J. Modes keep no cached means: MODE_NEAR(Sum, Count, V,
+Epsilon) tests abs(V - Sum / Count) <= Epsilon exactly with a multiply,
+since the truncated quotient is within Epsilon of V just when
+Sum - (V - Epsilon) * Count lies in [0, (2 Epsilon + 1) * Count). */
+
+#define                 MAXMODES 8
+#define                 MODEBLOCK 8
+#define                 SIMD_NONE 0
+#define                 SIMD_SSE4 1
+#define                 SIMD_AVX2 2
+#if defined(__x86_64__) || defined(__i386__)
+#define                 MODE_X86 1                /* x86 SIMD foreground kernels (mmmsimd.c) */
+#else
+#define                 MODE_X86 0
+#endif
+
+typedef struct          ModeRow {
+   int                  R[MODEBLOCK], G[MODEBLOCK], B[MODEBLOCK], Count[MODEBLOCK];
+}  ModeRow;
+
+typedef struct          ModeBGM {
+   int                  NumSets, NumBlocks, MaxModes;
+   ModeRow              *Rows;
+   unsigned char        *Modes;
+}  ModeBGM;
+
+#define                 MODE_STRIDE(BGM) ((BGM)->NumBlocks * MODEBLOCK)
+#define                 MODE_INDEX(BGM, I, M) ((M) * MODE_STRIDE(BGM) + (I))
+#define                 MODE_ROWS(BGM, I) (&((BGM)->Rows[(I) / MODEBLOCK]))
+#define                 MODE_ROW(BGM, J) ((BGM)->Rows[(unsigned) (J) / MODEBLOCK])
+#define                 MODE_R(BGM, J) (MODE_ROW(BGM, J).R[(unsigned) (J) % MODEBLOCK])
+#define                 MODE_G(BGM, J) (MODE_ROW(BGM, J).G[(unsigned) (J) % MODEBLOCK])
+#define                 MODE_B(BGM, J) (MODE_ROW(BGM, J).B[(unsigned) (J) % MODEBLOCK])
+#define                 MODE_COUNT(BGM, J) (MODE_ROW(BGM, J).Count[(unsigned) (J) % MODEBLOCK])
+#define                 MODE_NEAR(Sum, Count, V, Epsilon) \
+                        ((unsigned) ((Sum) - ((V) - (Epsilon)) * (Count)) < (unsigned) ((2 * (Epsilon) + 1) * (Count)))
+
+extern ModeBGM *Create_Initial_Mode_BGM(FrmBuf *FB, int MaxModes);
+extern void Free_Mode_BGM(ModeBGM *BGM);
+extern void Save_Mode_BGM(char *FileName, ModeBGM *BGM, int Width, int Height);
+extern ModeBGM *Restore_Mode_BGM(char *FileName, int *Width, int *Height);
+extern int Bound_Mode_BGM(ModeBGM *BGM, int MaxModes);
+extern int Ratio_Match_Mode(ModeBGM *BGM, int I, Pixel *P, int Epsilon);
+extern int Add_Mode(ModeBGM *BGM, int I, Pixel *P, int Cth);
+extern int Predominant_Mode(ModeBGM *BGM, int I, int *TotalCount);
+extern void Process_Frame_FG_Modes(ModeBGM *BGM, FrmBuf *FB, int Epsilon, int Cth);
+extern void Process_Frame_FG_Modes_SIMD(ModeBGM *BGM, FrmBuf *FB, int Epsilon, int Cth, int Level);
+extern void Process_Frame_FG_Modes_Mask(ModeBGM *BGM, FrmBuf *FB, unsigned char *Mask, int Epsilon, int Cth, int Level);
+extern int Mode_SIMD_Level();
+#if MODE_X86
+extern void Process_Blocks_FG_SSE4(ModeBGM *BGM, FrmBuf *FB, unsigned char *Mask, int Epsilon, int Cth, int FirstBlk, int LastBlk);
+extern void Process_Blocks_FG_AVX2(ModeBGM *BGM, FrmBuf *FB, unsigned char *Mask, int Epsilon, int Cth, int FirstBlk, int LastBlk);
+#endif
+extern void Process_Frame_BG_Modes(ModeBGM *BGM, FrmBuf *FB, int Epsilon, int Cth);
+extern void Create_BG_Frame_Modes(ModeBGM *BGM, FrmBuf *FB);
+extern int Decimate_Mode_BGM(ModeBGM *BGM, int Cth);
+extern int Decimate_Mode_BGM_Slice(ModeBGM *BGM, int Cth, int Slice, int NumSlices);
+
+/* Threaded processing over row bands of a worker pool (workers.h).
+Each band allocates cells from its own free list in BandCells. */
+
+extern Cell             *BandCells[MAXBANDS];
+
+extern void Process_Frame_FG_Threaded(Workers *W, Cell **BGM, FrmBuf *FB, unsigned char *Mask, int Epsilon, int Cth);
+extern void Process_Frame_BG_Threaded(Workers *W, Cell **BGM, FrmBuf *FB, int Epsilon, int Cth);
+extern int Decimate_BGM_Threaded(Workers *W, Cell **BGM, int Cth, int Width, int Height);
+extern int Decimate_BGM_Slice_Threaded(Workers *W, Cell **BGM, int Cth, int Width, int Height, int Slice, int NumSlices);
+extern void Process_Frame_FG_Modes_Threaded(Workers *W, ModeBGM *BGM, FrmBuf *FB, unsigned char *Mask, int Epsilon, int Cth, int Level);
+extern void Process_Frame_BG_Modes_Threaded(Workers *W, ModeBGM *BGM, FrmBuf *FB, int Epsilon, int Cth);
+extern int Decimate_Mode_BGM_Threaded(Workers *W, ModeBGM *BGM, int Cth);
+extern int Decimate_Mode_BGM_Slice_Threaded(Workers *W, ModeBGM *BGM, int Cth, int Slice, int NumSlices);
+
+/* Background model snapshot file header (see Save_BGM). */
+
+typedef struct          Snapshot {
+   char                 Magic[8];
+   int                  Version, ByteOrder, Kind, Width, Height, MaxModes;
+   long long            NumCells, SetsOffset, CellsOffset;
+}  Snapshot;
+
+#define                 SNAPMAGIC "MMMSNAP"     /* with its NUL, fills Magic */
+#define                 SNAPVERSION 2
+#define                 SNAPBYTEORDER 0x01020304
+#define                 SNAPALIGN 64
+#define                 SNAPLIST 0
+#define                 SNAPMODES 1
@@ -0,0 +1,247 @@
+/*                     Multi Modal Mean SIMD Kernels
+
+This file holds the x86 vectorized foreground kernels behind
+Process_Frame_FG_Modes_SIMD. It is kept apart from mmm.c so the
+makefile can build it optimized (-O2) while the rest of the program
+keeps the debug flags: at -O0 every intrinsic becomes a call through
+the stack and the kernels run two to five times slower than the
+scalar routine, so --simd only pays off in an optimized build.
+
+Part of the Virtual Blue-Screen program (P3-1).
+
+Documentation:
+
+The kernels match one MODEBLOCK group of pixels per step, one lane
+per pixel, against the group's ModeRow in each mode plane of a
+ModeBGM (see mmm.h). Results are bit-identical to
+Process_Modes_FG. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "utils.h"
+#include "workers.h"
+#include "mmm.h"
+
+#if MODE_X86
+
+#include <immintrin.h>
+
+/* Test abs(V - Sum / Count) <= Epsilon in each lane without dividing
+(see MODE_NEAR in mmm.h). Low holds V - Epsilon and Last holds
+(2 Epsilon + 1) Count - 1; the difference Sum - Low Count is compared
+unsigned against Last through an unsigned minimum. A lane is all ones
+when near. */
+
+__attribute__((target("sse4.1")))
+static inline __m128i Mode_Near_SSE4(__m128i Sum, __m128i Count, __m128i Low, __m128i Last) {
+
+   __m128i              D;
+
+   D = _mm_sub_epi32(Sum, _mm_mullo_epi32(Low, Count));
+   return (_mm_cmpeq_epi32(_mm_min_epu32(D, Last), D));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i Mode_Near_AVX2(__m256i Sum, __m256i Count, __m256i Low, __m256i Last) {
+
+   __m256i              D;
+
+   D = _mm256_sub_epi32(Sum, _mm256_mullo_epi32(Low, Count));
+   return (_mm256_cmpeq_epi32(_mm256_min_epu32(D, Last), D));
+}
+
+/* Black out the background pixels of a MODEBLOCK group. Lo and Hi hold
+the lane masks of pixels 0..3 and 4..7; they are narrowed to one byte
+per pixel and spread over the packed RGB bytes for a blend with
+black. */
+
+__attribute__((target("sse4.1")))
+static inline void Blackout_Block(unsigned char *Frm, __m128i Px0, __m128i Px1, __m128i Lo, __m128i Hi) {
+
+   const __m128i        Spread0 = _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+   const __m128i        Spread1 = _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+   __m128i              Mask;
+
+   Mask = _mm_packs_epi32(Lo, Hi);
+   Mask = _mm_packs_epi16(Mask, Mask);
+   Px0 = _mm_blendv_epi8(Px0, _mm_setzero_si128(), _mm_shuffle_epi8(Mask, Spread0));
+   Px1 = _mm_blendv_epi8(Px1, _mm_setzero_si128(), _mm_shuffle_epi8(Mask, Spread1));
+   _mm_storeu_si128((__m128i *) Frm, Px0);
+   _mm_storel_epi64((__m128i *) (Frm + 16), Px1);
+}
+
+/* Write the foreground mask bytes of a MODEBLOCK group. Lo and Hi hold
+the background lane masks of pixels 0..3 and 4..7 and PxLo and PxHi
+their packed R | G | B values; a mask byte is 1 for non-background,
+non-black pixels. */
+
+__attribute__((target("sse4.1")))
+static inline void Mask_Block(unsigned char *Mask, __m128i Lo, __m128i Hi, __m128i PxLo, __m128i PxHi) {
+
+   __m128i              Off;
+
+   Lo = _mm_or_si128(Lo, _mm_cmpeq_epi32(PxLo, _mm_setzero_si128()));
+   Hi = _mm_or_si128(Hi, _mm_cmpeq_epi32(PxHi, _mm_setzero_si128()));
+   Off = _mm_packs_epi32(Lo, Hi);
+   Off = _mm_packs_epi16(Off, Off);
+   _mm_storel_epi64((__m128i *) Mask, _mm_andnot_si128(Off, _mm_set1_epi8(1)));
+}
+
+/* Match the complete MODEBLOCK groups of pixels from FirstBlk to
+LastBlk (exclusive), one group per iteration as two four lane halves,
+one lane per pixel. Each half is deinterleaved from packed RGB
+with byte shuffles. The group's ModeRow is walked down its mode
+planes, NumBlocks rows per mode, and each half loads its four lanes
+of a field directly from the row and tests them without dividing. */
+
+__attribute__((target("sse4.1")))
+void Process_Blocks_FG_SSE4(ModeBGM *BGM, FrmBuf *FB, unsigned char *Mask, int Epsilon, int Cth, int FirstBlk, int LastBlk) {
+
+   const __m128i        ShufR = _mm_setr_epi8(0, 3, 6, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+   const __m128i        ShufG = _mm_setr_epi8(1, 4, 7, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+   const __m128i        ShufB = _mm_setr_epi8(2, 5, 8, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+   const __m128i        Eps = _mm_set1_epi32(Epsilon);
+   const __m128i        Span = _mm_set1_epi32(2 * Epsilon + 1);
+   const __m128i        Young = _mm_set1_epi32(Cth - 1);
+   const __m128i        One = _mm_set1_epi32(1);
+   __m128i              Px0, Px1, Px, PR, PG, PB, Modes, Slot, Active, Done, Hit, Match, R, G, B, Count;
+   __m128i              LR, LG, LB, Last, BG[2], Lit[2];
+   unsigned char        *Frm;
+   ModeRow              *Row;
+   int                  Blk, Half, M, K, Lane, Miss;
+
+   for (Blk = FirstBlk; Blk < LastBlk; Blk++) {
+      Frm = &(FB->Frm[Blk * MODEBLOCK * 3]);
+      Px0 = _mm_loadu_si128((__m128i *) Frm);                    /* pixels 0..5 (and a third) */
+      Px1 = _mm_loadl_epi64((__m128i *) (Frm + 16));             /* rest of pixels 5..7 */
+      Miss = 0;
+      for (Half = 0; Half < 2; Half++) {
+         Px = Half ? _mm_alignr_epi8(Px1, Px0, 12) : Px0;        /* pixels 4 Half .. 4 Half + 3 */
+         PR = _mm_cvtepu8_epi32(_mm_shuffle_epi8(Px, ShufR));
+         PG = _mm_cvtepu8_epi32(_mm_shuffle_epi8(Px, ShufG));
+         PB = _mm_cvtepu8_epi32(_mm_shuffle_epi8(Px, ShufB));
+         Modes = _mm_cvtepu8_epi32(_mm_loadu_si32(&(BGM->Modes[Blk * MODEBLOCK + 4 * Half])));
+         LR = _mm_sub_epi32(PR, Eps);
+         LG = _mm_sub_epi32(PG, Eps);
+         LB = _mm_sub_epi32(PB, Eps);
+         Done = Hit = _mm_setzero_si128();
+         K = 4 * Half;
+         for (M = 0, Row = &(BGM->Rows[Blk]); M < BGM->MaxModes; M++, Row += BGM->NumBlocks) {
+            Slot = _mm_set1_epi32(M);
+            Active = _mm_andnot_si128(Done, _mm_cmpgt_epi32(Modes, Slot)); /* unmatched lanes with mode M */
+            if (_mm_testz_si128(Active, Active))
+               break;
+            R = _mm_load_si128((__m128i *) &(Row->R[K]));
+            G = _mm_load_si128((__m128i *) &(Row->G[K]));
+            B = _mm_load_si128((__m128i *) &(Row->B[K]));
+            Count = _mm_load_si128((__m128i *) &(Row->Count[K]));
+            Last = _mm_sub_epi32(_mm_mullo_epi32(Count, Span), One);
+            Match = _mm_and_si128(Mode_Near_SSE4(R, Count, LR, Last), Mode_Near_SSE4(G, Count, LG, Last));
+            Match = _mm_and_si128(Match, Mode_Near_SSE4(B, Count, LB, Last));
+            Match = _mm_and_si128(Match, Active);                /* within epsilon in all components */
+            if (_mm_testz_si128(Match, Match))
+               continue;
+            R = _mm_add_epi32(R, _mm_and_si128(Match, PR));
+            G = _mm_add_epi32(G, _mm_and_si128(Match, PG));
+            B = _mm_add_epi32(B, _mm_and_si128(Match, PB));
+            Count = _mm_sub_epi32(Count, Match);
+            _mm_store_si128((__m128i *) &(Row->R[K]), R);
+            _mm_store_si128((__m128i *) &(Row->G[K]), G);
+            _mm_store_si128((__m128i *) &(Row->B[K]), B);
+            _mm_store_si128((__m128i *) &(Row->Count[K]), Count);
+            Hit = _mm_blendv_epi8(Hit, Count, Match);           /* remember matched mode count */
+            Done = _mm_or_si128(Done, Match);
+         }
+         BG[Half] = _mm_and_si128(Done, _mm_cmpgt_epi32(Hit, Young)); /* background lanes */
+         Lit[Half] = _mm_or_si128(_mm_or_si128(PR, PG), PB);
+         Miss |= (~_mm_movemask_ps(_mm_castsi128_ps(Done)) & 0xF) << (4 * Half);
+      }
+      if (Mask)
+         Mask_Block(&(Mask[Blk * MODEBLOCK]), BG[0], BG[1], Lit[0], Lit[1]);
+      else if (!_mm_testz_si128(_mm_or_si128(BG[0], BG[1]), _mm_or_si128(BG[0], BG[1])))
+         Blackout_Block(Frm, Px0, Px1, BG[0], BG[1]);
+      for (Lane = 0; Miss; Lane++, Miss >>= 1)                  /* add modes for unmatched lanes */
+         if (Miss & 1)
+            Add_Mode(BGM, Blk * MODEBLOCK + Lane, (Pixel *) &(Frm[Lane * 3]), Cth);
+   }
+}
+
+/* Match the complete MODEBLOCK groups of pixels from FirstBlk to
+LastBlk (exclusive), one group per iteration, one lane per
+pixel. Pixels are deinterleaved from packed RGB with byte shuffles.
+The group's ModeRow is walked down its mode planes, NumBlocks rows
+per mode, so each field of a mode is one aligned eight lane load, and
+the sums and counts are tested in place without dividing. */
+
+__attribute__((target("avx2")))
+void Process_Blocks_FG_AVX2(ModeBGM *BGM, FrmBuf *FB, unsigned char *Mask, int Epsilon, int Cth, int FirstBlk, int LastBlk) {
+
+   const __m128i        ShufR0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+   const __m128i        ShufR1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, -1, -1, -1, -1, -1, -1, -1, -1);
+   const __m128i        ShufG0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+   const __m128i        ShufG1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, -1, -1, -1, -1, -1, -1, -1, -1);
+   const __m128i        ShufB0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+   const __m128i        ShufB1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+   const __m256i        Eps = _mm256_set1_epi32(Epsilon);
+   const __m256i        Span = _mm256_set1_epi32(2 * Epsilon + 1);
+   const __m256i        Young = _mm256_set1_epi32(Cth - 1);
+   const __m256i        One = _mm256_set1_epi32(1);
+   __m128i              Px0, Px1;
+   __m256i              PR, PG, PB, Modes, Slot, Active, Done, Hit, Match, R, G, B, Count, LR, LG, LB, Last, Lit;
+   unsigned char        *Frm;
+   ModeRow              *Row;
+   int                  Blk, M, Lane, Miss;
+
+   for (Blk = FirstBlk; Blk < LastBlk; Blk++) {
+      Frm = &(FB->Frm[Blk * MODEBLOCK * 3]);
+      Px0 = _mm_loadu_si128((__m128i *) Frm);                    /* pixels 0..5 (and a third) */
+      Px1 = _mm_loadl_epi64((__m128i *) (Frm + 16));             /* rest of pixels 5..7 */
+      PR = _mm256_cvtepu8_epi32(_mm_or_si128(_mm_shuffle_epi8(Px0, ShufR0), _mm_shuffle_epi8(Px1, ShufR1)));
+      PG = _mm256_cvtepu8_epi32(_mm_or_si128(_mm_shuffle_epi8(Px0, ShufG0), _mm_shuffle_epi8(Px1, ShufG1)));
+      PB = _mm256_cvtepu8_epi32(_mm_or_si128(_mm_shuffle_epi8(Px0, ShufB0), _mm_shuffle_epi8(Px1, ShufB1)));
+      Modes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *) &(BGM->Modes[Blk * MODEBLOCK])));
+      LR = _mm256_sub_epi32(PR, Eps);
+      LG = _mm256_sub_epi32(PG, Eps);
+      LB = _mm256_sub_epi32(PB, Eps);
+      Done = Hit = _mm256_setzero_si256();
+      for (M = 0, Row = &(BGM->Rows[Blk]); M < BGM->MaxModes; M++, Row += BGM->NumBlocks) {
+         Slot = _mm256_set1_epi32(M);
+         Active = _mm256_andnot_si256(Done, _mm256_cmpgt_epi32(Modes, Slot)); /* unmatched lanes with mode M */
+         if (_mm256_testz_si256(Active, Active))
+            break;
+         R = _mm256_load_si256((__m256i *) Row->R);
+         G = _mm256_load_si256((__m256i *) Row->G);
+         B = _mm256_load_si256((__m256i *) Row->B);
+         Count = _mm256_load_si256((__m256i *) Row->Count);
+         Last = _mm256_sub_epi32(_mm256_mullo_epi32(Count, Span), One);
+         Match = _mm256_and_si256(Mode_Near_AVX2(R, Count, LR, Last), Mode_Near_AVX2(G, Count, LG, Last));
+         Match = _mm256_and_si256(Match, Mode_Near_AVX2(B, Count, LB, Last));
+         Match = _mm256_and_si256(Match, Active);               /* within epsilon in all components */
+         if (_mm256_testz_si256(Match, Match))
+            continue;
+         R = _mm256_add_epi32(R, _mm256_and_si256(Match, PR));
+         G = _mm256_add_epi32(G, _mm256_and_si256(Match, PG));
+         B = _mm256_add_epi32(B, _mm256_and_si256(Match, PB));
+         Count = _mm256_sub_epi32(Count, Match);
+         _mm256_store_si256((__m256i *) Row->R, R);
+         _mm256_store_si256((__m256i *) Row->G, G);
+         _mm256_store_si256((__m256i *) Row->B, B);
+         _mm256_store_si256((__m256i *) Row->Count, Count);
+         Hit = _mm256_blendv_epi8(Hit, Count, Match);           /* remember matched mode count */
+         Done = _mm256_or_si256(Done, Match);
+      }
+      Match = _mm256_and_si256(Done, _mm256_cmpgt_epi32(Hit, Young)); /* background lanes */
+      if (Mask) {
+         Lit = _mm256_or_si256(_mm256_or_si256(PR, PG), PB);
+         Mask_Block(&(Mask[Blk * MODEBLOCK]), _mm256_castsi256_si128(Match), _mm256_extracti128_si256(Match, 1),
+                    _mm256_castsi256_si128(Lit), _mm256_extracti128_si256(Lit, 1));
+      } else if (!_mm256_testz_si256(Match, Match))
+         Blackout_Block(Frm, Px0, Px1, _mm256_castsi256_si128(Match), _mm256_extracti128_si256(Match, 1));
+      Miss = ~_mm256_movemask_ps(_mm256_castsi256_ps(Done)) & 0xFF;
+      for (Lane = 0; Miss; Lane++, Miss >>= 1)                  /* add modes for unmatched lanes */
+         if (Miss & 1)
+            Add_Mode(BGM, Blk * MODEBLOCK + Lane, (Pixel *) &(Frm[Lane * 3]), Cth);
+   }
+}
+
+#endif
@@ -0,0 +1,268 @@
+/*                     Sequence Packs
+
+This library stores a numbered JPEG sequence in a single indexed pack
+file, and decodes its frames straight from a memory mapping.
+
+Part of the Virtual Blue-Screen program (P3-1).
+
+Documentation:
+
+A pack is a header, an index with one entry per frame, and the JPEG
+files of the frames concatenated unchanged. Each index entry gives the
+frame number, the payload offset and size, the image width and height
+and the modification time of the original file. Entries are in frame
+order; numbers may have gaps. The pack is in the byte order of the
+machine that wrote it.
+
+Write_Pack converts a sequence directory (files named NNNNN.jpg, as in
+InSeq/00001.jpg) into a pack. Open_Pack maps the whole pack with a
+single mmap, so opening a sequence costs one open and one mmap however
+many frames it has; index entries and payloads are only paged in when
+used. Decode_Pack_Frame decodes a frame with a decoder context straight
+from the mapping (jpeg_mem_src), with no file access at all. A pack
+may be shared by any number of decoder threads.
+
+Key Usage Functions:
+
+Write_Pack(): Packs a sequence directory into a pack file.
+
+Open_Pack(): Maps a pack file.
+
+Find_Pack_Frame(): Returns the index entry of a frame number.
+
+Decode_Pack_Frame(): Decodes a frame of a pack into a frame buffer.
+
+Close_Pack(): Unmaps a pack.
+
+Example:
+
+   Pack                 *P;
+   Decoder              *D;
+
+   Write_Pack("InSeq", "InSeq.pack");
+   P = Open_Pack("InSeq.pack");
+   D = Create_Decoder();
+   for (N = Start; N <= End; N += Step)
+      if (!Decode_Pack_Frame(D, P, N, FB))
+         exit(1);
+   Free_Decoder(D);
+   Close_Pack(P);
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "utils.h"
+#include "pack.h"
+
+/*              Frame Number
+
+This routine returns the frame number of a sequence file name
+(NNNNN.jpg), or -1 if it is not a frame. */
+
+static int Frame_Number(const char *FileName) {
+
+   int                  N, Used = 0;
+
+   if (sscanf(FileName, "%d.jpg%n", &N, &Used) != 1 || Used == 0 || FileName[Used] != '\0' ||
+       FileName[0] < '0' || FileName[0] > '9')
+      return (-1);
+   return (N);
+}
+
+static int Select_Frame(const struct dirent *Entry) {
+
+   return (Frame_Number(Entry->d_name) >= 0);
+}
+
+static int Compare_Frames(const struct dirent **A, const struct dirent **B) {
+
+   return (Frame_Number((*A)->d_name) - Frame_Number((*B)->d_name));
+}
+
+/*              Write Pack
+
+This routine packs the frames of a sequence directory into a pack
+file. Frame sizes are read from the JPEG headers with a decoder
+context. If a frame cannot be read or has an invalid header, or the
+pack cannot be written, an error message is printed and execution
+terminates. */
+
+void Write_Pack(char *Dir, char *Name) {
+
+   struct dirent        **List;
+   struct stat          Info;
+   Pack_Header          Header;
+   Pack_Entry           *Index;
+   FILE                 *In, *Out;
+   Decoder              *D;
+   unsigned char        *Data = NULL;
+   char                 Path[1024];
+   uint64_t             Offset;
+   int                  N, K, Width, Height;
+
+   N = scandir(Dir, &List, Select_Frame, Compare_Frames);
+   if (N < 0) {
+      fprintf(stderr, "ERROR: %s cannot be scanned\n", Dir);
+      exit(1);
+   }
+   Index = (Pack_Entry *) calloc(N + 1, sizeof(Pack_Entry));
+   Out = fopen(Name, "wb");
+   if (Index == NULL || Out == NULL) {
+      fprintf(stderr, "ERROR: %s cannot be created\n", Name);
+      exit(1);
+   }
+   memcpy(Header.Magic, PACKMAGIC, sizeof(Header.Magic));
+   Header.NumFrames = N;
+   Header.EntrySize = sizeof(Pack_Entry);
+   Offset = sizeof(Pack_Header) + (uint64_t) N * sizeof(Pack_Entry);
+   if (fseek(Out, Offset, SEEK_SET) != 0) {                  /* the index is written last */
+      fprintf(stderr, "can't write %s\n", Name);
+      exit(1);
+   }
+   D = Create_Decoder();
+   for (K = 0; K < N; K++) {
+      snprintf(Path, sizeof(Path), "%s/%s", Dir, List[K]->d_name);
+      In = fopen(Path, "rb");
+      if (In == NULL || fstat(fileno(In), &Info) != 0) {
+         fprintf(stderr, "ERROR: %s cannot be opened\n", Path);
+         exit(1);
+      }
+      Data = (unsigned char *) realloc(Data, Info.st_size + 1);
+      if (Data == NULL || fread(Data, 1, Info.st_size, In) != (size_t) Info.st_size) {
+         fprintf(stderr, "ERROR: %s cannot be read\n", Path);
+         exit(1);
+      }
+      fclose(In);
+      if (!Read_Header(D, Path, &Width, &Height))
+         exit(1);
+      Index[K].Offset = Offset;
+      Index[K].Size = Info.st_size;
+      Index[K].Number = Frame_Number(List[K]->d_name);
+      Index[K].Width = Width;
+      Index[K].Height = Height;
+      Index[K].Time = (int64_t) Info.st_mtim.tv_sec * 1000000 + Info.st_mtim.tv_nsec / 1000;
+      if (fwrite(Data, 1, Info.st_size, Out) != (size_t) Info.st_size) {
+         fprintf(stderr, "can't write %s\n", Name);
+         exit(1);
+      }
+      Offset += Info.st_size;
+      free(List[K]);
+   }
+   free(List);
+   free(Data);
+   Free_Decoder(D);
+   if (fseek(Out, 0, SEEK_SET) != 0 || fwrite(&Header, sizeof(Header), 1, Out) != 1 ||
+       (N > 0 && fwrite(Index, sizeof(Pack_Entry), N, Out) != (size_t) N) || fclose(Out) != 0) {
+      fprintf(stderr, "can't write %s\n", Name);
+      exit(1);
+   }
+   free(Index);
+}
+
+/*              Open Pack
+
+This routine maps a pack file read only, with a single mmap. If the
+pack cannot be opened or is not a valid pack, an error message is
+printed and execution terminates. */
+
+Pack *Open_Pack(char *Name) {
+
+   Pack                 *P;
+   Pack_Header          *Header;
+   struct stat          Info;
+   int                  FD;
+
+   P = (Pack *) malloc(sizeof(Pack));
+   if (P == NULL || (P->Name = strdup(Name)) == NULL) {
+      fprintf(stderr, "Unable to allocate pack\n");
+      exit(1);
+   }
+   FD = open(Name, O_RDONLY);
+   if (FD < 0 || fstat(FD, &Info) != 0) {
+      fprintf(stderr, "ERROR: %s cannot be opened\n", Name);
+      exit(1);
+   }
+   P->Size = Info.st_size;
+   P->Map = (P->Size < sizeof(Pack_Header)) ? MAP_FAILED :
+      (unsigned char *) mmap(NULL, P->Size, PROT_READ, MAP_SHARED, FD, 0);
+   close(FD);
+   Header = (Pack_Header *) P->Map;
+   if (P->Map == MAP_FAILED || memcmp(Header->Magic, PACKMAGIC, sizeof(Header->Magic)) != 0 ||
+       Header->EntrySize != sizeof(Pack_Entry) ||
+       sizeof(Pack_Header) + (uint64_t) Header->NumFrames * sizeof(Pack_Entry) > P->Size) {
+      fprintf(stderr, "ERROR: %s is not a sequence pack\n", Name);
+      exit(1);
+   }
+   madvise(P->Map, P->Size, MADV_SEQUENTIAL);
+   P->NumFrames = Header->NumFrames;
+   P->Index = (Pack_Entry *) (P->Map + sizeof(Pack_Header));
+   return (P);
+}
+
+/*              Find Pack Frame
+
+This routine returns the index entry of frame number N, or NULL if the
+pack does not hold it. Sequences without gaps are indexed directly;
+otherwise the index is searched. */
+
+Pack_Entry *Find_Pack_Frame(Pack *P, int N) {
+
+   int                  Low = 0, High = P->NumFrames - 1, Mid;
+
+   if (P->NumFrames == 0)
+      return (NULL);
+   Mid = N - (int) P->Index[0].Number;
+   if (Mid >= 0 && Mid < P->NumFrames && (int) P->Index[Mid].Number == N)
+      return (&(P->Index[Mid]));
+   while (Low <= High) {
+      Mid = (Low + High) / 2;
+      if ((int) P->Index[Mid].Number == N)
+         return (&(P->Index[Mid]));
+      if ((int) P->Index[Mid].Number < N)
+         Low = Mid + 1;
+      else
+         High = Mid - 1;
+   }
+   return (NULL);
+}
+
+/*              Decode Pack Frame
+
+This routine decodes frame number N of a pack into a preallocated
+frame buffer, from the mapping, returning TRUE. If the pack does not
+hold the frame or it cannot be decoded, an error message is printed
+and FALSE is returned. */
+
+int Decode_Pack_Frame(Decoder *D, Pack *P, int N, FrmBuf *FB) {
+
+   Pack_Entry           *E;
+   char                 Name[1024];
+
+   snprintf(Name, sizeof(Name), "%s:%05d", P->Name, N);
+   E = Find_Pack_Frame(P, N);
+   if (E == NULL) {
+      fprintf(stderr, "ERROR: %s cannot be opened\n", Name);
+      return (FALSE);
+   }
+   if (E->Offset > P->Size || E->Size > P->Size - E->Offset) {
+      fprintf(stderr, "ERROR: %s lies outside the pack\n", Name);
+      return (FALSE);
+   }
+   return (Decode_Memory(D, P->Map + E->Offset, E->Size, Name, FB));
+}
+
+/*              Close Pack
+
+This routine unmaps a pack and deallocates it. */
+
+void Close_Pack(Pack *P) {
+
+   munmap(P->Map, P->Size);
+   free(P->Name);
+   free(P);
+}
@@ -0,0 +1,39 @@
+/*                     Sequence Packs
+
+This library stores a numbered JPEG sequence in a single indexed pack
+file, and decodes its frames straight from a memory mapping.
+
+Part of the Virtual Blue-Screen program (P3-1).               */
+
+#include <stdint.h>
+
+typedef struct          Pack_Header {
+   char                 Magic[8];                 /* PACKMAGIC */
+   uint32_t             NumFrames;
+   uint32_t             EntrySize;                /* sizeof(Pack_Entry), checks the layout */
+}  Pack_Header;
+
+typedef struct          Pack_Entry {
+   uint64_t             Offset;                   /* JPEG payload, from the start of the pack */
+   uint32_t             Size;
+   uint32_t             Number;                   /* frame number, entries are in frame order */
+   uint16_t             Width, Height;
+   uint32_t             Unused;
+   int64_t              Time;                     /* file modification time, microseconds */
+}  Pack_Entry;
+
+typedef struct          Pack {
+   char                 *Name;
+   unsigned char        *Map;                     /* the whole pack, mapped read only */
+   size_t               Size;
+   int                  NumFrames;
+   Pack_Entry           *Index;
+}  Pack;
+
+#define                 PACKMAGIC "SEQPACK1"
+
+extern void Write_Pack(char *Dir, char *Name);
+extern Pack *Open_Pack(char *Name);
+extern Pack_Entry *Find_Pack_Frame(Pack *P, int N);
+extern int Decode_Pack_Frame(Decoder *D, Pack *P, int N, FrmBuf *FB);
+extern void Close_Pack(Pack *P);
@@ -0,0 +1,220 @@
+/*                     Frame Reader
+
+This library decodes a numbered JPEG sequence ahead of its consumer,
+filling a ring of preallocated frame buffers from one or more decoder
+threads.
+
+Part of the Virtual Blue-Screen program (P3-1).
+
+Documentation:
+
+A reader owns NumSlots frame buffers, allocated up front, and
+NumThreads decoder threads, each with its own reusable JPEG decoder
+context (set to the reader's decode scale). Frame K of the sequence (numbered First + K * Step) is
+decoded by Decode_Image into slot K % NumSlots, so
+decoding runs up to NumSlots - 1 frames ahead of the frame the
+consumer is working on. When every slot is full the decoders
+wait (backpressure); no frame buffers are allocated after creation.
+
+Read_Frame hands out frames strictly in sequence order. The returned
+frame buffer belongs to the caller until the next call to Read_Frame,
+which recycles its slot. At the end of the sequence Read_Frame returns
+NULL. A frame that cannot be opened or decoded, or is larger than the
+frame buffers, has its error message printed by the decoder thread;
+execution terminates when the failing frame is reached, after all
+earlier frames are handed out, as Load_Image would have.
+
+Key Usage Functions:
+
+Create_Reader(): Creates a reader for a frame sequence and starts its
+decoder threads.
+
+Read_Frame(): Returns the next frame in sequence order, waiting for it
+to be decoded if needed.
+
+Free_Reader(): Stops the decoder threads and deallocates the reader
+and its frame buffers.
+
+Example:
+
+   Reader               *R;
+   FrmBuf               *FB;
+   int                  N;
+
+   R = Create_Reader("InSeq/%05d.jpg", NULL, Start, End, Step, Width, Height, 1, FALSE, 4, 1);
+   while ((FB = Read_Frame(R, &N)) != NULL) {
+      ...
+   }
+   Free_Reader(R);
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "utils.h"
+#include "pack.h"
+#include "reader.h"
+
+/*              Decoder Thread
+
+This routine is the body of each decoder thread. It claims the next
+undecoded frame once its slot is free, decodes it and marks the slot
+filled. */
+
+static void *Decoder_Thread(void *Arg) {
+
+   Reader               *R = (Reader *) Arg;
+   Decoder              *D = Create_Decoder();
+   char                 FileName[256];
+   int                  K, Slot, Failed;
+
+   Set_Decoder_Scale(D, R->Scale, R->Fast);
+   pthread_mutex_lock(&R->Lock);
+   for (;;) {
+      while (!R->Quit && R->Claimed < R->NumFrames && R->Claimed - R->Consumed >= R->NumSlots - 1)
+         pthread_cond_wait(&R->Room, &R->Lock);
+      if (R->Quit || R->Claimed == R->NumFrames)
+         break;
+      K = R->Claimed;
+      R->Claimed += 1;
+      pthread_mutex_unlock(&R->Lock);
+      Slot = K % R->NumSlots;
+      if (R->Pack)
+         Failed = !Decode_Pack_Frame(D, R->Pack, R->First + K * R->Step, R->Frames[Slot]);
+      else {
+         snprintf(FileName, sizeof(FileName), R->Pattern, R->First + K * R->Step);
+         Failed = !Decode_Image(D, FileName, R->Frames[Slot]);
+      }
+      pthread_mutex_lock(&R->Lock);
+      R->Failed[Slot] = Failed;
+      R->Filled[Slot] = K;
+      pthread_cond_broadcast(&R->Ready);
+   }
+   pthread_mutex_unlock(&R->Lock);
+   Free_Decoder(D);
+   return (NULL);
+}
+
+/*              Create Reader
+
+This routine creates a reader for the frames numbered First to Last
+(inclusive) by Step, with file names given by a printf pattern taking
+the frame number, or if Pack is given, from that pack (which must stay
+open until the reader is freed). Frames are decoded at 1/Scale, with fast decoder
+settings if Fast is set (see Set_Decoder_Scale). NumSlots frame
+buffers of Width x Height (the scaled size; 2 or more, so decoding
+overlaps with the consumer) and NumThreads decoder threads (1 to
+MAXREADERS) are created. If the reader cannot be created, an
+error message is printed and execution terminates. */
+
+Reader *Create_Reader(char *Pattern, Pack *Pack, int First, int Last, int Step, int Width, int Height, int Scale, int Fast, int NumSlots, int NumThreads) {
+
+   Reader               *R;
+   int                  Slot, T;
+
+   if (NumSlots < 2)
+      NumSlots = 2;
+   if (NumThreads < 1)
+      NumThreads = 1;
+   if (NumThreads > MAXREADERS)
+      NumThreads = MAXREADERS;
+   R = (Reader *) malloc(sizeof(Reader));
+   if (R == NULL) {
+      fprintf(stderr, "Unable to allocate frame reader\n");
+      exit (1);
+   }
+   R->Pattern = strdup(Pattern);
+   R->Pack = Pack;
+   R->First = First;
+   R->Step = Step;
+   R->NumFrames = (Last >= First) ? (Last - First) / Step + 1 : 0;
+   R->NumSlots = NumSlots;
+   R->NumThreads = NumThreads;
+   R->Scale = Scale;
+   R->Fast = Fast;
+   R->Claimed = R->Consumed = R->Quit = 0;
+   R->Frames = (FrmBuf **) malloc(NumSlots * sizeof(FrmBuf *));
+   R->Filled = (int *) malloc(NumSlots * sizeof(int));
+   R->Failed = (int *) malloc(NumSlots * sizeof(int));
+   R->Threads = (pthread_t *) malloc(NumThreads * sizeof(pthread_t));
+   if (R->Pattern == NULL || R->Frames == NULL || R->Filled == NULL || R->Failed == NULL || R->Threads == NULL) {
+      fprintf(stderr, "Unable to allocate frame reader\n");
+      exit (1);
+   }
+   for (Slot = 0; Slot < NumSlots; Slot++) {
+      R->Frames[Slot] = Alloc_Frame(Width, Height);
+      if (R->Frames[Slot] == NULL) {
+         fprintf(stderr, "ERROR: frame buffer cannot be allocated\n");
+         exit(1);
+      }
+      R->Filled[Slot] = -1;
+      R->Failed[Slot] = FALSE;
+   }
+   pthread_mutex_init(&R->Lock, NULL);
+   pthread_cond_init(&R->Ready, NULL);
+   pthread_cond_init(&R->Room, NULL);
+   for (T = 0; T < NumThreads; T++)
+      if (pthread_create(&(R->Threads[T]), NULL, Decoder_Thread, R)) {
+         fprintf(stderr, "Unable to start decoder thread\n");
+         exit (1);
+      }
+   return (R);
+}
+
+/*              Read Frame
+
+This routine returns the next frame of the sequence, and its frame
+number in N, waiting until it is decoded. The frame returned by the
+previous call is recycled. At the end of the sequence NULL is
+returned. If the frame could not be decoded, execution terminates
+(its error message was printed when decoding failed). */
+
+FrmBuf *Read_Frame(Reader *R, int *N) {
+
+   int                  K, Slot;
+
+   pthread_mutex_lock(&R->Lock);
+   if (R->Consumed == R->NumFrames) {
+      pthread_mutex_unlock(&R->Lock);
+      return (NULL);
+   }
+   K = R->Consumed;
+   Slot = K % R->NumSlots;
+   R->Consumed += 1;                                    /* previous frame's slot is free */
+   pthread_cond_broadcast(&R->Room);
+   while (R->Filled[Slot] != K)
+      pthread_cond_wait(&R->Ready, &R->Lock);
+   pthread_mutex_unlock(&R->Lock);
+   *N = R->First + K * R->Step;
+   if (R->Failed[Slot])
+      exit(1);
+   return (R->Frames[Slot]);
+}
+
+/*              Free Reader
+
+This routine stops the decoder threads and deallocates the reader and
+its frame buffers. */
+
+void Free_Reader(Reader *R) {
+
+   int                  Slot, T;
+
+   pthread_mutex_lock(&R->Lock);
+   R->Quit = 1;
+   pthread_cond_broadcast(&R->Room);
+   pthread_mutex_unlock(&R->Lock);
+   for (T = 0; T < R->NumThreads; T++)
+      pthread_join(R->Threads[T], NULL);
+   pthread_mutex_destroy(&R->Lock);
+   pthread_cond_destroy(&R->Ready);
+   pthread_cond_destroy(&R->Room);
+   for (Slot = 0; Slot < R->NumSlots; Slot++)
+      Free_Frame(R->Frames[Slot]);
+   free(R->Frames);
+   free(R->Filled);
+   free(R->Failed);
+   free(R->Threads);
+   free(R->Pattern);
+   free(R);
+}
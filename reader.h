@@ -0,0 +1,30 @@
+/*                     Frame Reader
+
+This library decodes a numbered JPEG sequence ahead of its consumer,
+filling a ring of preallocated frame buffers from one or more decoder
+threads.
+
+Part of the Virtual Blue-Screen program (P3-1).               */
+
+#include <pthread.h>
+
+typedef struct          Reader {
+   char                 *Pattern;                 /* printf pattern of frame file names */
+   Pack                 *Pack;                    /* or the pack holding the frames */
+   int                  First, Step, NumFrames;   /* frame K is numbered First + K * Step */
+   int                  NumSlots, NumThreads;
+   int                  Scale, Fast;              /* decoder settings (Set_Decoder_Scale) */
+   int                  Claimed, Consumed, Quit;  /* frames claimed by decoders, handed out */
+   FrmBuf               **Frames;                 /* ring slots, frame K in slot K % NumSlots */
+   int                  *Filled;                  /* frame held by each slot, -1 if none */
+   int                  *Failed;                  /* slot file could not be opened */
+   pthread_t            *Threads;
+   pthread_mutex_t      Lock;
+   pthread_cond_t       Ready, Room;
+}  Reader;
+
+#define                 MAXREADERS 16
+
+extern Reader *Create_Reader(char *Pattern, Pack *Pack, int First, int Last, int Step, int Width, int Height, int Scale, int Fast, int NumSlots, int NumThreads);
+extern FrmBuf *Read_Frame(Reader *R, int *N);
+extern void Free_Reader(Reader *R);
@@ -0,0 +1,61 @@
+/*                  Delta Replayer
+
+This program reconstructs the full composited frames of a delta file
+written by P3-1 --delta, as JPEG files (outdir/outNNNNN.jpg, as P3-1
+would have written them) or as a Y4M or raw RGB24 stream.
+
+Part of the Virtual Blue-Screen program (P3-1).
+
+Usage: replay deltafile outdir|y4m:PATH|rgb:PATH
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "utils.h"
+#include "stream.h"
+#include "delta.h"
+
+int main(int argc, char *argv[]) {
+
+   Delta                *D;
+   Stream               *S = NULL;
+   Encoder              *E = NULL;
+   FrmBuf               *FB;
+   char                 FileName[1024];
+   int                  K, N;
+
+   if (argc != 3) {
+      fprintf(stderr, "usage: %s deltafile outdir|y4m:PATH|rgb:PATH\n", argv[0]);
+      exit(1);
+   }
+   D = Open_Delta(argv[1]);
+   if (strncmp(argv[2], "y4m:", 4) == 0 && argv[2][4])
+      S = Open_Output_Stream(argv[2] + 4, STREAM_Y4M, D->Width, D->Height, Y4MRATE);
+   else if (strncmp(argv[2], "rgb:", 4) == 0 && argv[2][4])
+      S = Open_Output_Stream(argv[2] + 4, STREAM_RGB, D->Width, D->Height, Y4MRATE);
+   else
+      E = Create_Encoder(QUALITY);
+   FB = Alloc_Frame(D->Width, D->Height);
+   Reset_Delta_Frame(D, FB);
+   for (K = 0; K < D->NumFrames; K++) {
+      N = Read_Delta_Frame(D, K, FB);
+      if (N < 0)
+         exit(1);
+      if (S)
+         Write_Stream(S, FB);
+      else {
+         snprintf(FileName, sizeof(FileName), "%s/out%05d.jpg", argv[2], N);
+         if (!Write_Image(E, FileName, FB))
+            exit(1);
+      }
+   }
+   fprintf(stderr, "%s: %d frames\n", argv[1], D->NumFrames);   /* stdout may be the stream */
+   if (S)
+      Close_Stream(S);
+   else
+      Free_Encoder(E);
+   Free_Frame(FB);
+   Close_Delta(D);
+   exit(0);
+}
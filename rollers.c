@@ -50,6 +50,27 @@ density. WheelSize is mask length.
 Area_Image_Density(): Compute area non-blackened pixel density
 WheelSize is window edge size.
 
+Area_Image_Density_Work(): Area_Image_Density in caller supplied work
+space of AREAWORK(Width, WheelSize) ints, for instance carved from a
+frame scope, so a frame loop allocates nothing.
+
+Horizontal_Mask_Density(), Vertical_Mask_Density(),
+Area_Mask_Density(): Compute the same densities from a one byte per
+pixel foreground mask (e.g. from Process_Frame_FG_Mask) instead of a
+blacked-out frame.
+
+Create_Integral(): Allocate a summed area table for frames of a given
+size; allocate once per stream and reuse for every frame.
+
+Build_Integral(), Build_Integral_Mask(): Fill a summed area table from
+the non-blackened pixels of a frame, or from a byte mask.
+
+Integral_Density(): Compute area density for a rectangular Wx by Wy
+window of any size from a summed area table, at constant cost per
+pixel.
+
+Free_Integral(): Deallocate a summed area table.
+
 Paint_Frame(): Colorize frame based on scaled density map value.
 
 Paint_Frame_Mod(): Colorize frame based on mod density map value.
@@ -101,6 +122,7 @@ Example:
 */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "utils.h"
 #include "rollers.h"
 
@@ -202,48 +224,257 @@ This routine area (two dimensionally) scans an input frame containing
 salient regions with blackened pixels elsewhere. It returns a
 preallocated map of window fill levels (contiguous salient pixels).
 
-ToDo: reverse scan order to better exploit spacial locality in data
-cache. */
+The frame is scanned in row order. Each row is rolled horizontally
+into a line of row sums kept in a rolling buffer of WheelSize lines;
+the vertical sums add the incoming line and drop the line it replaces,
+so each pixel is read once, in memory order. The lines and the
+vertical sums are kept in Work, AREAWORK(Width, WheelSize) ints, which
+is cleared first; Area_Image_Density allocates it for each call. */
 
 void Area_Image_Density(FrmBuf *FB, int *DensityMap, int WheelSize) {
 
-   int                   Wheels[FB->Height];
-   int                   Sums[FB->Height];
-   int                   Vwheel[WheelSize];
-   int                   Vsum, Vptr, HalfWheel, WheelOff, X, Y, I, Edge;
+   int                   *Work;
+
+   Work = (int *) malloc(AREAWORK(FB->Width, WheelSize) * sizeof(int));
+   if (Work == NULL) {
+      fprintf(stderr, "ERROR: density buffers cannot be allocated\n");
+      exit(1);
+   }
+   Area_Image_Density_Work(FB, DensityMap, WheelSize, Work);
+   free(Work);
+}
+
+void Area_Image_Density_Work(FrmBuf *FB, int *DensityMap, int WheelSize, int *Work) {
 
+   int                   *Lines, *Line, *Vsums;
+   int                   Sum, Wheel, HalfWheel, WheelOff, X, Y, I, Edge;
+
+   memset(Work, 0, AREAWORK(FB->Width, WheelSize) * sizeof(int));
+   Lines = Work;                                      // rolling buffer of row sum lines
+   Vsums = &(Work[WheelSize * FB->Width]);            // vertical sums of buffered lines
    Edge = 1 << (int) (WheelSize - 1);                 // initialize one in left edge of window
    HalfWheel = WheelSize >> 1;                        // half wheel size
-   WheelOff = HalfWheel * (FB->Width + 1);            // window offset = half window size x Width
-   for (Y = 0; Y < FB->Height; Y++) {                 // for all rows
-      Wheels[Y] = 0;                                  // clear the wheels
-      Sums[Y] = 0;                                    // clear the sums
-   }
-   for (X = 0; X < FB->Width + HalfWheel; X++) {      // for each column plus write out rows
-      for (Vptr = 0; Vptr < WheelSize; Vptr++)        // for all positions in vertical wheel
-         Vwheel[Vptr] = 0;                            // clear vertical wheel
-      Vsum = Vptr = 0;                                // clear vertical sum and ptr
-      for (Y = 0; Y < FB->Height + HalfWheel; Y++) {  // for each row
-	 I = X + Y * FB->Width;                       // compute index
-         Sums[Y] -= Wheels[Y] & 1;                    // remove outgoing pixel count
-         Wheels[Y] >>= 1;                             // shift window for new pixel
-         Vsum -= Vwheel[Vptr];                        // removing outgoing vertical wheel count
-         if (Y < FB->Height) {                        // while in image column
-	    if (X < FB->Width )                       // while in image row
-               if (FB->Frm[3*I] | FB->Frm[3*I+1] | FB->Frm[3*I+2]) { // if pixel contains non-blackened value
-	          Sums[Y] += 1;                       // increment count
-	          Wheels[Y] |= Edge;                  // and insert new edge pixel count
-               }
-            Vwheel[Vptr] = Sums[Y];                   // insert row sum on vertical wheel
-            Vsum += Sums[Y];                          // and add to vertical sum
+   WheelOff = HalfWheel * (FB->Width + 1);            // window offset = half window size x (Width + 1)
+   for (Y = 0; Y < FB->Height + HalfWheel; Y++) {     // for each row plus write out columns
+      Line = &(Lines[(Y % WheelSize) * FB->Width]);   // line leaving the window, replaced by row Y
+      Sum = Wheel = 0;                                // clear sum and window at row's start
+      for (X = 0; X < FB->Width + HalfWheel; X++) {   // for each column plus write out row
+         Sum -= Wheel & 1;                            // remove outgoing pixel count
+         Wheel >>= 1;                                 // shift window for new pixel
+         I = Y * FB->Width + X;                       // compute index
+         if (Y < FB->Height && X < FB->Width)         // while in image
+            if (FB->Frm[3*I] | FB->Frm[3*I+1] | FB->Frm[3*I+2]) { // if pixel contains non-blackened value
+               Sum += 1;                              // increment count
+               Wheel |= Edge;                         // and insert new edge pixel count
+            }
+         if (X >= HalfWheel) {                        // wait until fully into row
+            Vsums[X - HalfWheel] += Sum - Line[X - HalfWheel]; // swap outgoing for incoming row sum
+            Line[X - HalfWheel] = Sum;
+            if (Y >= HalfWheel)                       // wait until fully into column
+               DensityMap[I - WheelOff] = Vsums[X - HalfWheel]; // write vertical sum to density map
          }
-         Vptr = (Vptr + 1) % WheelSize;               // increment vertical ptr
-         if (X >= HalfWheel && Y >= HalfWheel)        // wait until fully into row and column
-	    DensityMap[I - WheelOff] = Vsum;          // write current vertical sum to density map
       }
    }
 }
 
+/*               Mask Density
+
+These routines compute the horizontal, vertical and area densities of
+a foreground mask holding one byte per pixel, 0 or 1. Results match
+the corresponding Image_Density routine applied to a frame blacked out
+wherever the mask is 0. The mask is scanned row by row; a running sum
+per column carries the vertical window, so no window is limited to the
+width of an int and no work space beyond one row is needed. */
+
+void Horizontal_Mask_Density(unsigned char *Mask, int Width, int Height, int *DensityMap, int WheelSize) {
+
+   unsigned char         *Row;
+   int                   *Out;
+   int                   Sum, HalfWheel, X, Y;
+
+   HalfWheel = WheelSize >> 1;                        // half wheel size
+   for (Y = 0; Y < Height; Y++) {                     // for each row
+      Row = &(Mask[Y * Width]);
+      Out = &(DensityMap[Y * Width]);
+      Sum = 0;
+      for (X = 0; X < Width + HalfWheel; X++) {       // for each column plus write out row
+         if (X < Width)                               // while in image row
+            Sum += Row[X];                            // add incoming pixel
+         if (X >= WheelSize)                          // once window is full
+            Sum -= Row[X - WheelSize];                // remove outgoing pixel
+         if (X >= HalfWheel)                          // wait until fully into row
+            Out[X - HalfWheel] = Sum;                 // write current sum to density map
+      }
+   }
+}
+
+void Vertical_Mask_Density(unsigned char *Mask, int Width, int Height, int *DensityMap, int WheelSize) {
+
+   int                   Sums[Width];
+   int                   HalfWheel, X, Y;
+
+   HalfWheel = WheelSize >> 1;                        // half wheel size
+   for (X = 0; X < Width; X++)                        // for all columns
+      Sums[X] = 0;                                    // clear the sums
+   for (Y = 0; Y < Height + HalfWheel; Y++) {         // for each row plus write out columns
+      for (X = 0; X < Width; X++) {                   // for each column
+         if (Y < Height)                              // while in image column
+            Sums[X] += Mask[Y * Width + X];           // add incoming pixel
+         if (Y >= WheelSize)                          // once window is full
+            Sums[X] -= Mask[(Y - WheelSize) * Width + X]; // remove outgoing pixel
+         if (Y >= HalfWheel)                          // wait until fully into column
+            DensityMap[(Y - HalfWheel) * Width + X] = Sums[X];
+      }
+   }
+}
+
+void Area_Mask_Density(unsigned char *Mask, int Width, int Height, int *DensityMap, int WheelSize) {
+
+   int                   Sums[Width];
+   int                   *Out;
+   int                   Hsum, HalfWheel, X, Y;
+
+   HalfWheel = WheelSize >> 1;                        // half wheel size
+   for (X = 0; X < Width; X++)                        // for all columns
+      Sums[X] = 0;                                    // clear the column sums
+   for (Y = 0; Y < Height + HalfWheel; Y++) {         // for each row plus write out columns
+      for (X = 0; X < Width; X++) {                   // roll column sums down one row
+         if (Y < Height)
+            Sums[X] += Mask[Y * Width + X];
+         if (Y >= WheelSize)
+            Sums[X] -= Mask[(Y - WheelSize) * Width + X];
+      }
+      if (Y < HalfWheel)                              // wait until fully into column
+         continue;
+      Out = &(DensityMap[(Y - HalfWheel) * Width]);
+      Hsum = 0;
+      for (X = 0; X < Width + HalfWheel; X++) {       // roll across column sums
+         if (X < Width)
+            Hsum += Sums[X];
+         if (X >= WheelSize)
+            Hsum -= Sums[X - WheelSize];
+         if (X >= HalfWheel)
+            Out[X - HalfWheel] = Hsum;                // write current area sum to density map
+      }
+   }
+}
+
+/*               Create Integral
+
+This routine allocates a summed area table (integral image) for frames
+of a specified width and height. The table holds (Width + 1) x (Height
++ 1) 32-bit entries with a zero first row and column, plus per column
+window bounds used by Integral_Density. It should be
+allocated once per stream and rebuilt for each frame. If it cannot be
+allocated, an error message is printed and execution terminates. */
+
+Integral *Create_Integral(int Width, int Height) {
+
+   Integral             *SAT;
+   int                  I;
+
+   SAT = (Integral *) malloc(sizeof(Integral));
+   if (SAT == NULL) {
+      fprintf(stderr, "ERROR: summed area table cannot be allocated\n");
+      exit(1);
+   }
+   SAT->Width = Width;
+   SAT->Height = Height;
+   SAT->Sat = (unsigned int *) malloc((Width + 1) * (Height + 1) * sizeof(unsigned int));
+   SAT->Lo = (int *) malloc(Width * sizeof(int));
+   SAT->Hi = (int *) malloc(Width * sizeof(int));
+   if (SAT->Sat == NULL || SAT->Lo == NULL || SAT->Hi == NULL) {
+      fprintf(stderr, "ERROR: summed area table cannot be allocated\n");
+      exit(1);
+   }
+   for (I = 0; I <= Width; I++)                       // first row stays zero
+      SAT->Sat[I] = 0;
+   return (SAT);
+}
+
+/*               Free Integral
+
+This routine deallocates a summed area table. */
+
+void Free_Integral(Integral *SAT) {
+
+   free(SAT->Sat);
+   free(SAT->Lo);
+   free(SAT->Hi);
+   free(SAT);
+}
+
+/*               Build Integral
+
+These routines fill a summed area table: entry (X + 1, Y + 1) holds the
+number of salient pixels in the rectangle from (0, 0) to (X, Y). A
+pixel is salient if it is not blackened (Build_Integral) or if its
+mask byte is set (Build_Integral_Mask). Sums are unsigned, so window
+differences stay exact even if a corner would exceed 32 bits. */
+
+void Build_Integral(Integral *SAT, FrmBuf *FB) {
+
+   unsigned int         *Above, *Row, RowSum;
+   unsigned char        *P;
+   int                  X, Y;
+
+   for (Y = 0; Y < FB->Height; Y++) {                 // for each row
+      Above = &(SAT->Sat[Y * (FB->Width + 1)]);
+      Row = Above + FB->Width + 1;
+      P = &(FB->Frm[3 * Y * FB->Width]);
+      Row[0] = RowSum = 0;                            // first column stays zero
+      for (X = 0; X < FB->Width; X++, P += 3) {
+         RowSum += (P[0] | P[1] | P[2]) != 0;         // count non-blackened pixel
+         Row[X + 1] = Above[X + 1] + RowSum;
+      }
+   }
+}
+
+void Build_Integral_Mask(Integral *SAT, unsigned char *Mask) {
+
+   unsigned int         *Above, *Row, RowSum;
+   int                  X, Y;
+
+   for (Y = 0; Y < SAT->Height; Y++) {                // for each row
+      Above = &(SAT->Sat[Y * (SAT->Width + 1)]);
+      Row = Above + SAT->Width + 1;
+      Row[0] = RowSum = 0;                            // first column stays zero
+      for (X = 0; X < SAT->Width; X++) {
+         RowSum += Mask[Y * SAT->Width + X];
+         Row[X + 1] = Above[X + 1] + RowSum;
+      }
+   }
+}
+
+/*               Integral Density
+
+This routine computes area density from a summed area table for a
+window Wx pixels wide and Wy pixels high, four table reads per
+pixel. Window placement and clipping at frame edges match
+Area_Image_Density, which it reproduces for Wx = Wy = WheelSize. */
+
+void Integral_Density(Integral *SAT, int *DensityMap, int Wx, int Wy) {
+
+   int                  *Lo = SAT->Lo, *Hi = SAT->Hi;
+   unsigned int         *Top, *Bottom;
+   int                  HalfX, HalfY, Y0, Y1, X, Y;
+
+   HalfX = Wx >> 1;
+   HalfY = Wy >> 1;
+   for (X = 0; X < SAT->Width; X++) {                 // window columns are [X+HalfX-Wx+1, X+HalfX]
+      Lo[X] = X + HalfX - Wx + 1 < 0 ? 0 : X + HalfX - Wx + 1;
+      Hi[X] = X + HalfX + 1 > SAT->Width ? SAT->Width : X + HalfX + 1;
+   }
+   for (Y = 0; Y < SAT->Height; Y++) {                // window rows are [Y+HalfY-Wy+1, Y+HalfY]
+      Y0 = Y + HalfY - Wy + 1 < 0 ? 0 : Y + HalfY - Wy + 1;
+      Y1 = Y + HalfY + 1 > SAT->Height ? SAT->Height : Y + HalfY + 1;
+      Top = &(SAT->Sat[Y0 * (SAT->Width + 1)]);
+      Bottom = &(SAT->Sat[Y1 * (SAT->Width + 1)]);
+      for (X = 0; X < SAT->Width; X++)
+         DensityMap[Y * SAT->Width + X] = (int) (Bottom[Hi[X]] - Bottom[Lo[X]] - Top[Hi[X]] + Top[Lo[X]]);
+   }
+}
+
 /*              Paint Frame
 
 This routine uses a DensityMap to paint a frame using a rainbow paint
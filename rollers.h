@@ -13,13 +13,29 @@ typedef struct          Blob {
    struct Blob          *FP, *Next;
 }  Blob;
 
+typedef struct          Integral {
+   int                  Width, Height;
+   unsigned int         *Sat;
+   int                  *Lo, *Hi;     // window column bounds
+}  Integral;
+
 #define                 FREEBLOBSBLOCKSIZE 20
+#define                 AREAWORK(Width, WheelSize) (((WheelSize) + 1) * (Width))  /* ints of Area_Image_Density work space */
 
 extern Blob *FreeBlobs;
 
 extern void Horizontal_Image_Density(FrmBuf *FB, int *DensityMap, int WheelSize);
 extern void Vertical_Image_Density(FrmBuf *FB, int *DensityMap, int WheelSize);
 extern void Area_Image_Density(FrmBuf *FB, int *DensityMap, int WheelSize);
+extern void Area_Image_Density_Work(FrmBuf *FB, int *DensityMap, int WheelSize, int *Work);
+extern void Horizontal_Mask_Density(unsigned char *Mask, int Width, int Height, int *DensityMap, int WheelSize);
+extern void Vertical_Mask_Density(unsigned char *Mask, int Width, int Height, int *DensityMap, int WheelSize);
+extern void Area_Mask_Density(unsigned char *Mask, int Width, int Height, int *DensityMap, int WheelSize);
+extern Integral *Create_Integral(int Width, int Height);
+extern void Free_Integral(Integral *SAT);
+extern void Build_Integral(Integral *SAT, FrmBuf *FB);
+extern void Build_Integral_Mask(Integral *SAT, unsigned char *Mask);
+extern void Integral_Density(Integral *SAT, int *DensityMap, int Wx, int Wy);
 extern void Paint_Frame(FrmBuf *FB, int MaxCount, int *DensityMap);
 extern void Paint_Frame_Mod(FrmBuf *FB, int *DensityMap);
 extern void Grayscale_Frame(FrmBuf *FB, int MaxCount, int *DensityMap);
@@ -0,0 +1,536 @@
+/*                     Frame Streams
+
+This library reads and writes uncompressed video frames, YUV4MPEG2
+(Y4M) or raw RGB24, from or to a file, a named pipe or standard
+input/output.
+
+Part of the Virtual Blue-Screen program (P3-1).
+
+Documentation:
+
+A stream is opened by name ("-" is standard input). A Y4M stream
+describes its frame size in its header; a raw RGB24 stream is a bare
+sequence of Width x Height x 3 byte frames, so its size must be given.
+Frames are numbered from 1, like the files of a numbered sequence.
+
+Read_Stream reads a frame straight into a recycled frame buffer: a raw
+frame with a single fread into the pixel array, a Y4M frame with a
+single fread of its planes followed by a table driven YCbCr to RGB
+conversion (BT.601; studio range unless the header carries
+XCOLORRANGE=FULL). 4:2:0, 4:2:2, 4:4:4 and monochrome Y4M streams are
+supported; interlacing and aspect parameters are ignored. Frames
+before the requested one are read and skipped. A stream cannot be
+rewound, so while Keep_Stream_Frames is on, copies of the frames read
+are kept and can be read again. A stream ending between frames ends
+the sequence; a truncated or malformed frame is an error.
+
+An output stream is opened by name ("-" is standard output) with its
+frame size and, for Y4M, its frame rate. Write_Stream writes a frame
+buffer with a single fwrite through a large stdio buffer: a raw frame
+straight from the pixel array, a Y4M frame after a table driven RGB to
+YCbCr conversion into 4:2:0 studio range planes (C420jpeg, chroma
+averaged over each 2 x 2 block). Write errors, such as a reader
+closing its end of a pipe, print an error message and terminate
+execution.
+
+Key Usage Functions:
+
+Open_Stream(): Opens a Y4M or raw RGB24 stream.
+
+Read_Stream(): Reads frame N into a frame buffer, returning FALSE at
+the end of the stream.
+
+Keep_Stream_Frames(): Starts or stops keeping copies of the frames
+read, so they can be read again.
+
+Open_Output_Stream(): Opens a Y4M or raw RGB24 output stream.
+
+Write_Stream(): Writes a frame buffer as the next frame.
+
+Close_Stream(): Closes the stream, flushing an output stream, and
+deallocates it.
+
+Example:
+
+   Stream               *S;
+   FrmBuf               *FB;
+
+   S = Open_Stream("-", STREAM_Y4M, 0, 0);
+   FB = Alloc_Frame(S->Width, S->Height);
+   for (N = Start; N <= End && Read_Stream(S, N, FB); N += Step) {
+      ...
+   }
+   Close_Stream(S);
+
+   S = Open_Output_Stream("-", STREAM_Y4M, FB->Width, FB->Height, Y4MRATE);
+   for (...) {
+      ...
+      Write_Stream(S, FB);
+   }
+   Close_Stream(S);
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "utils.h"
+#include "stream.h"
+
+/*              Fixed
+
+This routine rounds a color conversion factor to 16 fraction bits. */
+
+static int Fixed(double X) {
+
+   return ((int) (X * 65536.0 + (X >= 0 ? 0.5 : -0.5)));
+}
+
+/*              Build Color Tables
+
+This routine fills the YCbCr to RGB conversion tables of a stream, for
+studio range (Y 16-235) or full range (JPEG) samples, and the range
+limit table that clamps converted samples to 0-255. */
+
+static void Build_Color_Tables(Stream *S, int FullRange) {
+
+   double               YScale = FullRange ? 1.0 : 255.0 / 219.0;
+   double               CScale = FullRange ? 1.0 : 255.0 / 224.0;
+   int                  YOff = FullRange ? 0 : 16;
+   int                  I;
+
+   for (I = 0; I < 256; I++) {
+      S->YTab[I] = Fixed(YScale * (I - YOff)) + (1 << 15);   /* rounds the sums */
+      S->CrR[I] = Fixed(1.402 * CScale * (I - 128));
+      S->CbB[I] = Fixed(1.772 * CScale * (I - 128));
+      S->CrG[I] = Fixed(-0.714136 * CScale * (I - 128));
+      S->CbG[I] = Fixed(-0.344136 * CScale * (I - 128));
+   }
+   for (I = 0; I < LIMITSIZE; I++)
+      S->Limit[I] = (I < LIMITOFF) ? 0 : ((I - LIMITOFF > 255) ? 255 : I - LIMITOFF);
+}
+
+/*              Read Y4M Header
+
+This routine parses the stream header of a Y4M stream, setting its
+frame size, chroma subsampling and color tables. If the header is
+malformed or unsupported, an error message is printed and execution
+terminates. */
+
+static void Read_Y4M_Header(Stream *S) {
+
+   char                 Line[1024], *Token;
+   char                 Chroma[32] = "420jpeg";
+   int                  FullRange = FALSE;
+
+   if (fgets(Line, sizeof(Line), S->FP) == NULL || strncmp(Line, "YUV4MPEG2 ", 10) != 0 ||
+       strchr(Line, '\n') == NULL) {
+      fprintf(stderr, "ERROR: %s is not a YUV4MPEG2 stream\n", S->Name);
+      exit(1);
+   }
+   S->Width = S->Height = 0;
+   for (Token = strtok(Line + 10, " \n"); Token; Token = strtok(NULL, " \n"))
+      if (Token[0] == 'W')
+         S->Width = atoi(Token + 1);
+      else if (Token[0] == 'H')
+         S->Height = atoi(Token + 1);
+      else if (Token[0] == 'C')
+         sscanf(Token + 1, "%31s", Chroma);
+      else if (Token[0] == 'F')
+         sscanf(Token + 1, "%31s", S->Rate);
+      else if (strcmp(Token, "XCOLORRANGE=FULL") == 0)
+         FullRange = TRUE;
+   if (S->Width < 1 || S->Height < 1) {
+      fprintf(stderr, "ERROR: %s has no frame size\n", S->Name);
+      exit(1);
+   }
+   S->XShift = S->YShift = S->Mono = 0;
+   if (strncmp(Chroma, "420", 3) == 0)
+      S->XShift = S->YShift = 1;
+   else if (strcmp(Chroma, "422") == 0)
+      S->XShift = 1;
+   else if (strncmp(Chroma, "mono", 4) == 0)
+      S->Mono = TRUE;
+   else if (strcmp(Chroma, "444") != 0) {
+      fprintf(stderr, "ERROR: %s has unsupported Y4M chroma C%s\n", S->Name, Chroma);
+      exit(1);
+   }
+   S->ChromaSize = S->Mono ? 0 : ((S->Width + S->XShift) >> S->XShift) * ((S->Height + S->YShift) >> S->YShift);
+   S->FrameSize = S->Width * S->Height + 2 * S->ChromaSize;
+   Build_Color_Tables(S, FullRange);
+}
+
+/*              Open Stream
+
+This routine opens a frame stream of a Format (STREAM_Y4M or
+STREAM_RGB) by name, "-" for standard input. The frame size of a raw
+RGB stream is given by Width and Height; a Y4M stream gives its own.
+If the stream cannot be opened, an error message is printed and
+execution terminates. */
+
+Stream *Open_Stream(char *Name, int Format, int Width, int Height) {
+
+   Stream               *S;
+
+   S = (Stream *) malloc(sizeof(Stream));
+   if (S == NULL || (S->Name = strdup(Name)) == NULL) {
+      fprintf(stderr, "Unable to allocate frame stream\n");
+      exit(1);
+   }
+   S->FP = strcmp(Name, "-") == 0 ? stdin : fopen(Name, "rb");
+   if (S->FP == NULL) {
+      fprintf(stderr, "ERROR: %s cannot be opened\n", Name);
+      exit(1);
+   }
+   setvbuf(S->FP, NULL, _IOFBF, STREAMBUF);
+   S->Format = Format;
+   S->Output = FALSE;
+   strcpy(S->Rate, Y4MRATE);
+   S->Next = 1;
+   S->Planes = NULL;
+   S->Keep = FALSE;
+   S->Kept = NULL;
+   if (Format == STREAM_Y4M) {
+      Read_Y4M_Header(S);
+      S->Planes = (unsigned char *) malloc(S->FrameSize);
+      if (S->Planes == NULL) {
+         fprintf(stderr, "Unable to allocate frame stream\n");
+         exit(1);
+      }
+   } else {
+      S->Width = Width;
+      S->Height = Height;
+      S->FrameSize = 3 * Width * Height;
+   }
+   return (S);
+}
+
+/*              Read Frame Data
+
+This routine reads Size bytes of a frame. It returns FALSE if the
+stream ends before the first byte. If it ends part way, an error
+message is printed and execution terminates. */
+
+static int Read_Frame_Data(Stream *S, unsigned char *Data, int Size) {
+
+   size_t               Got;
+
+   Got = fread(Data, 1, Size, S->FP);
+   if (Got == 0 && feof(S->FP))
+      return (FALSE);
+   if (Got != (size_t) Size) {
+      fprintf(stderr, "ERROR: %s: frame %d is truncated\n", S->Name, S->Next);
+      exit(1);
+   }
+   return (TRUE);
+}
+
+/*              Read Y4M Frame
+
+This routine reads the next Y4M frame and converts it into a frame
+buffer. It returns FALSE at the end of the stream. If the frame header
+is malformed, an error message is printed and execution terminates. */
+
+static int Read_Y4M_Frame(Stream *S, FrmBuf *FB) {
+
+   char                 Tag[6];
+   unsigned char        *Y, *Cb, *Cr, *P;
+   unsigned char        *Limit = &(S->Limit[LIMITOFF]);
+   int                  *YTab = S->YTab, *CrR = S->CrR, *CbB = S->CbB, *CrG = S->CrG, *CbG = S->CbG;
+   int                  XShift = S->XShift, YShift = S->YShift;
+   int                  C, L, X, Cx, Y0, CW;
+   size_t               Got;
+
+   Got = fread(Tag, 1, 5, S->FP);
+   if (Got == 0 && feof(S->FP))
+      return (FALSE);
+   if (Got != 5 || strncmp(Tag, "FRAME", 5) != 0) {
+      fprintf(stderr, "ERROR: %s: frame %d has no FRAME header\n", S->Name, S->Next);
+      exit(1);
+   }
+   while ((C = getc(S->FP)) != '\n')                    /* frame parameters are ignored */
+      if (C == EOF) {
+         fprintf(stderr, "ERROR: %s: frame %d is truncated\n", S->Name, S->Next);
+         exit(1);
+      }
+   if (!Read_Frame_Data(S, S->Planes, S->FrameSize)) {
+      fprintf(stderr, "ERROR: %s: frame %d is truncated\n", S->Name, S->Next);
+      exit(1);
+   }
+   CW = (S->Width + S->XShift) >> S->XShift;
+   P = FB->Frm;
+   for (Y0 = 0; Y0 < S->Height; Y0++) {
+      Y = &(S->Planes[Y0 * S->Width]);
+      if (S->Mono) {
+         for (X = 0; X < S->Width; X++, P += 3)
+            P[0] = P[1] = P[2] = Limit[YTab[Y[X]] >> 16];
+         continue;
+      }
+      Cb = &(S->Planes[S->Width * S->Height + (Y0 >> YShift) * CW]);
+      Cr = Cb + S->ChromaSize;
+      for (X = 0; X < S->Width; X++, P += 3) {
+         Cx = X >> XShift;
+         L = YTab[Y[X]];
+         P[0] = Limit[(L + CrR[Cr[Cx]]) >> 16];
+         P[1] = Limit[(L + CrG[Cr[Cx]] + CbG[Cb[Cx]]) >> 16];
+         P[2] = Limit[(L + CbB[Cb[Cx]]) >> 16];
+      }
+   }
+   return (TRUE);
+}
+
+/*              Read Next
+
+This routine reads the next frame of the stream into a frame buffer,
+keeping a copy if frames are being kept. It returns FALSE at the end
+of the stream. */
+
+static int Read_Next(Stream *S, FrmBuf *FB) {
+
+   Kept_Frame           *K, **Last;
+   int                  OK;
+
+   if (S->Format == STREAM_Y4M)
+      OK = Read_Y4M_Frame(S, FB);
+   else
+      OK = Read_Frame_Data(S, FB->Frm, S->FrameSize);
+   if (!OK)
+      return (FALSE);
+   if (S->Keep) {
+      K = (Kept_Frame *) malloc(sizeof(Kept_Frame));
+      if (K == NULL) {
+         fprintf(stderr, "Unable to allocate kept frame\n");
+         exit(1);
+      }
+      K->Number = S->Next;
+      K->FB = Duplicate_Frame(FB);
+      K->Next = NULL;
+      for (Last = &(S->Kept); *Last; Last = &((*Last)->Next));
+      *Last = K;
+   }
+   S->Next += 1;
+   return (TRUE);
+}
+
+/*              Read Stream
+
+This routine reads frame N of the stream (numbered from 1) into a
+frame buffer of the stream's frame size, skipping the frames before
+it. A frame already read can be read again if it was kept. It returns
+TRUE, or FALSE at the end of the stream. If the frame cannot be read,
+an error message is printed and execution terminates. */
+
+int Read_Stream(Stream *S, int N, FrmBuf *FB) {
+
+   Kept_Frame           *K;
+
+   if (FB->Width != S->Width || FB->Height != S->Height) {
+      fprintf(stderr, "ERROR: %s frame size (%d,%d) does not match frame buffer size (%d,%d)\n", \
+	      S->Name, S->Width, S->Height, FB->Width, FB->Height);
+      exit(1);
+   }
+   if (!S->Keep)                                        /* kept frames passed are not needed again */
+      while ((K = S->Kept) != NULL && K->Number < N) {
+         S->Kept = K->Next;
+         Free_Frame(K->FB);
+         free(K);
+      }
+   for (K = S->Kept; K != NULL && K->Number != N; K = K->Next);
+   if (K != NULL) {
+      Copy_Image(K->FB, FB, 0);
+      if (!S->Keep) {                                   /* read again for the last time */
+         S->Kept = K->Next;
+         Free_Frame(K->FB);
+         free(K);
+      }
+      return (TRUE);
+   }
+   if (N < S->Next) {
+      fprintf(stderr, "ERROR: %s: frame %d was not kept and cannot be read again\n", S->Name, N);
+      exit(1);
+   }
+   while (S->Next < N)
+      if (!Read_Next(S, FB))
+         return (FALSE);
+   return (Read_Next(S, FB));
+}
+
+/*              Keep Stream Frames
+
+This routine starts (Keep TRUE) or stops keeping copies of the frames
+read from a stream. Frames kept so far can still be read once more
+after keeping stops. */
+
+void Keep_Stream_Frames(Stream *S, int Keep) {
+
+   S->Keep = Keep;
+}
+
+/**********************************************************************
+                           Output Streams
+***********************************************************************/
+
+/*              Build Output Tables
+
+This routine fills the RGB to YCbCr conversion tables of an output
+stream, for studio range samples (BT.601). Rounding and the sample
+offsets are folded into the first table of each sum. */
+
+static void Build_Output_Tables(Stream *S) {
+
+   double               YScale = 219.0 / 255.0, CScale = 224.0 / 255.0;
+   int                  I;
+
+   for (I = 0; I < 256; I++) {
+      S->RY[I] = Fixed(YScale * 0.299 * I + 16.5);
+      S->GY[I] = Fixed(YScale * 0.587 * I);
+      S->BY[I] = Fixed(YScale * 0.114 * I);
+      S->RCb[I] = Fixed(CScale * -0.168736 * I + 128.5);
+      S->GCb[I] = Fixed(CScale * -0.331264 * I);
+      S->Half[I] = Fixed(CScale * 0.5 * I);            /* B to Cb, R to Cr */
+      S->GCr[I] = Fixed(CScale * -0.418688 * I + 128.5);
+      S->BCr[I] = Fixed(CScale * -0.081312 * I);
+   }
+}
+
+/*              Open Output Stream
+
+This routine opens a frame stream of a Format (STREAM_Y4M or
+STREAM_RGB) for writing by name, "-" for standard output, with frames
+of Width x Height. A Y4M stream header is written with the frame Rate
+(N:D frames per second). If the stream cannot be opened, an error
+message is printed and execution terminates. */
+
+Stream *Open_Output_Stream(char *Name, int Format, int Width, int Height, char *Rate) {
+
+   Stream               *S;
+
+   S = (Stream *) malloc(sizeof(Stream));
+   if (S == NULL || (S->Name = strdup(Name)) == NULL) {
+      fprintf(stderr, "Unable to allocate frame stream\n");
+      exit(1);
+   }
+   S->FP = strcmp(Name, "-") == 0 ? stdout : fopen(Name, "wb");
+   if (S->FP == NULL) {
+      fprintf(stderr, "ERROR: %s cannot be opened\n", Name);
+      exit(1);
+   }
+   setvbuf(S->FP, NULL, _IOFBF, OUTSTREAMBUF);
+   S->Format = Format;
+   S->Output = TRUE;
+   S->Width = Width;
+   S->Height = Height;
+   snprintf(S->Rate, sizeof(S->Rate), "%s", Rate);
+   S->Next = 1;
+   S->Planes = NULL;
+   S->Keep = FALSE;
+   S->Kept = NULL;
+   if (Format == STREAM_Y4M) {
+      S->XShift = S->YShift = 1;
+      S->Mono = FALSE;
+      S->ChromaSize = ((Width + 1) >> 1) * ((Height + 1) >> 1);
+      S->FrameSize = 6 + Width * Height + 2 * S->ChromaSize;   /* with the FRAME header */
+      S->Planes = (unsigned char *) malloc(S->FrameSize);
+      if (S->Planes == NULL) {
+         fprintf(stderr, "Unable to allocate frame stream\n");
+         exit(1);
+      }
+      memcpy(S->Planes, "FRAME\n", 6);
+      Build_Output_Tables(S);
+      fprintf(S->FP, "YUV4MPEG2 W%d H%d F%s Ip A1:1 C420jpeg\n", Width, Height, S->Rate);
+   } else
+      S->FrameSize = 3 * Width * Height;
+   return (S);
+}
+
+/*              Convert Y4M Frame
+
+This routine converts a frame buffer into the 4:2:0 planes of an output
+Y4M frame. Luma is converted per pixel; chroma from the average color
+of each 2 x 2 block (partial blocks at odd edges). */
+
+static void Convert_Y4M_Frame(Stream *S, FrmBuf *FB) {
+
+   unsigned char        *Y = &(S->Planes[6]);
+   unsigned char        *Cb = Y + S->Width * S->Height;
+   unsigned char        *Cr = Cb + S->ChromaSize;
+   unsigned char        *P, *Q;
+   int                  *RY = S->RY, *GY = S->GY, *BY = S->BY;
+   int                  Width = S->Width, Height = S->Height;
+   int                  X, Y0, DX, DY, N, R, G, B;
+
+   P = FB->Frm;
+   for (Y0 = 0; Y0 < Height; Y0++)
+      for (X = 0; X < Width; X++, P += 3)
+         *Y++ = (RY[P[0]] + GY[P[1]] + BY[P[2]]) >> 16;
+   for (Y0 = 0; Y0 < Height; Y0 += 2)
+      for (X = 0; X < Width; X += 2) {
+         R = G = B = N = 0;
+         for (DY = 0; DY < 2 && Y0 + DY < Height; DY++)
+            for (DX = 0; DX < 2 && X + DX < Width; DX++) {
+               Q = &(FB->Frm[3 * ((Y0 + DY) * Width + X + DX)]);
+               R += Q[0];
+               G += Q[1];
+               B += Q[2];
+               N += 1;
+            }
+         R = (R + N / 2) / N;
+         G = (G + N / 2) / N;
+         B = (B + N / 2) / N;
+         *Cb++ = (S->RCb[R] + S->GCb[G] + S->Half[B]) >> 16;
+         *Cr++ = (S->Half[R] + S->GCr[G] + S->BCr[B]) >> 16;
+      }
+}
+
+/*              Write Stream
+
+This routine writes a frame buffer of the stream's frame size as the
+next frame of an output stream. If the frame cannot be written, an
+error message is printed and execution terminates. */
+
+void Write_Stream(Stream *S, FrmBuf *FB) {
+
+   unsigned char        *Data = FB->Frm;
+
+   if (FB->Width != S->Width || FB->Height != S->Height) {
+      fprintf(stderr, "ERROR: frame buffer size (%d,%d) does not match %s frame size (%d,%d)\n", \
+	      FB->Width, FB->Height, S->Name, S->Width, S->Height);
+      exit(1);
+   }
+   if (S->Format == STREAM_Y4M) {
+      Convert_Y4M_Frame(S, FB);
+      Data = S->Planes;
+   }
+   if (fwrite(Data, 1, S->FrameSize, S->FP) != (size_t) S->FrameSize) {
+      fprintf(stderr, "can't write %s\n", S->Name);
+      exit(1);
+   }
+   S->Next += 1;
+}
+
+/*              Close Stream
+
+This routine closes a stream and deallocates it, with any kept
+frames. An output stream is flushed first; if it cannot be, an error
+message is printed and execution terminates. */
+
+void Close_Stream(Stream *S) {
+
+   Kept_Frame           *K;
+
+   while ((K = S->Kept) != NULL) {
+      S->Kept = K->Next;
+      Free_Frame(K->FB);
+      free(K);
+   }
+   if (S->Output && (fflush(S->FP) != 0 || ferror(S->FP))) {
+      fprintf(stderr, "can't write %s\n", S->Name);
+      exit(1);
+   }
+   if (S->FP != stdin && S->FP != stdout && fclose(S->FP) != 0) {
+      fprintf(stderr, "can't write %s\n", S->Name);
+      exit(1);
+   }
+   free(S->Planes);
+   free(S->Name);
+   free(S);
+}
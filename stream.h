@@ -0,0 +1,48 @@
+/*                     Frame Streams
+
+This library reads and writes uncompressed video frames, YUV4MPEG2
+(Y4M) or raw RGB24, from or to a file, a named pipe or standard
+input/output.
+
+Part of the Virtual Blue-Screen program (P3-1).               */
+
+#define                 LIMITOFF 512              /* converted samples lie within -512 to 767 */
+#define                 LIMITSIZE 1280
+
+typedef struct          Kept_Frame {
+   int                  Number;
+   FrmBuf               *FB;
+   struct Kept_Frame    *Next;
+}  Kept_Frame;
+
+typedef struct          Stream {
+   FILE                 *FP;
+   char                 *Name;
+   int                  Format;                   /* STREAM_Y4M or STREAM_RGB */
+   int                  Output;                   /* written, not read */
+   int                  Width, Height;
+   char                 Rate[32];                 /* Y4M frame rate, as N:D */
+   int                  Next;                     /* number of the next frame in the stream */
+   int                  XShift, YShift, Mono;     /* Y4M chroma subsampling */
+   int                  ChromaSize, FrameSize;    /* bytes per chroma plane, per frame */
+   unsigned char        *Planes;                  /* Y4M frame, as read or written */
+   int                  YTab[256], CrR[256], CbB[256], CrG[256], CbG[256];
+   int                  RY[256], GY[256], BY[256];                /* RGB to YCbCr, for output */
+   int                  RCb[256], GCb[256], Half[256], GCr[256], BCr[256];
+   unsigned char        Limit[LIMITSIZE];         /* clamps sample LIMITOFF + X to 0-255 */
+   int                  Keep;                     /* keep the frames read, to read them again */
+   Kept_Frame           *Kept;                    /* kept frames, in frame order */
+}  Stream;
+
+#define                 STREAM_Y4M 0
+#define                 STREAM_RGB 1
+#define                 STREAMBUF (1 << 16)       /* stdio buffer size, input */
+#define                 OUTSTREAMBUF (1 << 20)    /* stdio buffer size, output */
+#define                 Y4MRATE "30:1"            /* frame rate when none is known */
+
+extern Stream *Open_Stream(char *Name, int Format, int Width, int Height);
+extern int Read_Stream(Stream *S, int N, FrmBuf *FB);
+extern void Keep_Stream_Frames(Stream *S, int Keep);
+extern Stream *Open_Output_Stream(char *Name, int Format, int Width, int Height, char *Rate);
+extern void Write_Stream(Stream *S, FrmBuf *FB);
+extern void Close_Stream(Stream *S);
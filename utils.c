@@ -13,7 +13,17 @@ Frame Buffer (FrmBuf): An array of unsigned chars (bytes) equal to the
 number of pixels in an image times three (RGB). Typically frame
 buffers are dynamically allocated in the heap once the image size is
 known. The frame buffer struct includes its width and height. Frame
-buffers are managed explicitly.
+buffers are managed explicitly. A frame buffer may also be a view of
+a band of rows of a larger one (Parent), sharing its pixels: rows are
+whole, so a view is laid out as any frame buffer and every routine
+works on it in place.
+
+Decoder, Encoder: Reusable JPEG codec contexts. A context is created
+once per stream of images (for instance per thread) and reused for
+every frame, so the libjpeg objects, memory pools and tables are set
+up once. Codec errors are recovered with setjmp: the failing call
+prints an error message and returns FALSE, and the context remains
+usable.
 
 Point: An point object contains an X,Y position as two integers plus a
 Next pointer to support lists of points. Points are used for
@@ -26,7 +36,12 @@ Clear_Frame(): This function clears the frame buffer array.
 Alloc_Frame(): This function allocates and returns a frame buffer of a
 specified height and width. The frame buffer data is cleared. NOTE:
 the returned frame buffer should be deallocated when it is no longer
-needed.
+needed. Freed frames are kept on free lists by frame size, so a frame
+of a size seen before is handed out in constant time. Pixel arrays are
+64 byte (cache line) aligned.
+
+Alloc_Frame_Uncleared(): This function is Alloc_Frame without the
+clearing, for callers that overwrite every pixel.
 
 Create_Frame(): This function allocates a frame buffer (using the height
 and width specified in the image) and then initializes it with the
@@ -36,7 +51,21 @@ when it is no longer needed.
 Duplicate_Frame(): This function duplicates a existing frame buffer
 and returns the newly allocated and initialized frame buffer.
 
-Free_Frame(): This function deallocates a frame buffer.
+Free_Frame(): This function deallocates a frame buffer. Freeing a view
+leaves the pixels to its parent.
+
+View_Frame(): This function returns a view of a band of rows of a frame
+buffer, for instance one pane of a stack of images, so a result can be
+written in place instead of copied into the pane.
+
+Frame Scope: The lifetime of the temporary frame buffers and scratch
+memory of one iteration (for instance one frame of a sequence).
+Scope_Frame() hands a frame buffer to the scope and Scope_Alloc()
+allocates scratch memory from it; Release_Frame_Scope() frees them all
+at once at the end of the iteration. Frames are recycled through the
+free frame list, and the scratch arena grows to the largest iteration
+seen and is then reused, so a steady loop allocates nothing from the
+heap after the first iteration.
 
 Load_Image(): This function loads and decodes an JPEG image into a
 preallocated frame buffer.
@@ -44,11 +73,52 @@ preallocated frame buffer.
 Store_Image(): This function encodes and stores a frame buffer as an
 output JPEG image file.
 
+Create_Decoder(), Free_Decoder(): These functions create and destroy a
+reusable JPEG decoder context.
+
+Decode_Image(), Decode_Frame(): These functions decode a JPEG image
+with a decoder context, into a preallocated frame buffer (like
+Load_Image) or a new one (like Create_Frame). Errors are reported and
+FALSE (or NULL) is returned instead of terminating execution.
+
+Decode_Memory(): This function decodes a JPEG image held in memory
+with a decoder context, into a preallocated frame buffer.
+
+Read_Header(): This function reads only the header of a JPEG image
+with a decoder context and returns its width and height. Errors are
+reported and FALSE is returned.
+
+Set_Decoder_Scale(), Scaled_Size(): These functions make a decoder
+context decode at 1/2, 1/4 or 1/8 scale, optionally with the fast IDCT
+and upsampling, and return the size of a scaled dimension.
+
+Create_Encoder(), Free_Encoder(): These functions create and destroy a
+reusable JPEG encoder context of a given quality.
+
+Encode Profile: A named set of JPEG encoder settings (quality, DCT
+method, chroma subsampling, Huffman optimization). "default" is what
+Store_Image has always produced; "preview" is a cheap encode for debug
+output; "archive" is a high quality encode for deliverables.
+
+Find_Encode_Profile(), Parse_Encode_Profile(): These functions look up
+a named profile, or parse NAME[:QUALITY] into a profile.
+
+Set_Encoder_Profile(): This function switches an encoder context to a
+profile, for the images it encodes from then on.
+
+Encode_Image(), Write_Image(): These functions encode a frame buffer
+with an encoder context, onto an open stdio stream (such as an
+in-memory stream) or into an output file (like Store_Image). Errors
+are reported and FALSE is returned instead of terminating execution.
+
 Copy_Image(): This function copies an image from a source buffer to a
 destination buffer. The target frame buffer must be large enough to
 accommodate the frame buffer being copied. An tile offset allows the
 source image to be placed in a pane of a larger window.
 
+Mask_Image(): This function copies the pixels of a frame buffer that
+are set in a one byte per pixel mask, blacking out the rest.
+
 Draw_Multi_Seg_Line(): This function draws a multi-segment line
 constructed out of points.
 
@@ -58,113 +128,165 @@ Draw_Rectangle(): This function draws a rectangle in a frame buffer.
 
 Draw_Circle(): This function draws a filled circle in a frame buffer.
 
-<depreciated functions>
-
-Read_Header(): This function opens an image and returns its height and
-width.
-
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <setjmp.h>
 #include <jpeglib.h>
 #include "utils.h"
 
+#if JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED)
+#define                 MEMSRC 1                  /* libjpeg can decode from memory */
+#else
+#define                 MEMSRC 0
+#endif
+
+typedef struct          Codec_Error {
+   struct jpeg_error_mgr Mgr;
+   jmp_buf              Jump;                     /* recovery point of the current call */
+}  Codec_Error;
+
+struct                  Decoder {
+   struct jpeg_decompress_struct Info;
+   Codec_Error          Err;
+   FILE                 *FP;                      /* image being decoded */
+   int                  Scale, Fast;              /* decode at 1/Scale, with fast settings */
+   int                  Memory;                   /* the source manager reads from memory */
+};
+
+struct                  Encoder {
+   struct jpeg_compress_struct Info;
+   Codec_Error          Err;
+   Encode_Profile       Profile;                  /* settings now in Info */
+   JHUFF_TBL            StdDC[NUM_HUFF_TBLS], StdAC[NUM_HUFF_TBLS];   /* standard Huffman tables */
+};
+
+Encode_Profile          Encode_Profiles[] = {     /* named encoder settings, first is the default */
+   {"default",  QUALITY, FALSE, 420, FALSE},
+   {"preview",  50,      TRUE,  420, FALSE},
+   {"archive",  92,      FALSE, 444, TRUE},
+   {NULL,       0,       FALSE, 0,   FALSE}
+};
+
+typedef struct      Frame_Bucket {
+   int              Width, Height;                /* frame size, 0 for an empty slot */
+   FrmBuf           *Free;                        /* free frames of that size */
+}  Frame_Bucket;
+
 Point               *FreePoints = NULL;           /* free points list */
-FrmBuf              *FreeFrames = NULL;           /* free frame list */
+Frame_Bucket        FreeFrames[FRAMEBUCKETS];     /* free frame lists, hashed by frame size */
 
 /*              Clear Frame
 
 This routine clears the pixel data of a frame buffer. */
 
 void Clear_Frame (FrmBuf *FB) {
-   int              N;
 
-   for (N = 0; N < 3 * FB->Width * FB->Height; N++)
-      FB->Frm[N] = 0;
+   memset(FB->Frm, 0, 3 * FB->Width * FB->Height);
 }
 
-/*              Allocate Frame
+/*              Frame Bucket
+
+This routine returns the free frame list of a frame size, claiming an
+empty slot of the table for a new size, or NULL if every slot holds
+another size. Sizes are hashed, then probed linearly. */
+
+static Frame_Bucket *Frame_Bucket_Of(int Width, int Height) {
+   Frame_Bucket     *B;
+   unsigned int     H, I;
+
+   H = ((unsigned int) Width * 2654435761u) ^ ((unsigned int) Height * 40503u);
+   for (I = 0; I < FRAMEBUCKETS; I++) {
+      B = &(FreeFrames[(H + I) % FRAMEBUCKETS]);
+      if (B->Width == Width && B->Height == Height)
+	 return (B);
+      if (B->Width == 0) {   // first frame of this size
+	 B->Width = Width;
+	 B->Height = Height;
+	 return (B);
+      }
+   }
+   return (NULL);
+}
 
-This routine allocates a new frame buffer of a specified width and
-height. A new frame object and a pixel array are allocated, either
-from the free frame list, or if unavailable, from the heap. The frame
-buffer is cleared. If the frame buffer cannot be allocated, Null is
-returned. */
+/*              Allocate Frame Uncleared
 
-FrmBuf *Alloc_Frame(int Width, int Height) {
-   FrmBuf           *FB = NULL, *LastFB;
-
-   if (FreeFrames) {   // if recycled frame buffers exist, check if proper size is available.       
-      LastFB = FB = FreeFrames;
-      while (FB)
-	 if (FB->Width == Width && FB->Height == Height) {
-	    if (FB == LastFB)
-	       FreeFrames = FB->Next;
-	    else
-	       LastFB->Next = FB->Next;
-	    break;
-	 } else {
-	    LastFB = FB;
-	    FB = FB->Next;
-	 }
-   }
-   if (FB == NULL) {   // if recycled frame buffer not available, then allocate one from heap.
+This routine allocates a new frame buffer of a specified width and
+height, like Alloc_Frame, but leaves the pixel data as it is, for
+callers that overwrite the whole frame. The pixel array is 64 byte
+aligned; with HUGEFRAMES, frames of a huge page or more are aligned to
+a huge page and backed by transparent huge pages. If the frame buffer
+cannot be allocated, Null is returned. */
+
+FrmBuf *Alloc_Frame_Uncleared(int Width, int Height) {
+   FrmBuf           *FB = NULL;
+   Frame_Bucket     *B = Frame_Bucket_Of(Width, Height);
+   size_t           Size = 3 * (size_t) Width * Height, Align = FRAMEALIGN;
+   void             *Frm;
+
+   if (B && B->Free) {   // pop a recycled frame buffer of this size
+      FB = B->Free;
+      B->Free = FB->Next;
+   } else {              // else allocate one from the heap
       FB = (FrmBuf *) malloc(sizeof(FrmBuf));
       if (FB == NULL)
 	 return(FB);
-      FB->Frm = (unsigned char *) malloc(3 * Width * Height * sizeof(unsigned char));
-      if (FB == NULL)
+      if (HUGEFRAMES && Size >= HUGEPAGESIZE)
+	 Align = HUGEPAGESIZE;
+      if (posix_memalign(&Frm, Align, Size ? Size : 1) != 0) {
+	 free(FB);
 	 return (NULL);
+      }
+#ifdef MADV_HUGEPAGE
+      if (Align == HUGEPAGESIZE)
+	 madvise(Frm, Size, MADV_HUGEPAGE);
+#endif
+      FB->Frm = (unsigned char *) Frm;
       FB->Width = Width;
       FB->Height = Height;
+      FB->Parent = NULL;
    }
    FB->Next = NULL;   // either way, set next ptr to NULL
-   Clear_Frame(FB);   // clear frame data
+   return (FB);
+}
+
+/*              Allocate Frame
+
+This routine allocates a new frame buffer of a specified width and
+height. A new frame object and a pixel array are allocated, either
+from the free frame list of that size, or if unavailable, from the
+heap. The frame buffer is cleared. If the frame buffer cannot be
+allocated, Null is returned. */
+
+FrmBuf *Alloc_Frame(int Width, int Height) {
+   FrmBuf           *FB;
+
+   FB = Alloc_Frame_Uncleared(Width, Height);
+   if (FB)
+      Clear_Frame(FB);   // clear frame data
    return (FB);
 }
 
 /*              Create Frame
 
 This routine loads and decodes a JPEG image, storing it in a new frame
-buffer. If the image file cannot be opened, or if the frame buffer
-cannot be allocated, an error message is printed and execution
-terminates. */
+buffer. If the image file cannot be opened or decoded, or if the
+frame buffer cannot be allocated, an error message is printed and
+execution terminates. */
 
 FrmBuf *Create_Frame(char *FileName) {
-   struct jpeg_decompress_struct       cinfo;
-   struct jpeg_error_mgr               jerr;
-   FILE                                *FP;
-   int                                 Width, Height, Row;
-   JSAMPROW                            *RowPtr;
+   Decoder                             *D;
    FrmBuf                              *FB;
 
-   cinfo.err = jpeg_std_error(&jerr);
-   jpeg_create_decompress(&cinfo);
-   FP = fopen(FileName, "rb");
-   if (FP == NULL) {
-      fprintf(stderr, "ERROR: %s cannot be opened\n", FileName);
-      exit(1);
-   }
-   jpeg_stdio_src(&cinfo, FP);
-   jpeg_read_header(&cinfo, TRUE);
-   cinfo.out_color_space = JCS_RGB;
-   jpeg_start_decompress(&cinfo);
-   Width = cinfo.output_width;
-   Height = cinfo.output_height;
-   FB = Alloc_Frame(Width, Height);
-   if (FB == NULL) {
-      fprintf(stderr, "ERROR: frame buffer cannot be allocated\n");
+   D = Create_Decoder();
+   FB = Decode_Frame(D, FileName);
+   Free_Decoder(D);
+   if (FB == NULL)
       exit(1);
-   }
-   for (Row = 0; Row < 3 * Height * Width; Row += 3 * Width) {
-      RowPtr = (JSAMPROW *) &(FB->Frm[Row]);
-      jpeg_read_scanlines(&cinfo, (JSAMPARRAY) &RowPtr, 1);
-   }
-   jpeg_finish_decompress(&cinfo);
-   fclose(FP);
    return (FB);
 }
 
@@ -178,7 +300,7 @@ message is printed and execution terminates.*/
 FrmBuf *Duplicate_Frame(FrmBuf *Src) {
    FrmBuf               *Dst;
 
-   Dst = Alloc_Frame(Src->Width, Src->Height);
+   Dst = Alloc_Frame_Uncleared(Src->Width, Src->Height);   // every pixel is copied
    if (Dst == NULL) {
       fprintf(stderr, "ERROR: frame buffer cannot be allocated\n");
       exit(1);
@@ -192,102 +314,642 @@ FrmBuf *Duplicate_Frame(FrmBuf *Src) {
 This routine prints all frame buffers on the free lists. */
 
 void Print_Free_Frames() {
-   FrmBuf                              *FB = FreeFrames;
+   FrmBuf                              *FB;
+   int                                 I;
 
-   while (FB) {
-      printf("%u: (%d,%d) next=%u\n", (unsigned int) FB, FB->Width, FB->Height, (unsigned int) FB->Next);
-      FB = FB->Next;
-   }
+   for (I = 0; I < FRAMEBUCKETS; I++)
+      for (FB = FreeFrames[I].Free; FB; FB = FB->Next)
+	 printf("%p: (%d,%d) next=%p\n", (void *) FB, FB->Width, FB->Height, (void *) FB->Next);
    printf("\n");
 }
 
 /*              Free Frame
 
 This routine deallocates a frame object (including the data array) by
-pushing it on the free frame list. */
+pushing it on the free frame list of its size. If the free list table
+is full of other sizes, the frame is returned to the heap. Only the
+frame object of a view is deallocated. */
 
 void Free_Frame(FrmBuf *FB) {
+   Frame_Bucket                        *B;
 
-   FB->Next = FreeFrames;
-   FreeFrames = FB;
+   if (FB->Parent) {
+      free(FB);
+      return;
+   }
+   B = Frame_Bucket_Of(FB->Width, FB->Height);
+   if (B == NULL) {
+      free(FB->Frm);
+      free(FB);
+      return;
+   }
+   FB->Next = B->Free;
+   B->Free = FB;
    //   Print_Free_Frames();
 }
 
+/*              View Frame
+
+This routine creates a view of Height rows of a frame buffer, from row
+Y. The view has the width of the frame and shares its pixels, so
+whatever is written to one shows in the other; the frame must outlive
+the view. If the rows are not within the frame or the view cannot be
+allocated, an error message is printed and execution terminates. */
+
+FrmBuf *View_Frame(FrmBuf *Parent, int Y, int Height) {
+   FrmBuf                              *FB;
+
+   if (Y < 0 || Height < 0 || Y + Height > Parent->Height) {
+      fprintf(stderr, "rows %d to %d are not within a %dx%d frame\n", Y, Y + Height - 1, Parent->Width, Parent->Height);
+      exit(1);
+   }
+   FB = (FrmBuf *) malloc(sizeof(FrmBuf));
+   if (FB == NULL) {
+      fprintf(stderr, "ERROR: frame buffer cannot be allocated\n");
+      exit(1);
+   }
+   FB->Frm = Parent->Frm + 3 * (size_t) Y * Parent->Width;
+   FB->Width = Parent->Width;
+   FB->Height = Height;
+   FB->Parent = Parent;
+   FB->Next = NULL;
+   return (FB);
+}
+
+/*              Create Frame Scope
+
+This routine creates an empty frame scope. If it cannot be allocated,
+an error message is printed and execution terminates. */
+
+Frame_Scope *Create_Frame_Scope() {
+   Frame_Scope                         *S;
+
+   S = (Frame_Scope *) calloc(1, sizeof(Frame_Scope));
+   if (S == NULL) {
+      fprintf(stderr, "Unable to allocate frame scope\n");
+      exit(1);
+   }
+   return (S);
+}
+
+/*              Scope Frame
+
+This routine hands a frame buffer to a scope, which frees it when it
+is released, and returns it. */
+
+FrmBuf *Scope_Frame(Frame_Scope *S, FrmBuf *FB) {
+
+   if (S->NumFrames == S->MaxFrames) {
+      S->MaxFrames = S->MaxFrames ? 2 * S->MaxFrames : 8;
+      S->Frames = (FrmBuf **) realloc(S->Frames, S->MaxFrames * sizeof(FrmBuf *));
+      if (S->Frames == NULL) {
+	 fprintf(stderr, "Unable to allocate frame scope\n");
+	 exit(1);
+      }
+   }
+   S->Frames[S->NumFrames++] = FB;
+   return (FB);
+}
+
+/*              Scope Alloc
+
+This routine allocates Bytes of scratch memory, aligned to 64 bytes,
+that stays valid until the scope is released. Memory comes from the
+scope's arena; until the arena has grown to the largest iteration, the
+overflow is allocated from the heap. If it cannot be allocated, an
+error message is printed and execution terminates. */
+
+void *Scope_Alloc(Frame_Scope *S, size_t Bytes) {
+   void                                *P;
+
+   Bytes = (Bytes + 63) & ~(size_t) 63;
+   S->HighWater += Bytes;
+   if (S->ArenaUsed + Bytes <= S->ArenaSize) {
+      P = S->Arena + S->ArenaUsed;
+      S->ArenaUsed += Bytes;
+      return (P);
+   }
+   if (S->NumSpills == S->MaxSpills) {
+      S->MaxSpills = S->MaxSpills ? 2 * S->MaxSpills : 8;
+      S->Spills = (void **) realloc(S->Spills, S->MaxSpills * sizeof(void *));
+   }
+   if (S->Spills == NULL || posix_memalign(&P, 64, Bytes) != 0) {
+      fprintf(stderr, "Unable to allocate frame scope scratch memory\n");
+      exit(1);
+   }
+   S->Spills[S->NumSpills++] = P;
+   return (P);
+}
+
+/*              Release Frame Scope
+
+This routine frees every frame buffer and all scratch memory of a
+scope, which can then be used for the next iteration. If scratch
+memory overflowed the arena, the arena is grown to fit it all. */
+
+void Release_Frame_Scope(Frame_Scope *S) {
+   int                                 I;
+
+   for (I = 0; I < S->NumFrames; I++)
+      Free_Frame(S->Frames[I]);
+   S->NumFrames = 0;
+   for (I = 0; I < S->NumSpills; I++)
+      free(S->Spills[I]);
+   if (S->NumSpills > 0) {
+      free(S->Arena);
+      if (posix_memalign((void **) &(S->Arena), 64, S->HighWater) != 0) {
+	 fprintf(stderr, "Unable to allocate frame scope scratch memory\n");
+	 exit(1);
+      }
+      S->ArenaSize = S->HighWater;
+   }
+   S->NumSpills = 0;
+   S->ArenaUsed = S->HighWater = 0;
+}
+
+/*              Free Frame Scope
+
+This routine releases a scope and deallocates it. */
+
+void Free_Frame_Scope(Frame_Scope *S) {
+
+   Release_Frame_Scope(S);
+   free(S->Frames);
+   free(S->Arena);
+   free(S->Spills);
+   free(S);
+}
+
 /*              Load Image
 
 This routine loads and decodes a JPEG image, storing it in a
-preallocated frame buffer. If the image file cannot be opened, or if
-the image size exceeds the frame buffer, an error message is printed
-and execution terminates. */
+preallocated frame buffer. If the image file cannot be opened or
+decoded, or if the image size exceeds the frame buffer, an error
+message is printed and execution terminates. */
 
 void Load_Image(char *FileName, FrmBuf *FB) {
-   struct jpeg_decompress_struct       cinfo;
-   struct jpeg_error_mgr               jerr;
-   FILE                                *FP;
+   Decoder                             *D;
+   int                                 OK;
+
+   D = Create_Decoder();
+   OK = Decode_Image(D, FileName, FB);
+   Free_Decoder(D);
+   if (!OK)
+      exit(1);
+}
+
+/*              Store Image
+
+This routine stores a frame buffer as a JPEG image. If the image file
+cannot be opened or encoded, an error message is printed and execution
+terminates. */
+
+void Store_Image(char *FileName, FrmBuf *FB) {
+   Encoder                             *E;
+   int                                 OK;
+
+   E = Create_Encoder(QUALITY);
+   OK = Write_Image(E, FileName, FB);
+   Free_Encoder(E);
+   if (!OK)
+      exit(1);
+}
+
+/**********************************************************************
+                        JPEG Codec Contexts
+***********************************************************************/
+
+/*              Codec Error Exit
+
+This routine replaces libjpeg's error exit, which terminates
+execution, with a jump back to the recovery point of the failing
+call. */
+
+static void Codec_Error_Exit(j_common_ptr Info) {
+
+   longjmp(((Codec_Error *) Info->err)->Jump, 1);
+}
+
+/*              Codec Failed
+
+This routine prints the pending libjpeg error message of a codec
+context. */
+
+static void Codec_Failed(j_common_ptr Info, char *FileName) {
+   char                                Message[JMSG_LENGTH_MAX];
+
+   (*Info->err->format_message)(Info, Message);
+   fprintf(stderr, "ERROR: %s: %s\n", FileName, Message);
+}
+
+/*              Create Decoder
+
+This routine creates a reusable JPEG decoder context. If it cannot be
+created, an error message is printed and execution terminates. */
+
+Decoder *Create_Decoder() {
+   Decoder                             *D;
+
+   D = (Decoder *) malloc(sizeof(Decoder));
+   if (D == NULL) {
+      fprintf(stderr, "ERROR: JPEG decoder cannot be allocated\n");
+      exit(1);
+   }
+   D->Info.err = jpeg_std_error(&(D->Err.Mgr));
+   D->Err.Mgr.error_exit = Codec_Error_Exit;
+   D->FP = NULL;
+   D->Scale = 1;
+   D->Fast = FALSE;
+   D->Memory = FALSE;
+   if (setjmp(D->Err.Jump)) {
+      Codec_Failed((j_common_ptr) &(D->Info), "JPEG decoder");
+      exit(1);
+   }
+   jpeg_create_decompress(&(D->Info));
+   return (D);
+}
+
+/*              Free Decoder
+
+This routine destroys a JPEG decoder context. */
+
+void Free_Decoder(Decoder *D) {
+
+   jpeg_destroy_decompress(&(D->Info));
+   free(D);
+}
+
+/*              Set Decoder Scale
+
+This routine makes a decoder context decode images at 1/Scale of their
+size (Scale is 1, 2, 4 or 8), which libjpeg does in the DCT domain at a
+fraction of the cost of a full decode. If Fast is set, the fast
+integer IDCT is used and chroma is upsampled by replication instead of
+interpolation, trading a little accuracy for speed. An image of W x H
+decodes to (W + Scale - 1) / Scale x (H + Scale - 1) / Scale (see
+Scaled_Size). */
+
+void Set_Decoder_Scale(Decoder *D, int Scale, int Fast) {
+
+   if (Scale != 2 && Scale != 4 && Scale != 8)
+      Scale = 1;
+   D->Scale = Scale;
+   D->Fast = Fast;
+}
+
+/*              Scaled Size
+
+This routine returns the size an image dimension decodes to at 1/Scale,
+rounding up as libjpeg does. */
+
+int Scaled_Size(int Size, int Scale) {
+
+   return ((Size + Scale - 1) / Scale);
+}
+
+/*              Attach Source
+
+This routine sets the source of a decoder context: the open file D->FP,
+or if it is NULL, Size bytes at Data. libjpeg can't switch source
+managers, so the decompressor is recreated when the kind of source
+changes. It must be called under the recovery point of the current
+call. */
+
+static void Attach_Source(Decoder *D, unsigned char *Data, unsigned long Size) {
+
+   if ((D->FP == NULL) != D->Memory) {
+      jpeg_destroy_decompress(&(D->Info));
+      jpeg_create_decompress(&(D->Info));
+      D->Memory = (D->FP == NULL);
+   }
+   if (D->FP)
+      jpeg_stdio_src(&(D->Info), D->FP);
+#if MEMSRC
+   else
+      jpeg_mem_src(&(D->Info), Data, Size);
+#endif
+}
+
+/*              Decode
+
+This routine decodes a JPEG image with a decoder context into *FB, or
+into a new frame buffer if *FB is NULL. The image is read from the
+file FileName, or if Data is given, from Size bytes in memory
+(FileName then only names the image in error messages). If the image
+cannot be opened or decoded, or exceeds the frame buffer, an error
+message is printed, the decoder is reset, any new frame buffer is
+freed and FALSE is returned. */
+
+static int Decode(Decoder *D, char *FileName, unsigned char *Data, unsigned long Size, FrmBuf **FB) {
+   FrmBuf                              *volatile New = NULL;
+   JSAMPROW                            RowPtr;
    int                                 Width, Height, Row;
-   JSAMPROW                            *RowPtr;
 
-   cinfo.err = jpeg_std_error(&jerr);
-   jpeg_create_decompress(&cinfo);
-   FP = fopen(FileName, "rb");
-   if (FP == NULL) {
+   if (Data == NULL)
+      D->FP = fopen(FileName, "rb");
+#if !MEMSRC
+   else
+      D->FP = fmemopen(Data, Size, "rb");              /* no memory source in this libjpeg */
+#endif
+   if (D->FP == NULL && !(Data && MEMSRC)) {
       fprintf(stderr, "ERROR: %s cannot be opened\n", FileName);
-      exit(1);
+      return (FALSE);
+   }
+   if (setjmp(D->Err.Jump)) {
+      Codec_Failed((j_common_ptr) &(D->Info), FileName);
+      jpeg_abort_decompress(&(D->Info));
+      if (D->FP)
+         fclose(D->FP);
+      D->FP = NULL;
+      if (New)
+         Free_Frame(New);
+      return (FALSE);
    }
-   jpeg_stdio_src(&cinfo, FP);
-   jpeg_read_header(&cinfo, TRUE);
-   cinfo.out_color_space = JCS_RGB;
-   jpeg_start_decompress(&cinfo);
-   Width = cinfo.output_width;
-   Height = cinfo.output_height;
-   if (Width > FB->Width || Height > FB->Height) {
+   Attach_Source(D, Data, Size);
+   jpeg_read_header(&(D->Info), TRUE);
+   D->Info.out_color_space = JCS_RGB;
+   D->Info.scale_num = 1;                               /* reset by every jpeg_read_header */
+   D->Info.scale_denom = D->Scale;
+   if (D->Fast) {
+      D->Info.dct_method = JDCT_IFAST;
+      D->Info.do_fancy_upsampling = FALSE;
+   }
+   jpeg_start_decompress(&(D->Info));
+   Width = D->Info.output_width;
+   Height = D->Info.output_height;
+   if (*FB == NULL) {
+      *FB = New = Alloc_Frame_Uncleared(Width, Height);   // every row is decoded
+      if (New == NULL) {
+         fprintf(stderr, "ERROR: frame buffer cannot be allocated\n");
+         exit(1);
+      }
+   }
+   if (Width > (*FB)->Width || Height > (*FB)->Height) {
       fprintf(stderr, "ERROR: image size (%d,%d) exceeds frame buffer size (%d,%d)\n", \
-	      Width, Height, FB->Width, FB->Height);
-      exit(1);
+	      Width, Height, (*FB)->Width, (*FB)->Height);
+      jpeg_abort_decompress(&(D->Info));
+      if (D->FP)
+         fclose(D->FP);
+      D->FP = NULL;
+      return (FALSE);
    }
    for (Row = 0; Row < 3 * Height * Width; Row += 3 * Width) {
-      RowPtr = (JSAMPROW *) &(FB->Frm[Row]);
-      jpeg_read_scanlines(&cinfo, (JSAMPARRAY) &RowPtr, 1);
+      RowPtr = (JSAMPROW) &((*FB)->Frm[Row]);
+      jpeg_read_scanlines(&(D->Info), &RowPtr, 1);
    }
-   jpeg_finish_decompress(&cinfo);
-   fclose(FP);
+   jpeg_finish_decompress(&(D->Info));
+   if (D->FP)
+      fclose(D->FP);
+   D->FP = NULL;
+   return (TRUE);
 }
 
-/*              Store Image
+/*              Decode Image
 
-This routine stores a frame buffer as a JPEG image. If the image file
-cannot be opened, an error message is printed and execution
-terminates. */
+This routine is a recoverable Load_Image: it decodes a JPEG image into
+a preallocated frame buffer with a decoder context, returning TRUE. On
+error, a message is printed and FALSE is returned. */
 
-void Store_Image(char *FileName, FrmBuf *FB) {
-   struct jpeg_compress_struct		cinfo;
-   struct jpeg_error_mgr		jerr;
-   FILE					*FP;
+int Decode_Image(Decoder *D, char *FileName, FrmBuf *FB) {
+
+   return (Decode(D, FileName, NULL, 0, &FB));
+}
+
+/*              Decode Memory
+
+This routine is Decode_Image for a JPEG image held in memory (Size
+bytes at Data), such as a frame of a memory mapped pack; Name
+identifies the image in error messages. On error, a message is printed
+and FALSE is returned. */
+
+int Decode_Memory(Decoder *D, unsigned char *Data, unsigned long Size, char *Name, FrmBuf *FB) {
+
+   return (Decode(D, Name, Data, Size, &FB));
+}
+
+/*              Decode Frame
+
+This routine is a recoverable Create_Frame: it decodes a JPEG image
+into a new frame buffer with a decoder context. On error, a message is
+printed and NULL is returned. Like Alloc_Frame, it must only be called
+from one thread at a time. */
+
+FrmBuf *Decode_Frame(Decoder *D, char *FileName) {
+   FrmBuf                              *FB = NULL;
+
+   if (!Decode(D, FileName, NULL, 0, &FB))
+      return (NULL);
+   return (FB);
+}
+
+/*              Read Header
+
+This routine reads the header of a JPEG image file with a decoder
+context, without decoding it, and returns its width and height. If the
+image cannot be opened, its header is invalid or it does not hold three
+color components, an error message is printed, the decoder is reset and
+FALSE is returned. */
+
+int Read_Header(Decoder *D, char *FileName, int *Width, int *Height) {
+   int                                 Components;
+
+   D->FP = fopen(FileName, "rb");
+   if (D->FP == NULL) {
+      fprintf(stderr, "ERROR: %s cannot be opened\n", FileName);
+      return (FALSE);
+   }
+   if (setjmp(D->Err.Jump)) {
+      Codec_Failed((j_common_ptr) &(D->Info), FileName);
+      jpeg_abort_decompress(&(D->Info));
+      fclose(D->FP);
+      D->FP = NULL;
+      return (FALSE);
+   }
+   Attach_Source(D, NULL, 0);
+   jpeg_read_header(&(D->Info), TRUE);
+   *Width = D->Info.image_width;
+   *Height = D->Info.image_height;
+   Components = D->Info.num_components;
+   jpeg_abort_decompress(&(D->Info));
+   fclose(D->FP);
+   D->FP = NULL;
+   if (Components != 3) {
+      fprintf(stderr, "ERROR: %s: %d color components; wrong image type\n", FileName, Components);
+      return (FALSE);
+   }
+   return (TRUE);
+}
+
+/*              Create Encoder
+
+This routine creates a reusable JPEG encoder context producing
+baseline JPEG images of the given quality. If it cannot be created, an
+error message is printed and execution terminates. */
+
+Encoder *Create_Encoder(int Quality) {
+   Encoder                             *E;
+   Encode_Profile                      Profile;
+   int                                 T;
+
+   E = (Encoder *) malloc(sizeof(Encoder));
+   if (E == NULL) {
+      fprintf(stderr, "ERROR: JPEG encoder cannot be allocated\n");
+      exit(1);
+   }
+   E->Info.err = jpeg_std_error(&(E->Err.Mgr));
+   E->Err.Mgr.error_exit = Codec_Error_Exit;
+   if (setjmp(E->Err.Jump)) {
+      Codec_Failed((j_common_ptr) &(E->Info), "JPEG encoder");
+      exit(1);
+   }
+   jpeg_create_compress(&(E->Info));
+   E->Info.input_components = 3;		/* # of color components per pixel */
+   E->Info.in_color_space = JCS_RGB; 		/* colorspace of input image */
+   jpeg_set_defaults(&(E->Info));
+   for (T = 0; T < NUM_HUFF_TBLS; T++) {	/* Huffman optimization overwrites them */
+      if (E->Info.dc_huff_tbl_ptrs[T])
+         E->StdDC[T] = *(E->Info.dc_huff_tbl_ptrs[T]);
+      if (E->Info.ac_huff_tbl_ptrs[T])
+         E->StdAC[T] = *(E->Info.ac_huff_tbl_ptrs[T]);
+   }
+   E->Profile = Encode_Profiles[0];
+   E->Profile.Quality = -1;			/* not yet applied */
+   Profile = Encode_Profiles[0];
+   Profile.Quality = Quality;
+   Set_Encoder_Profile(E, &Profile);
+   return (E);
+}
+
+/*              Free Encoder
+
+This routine destroys a JPEG encoder context. */
+
+void Free_Encoder(Encoder *E) {
+
+   jpeg_destroy_compress(&(E->Info));
+   free(E);
+}
+
+/*              Find Encode Profile
+
+This routine returns the encode profile of a given name, or NULL if
+there is none. */
+
+Encode_Profile *Find_Encode_Profile(char *Name) {
+   Encode_Profile                      *P;
+
+   for (P = Encode_Profiles; P->Name; P++)
+      if (strcmp(P->Name, Name) == 0)
+         return (P);
+   return (NULL);
+}
+
+/*              Parse Encode Profile
+
+This routine parses a profile specification, a profile name optionally
+followed by :QUALITY (as in "preview:30"), into Profile. It returns
+FALSE if the name is unknown or the quality is not 1-100. */
+
+int Parse_Encode_Profile(char *Spec, Encode_Profile *Profile) {
+   Encode_Profile                      *P;
+   char                                Name[32];
+   int                                 Quality, Used = 0, Rest = 0;
+
+   if (sscanf(Spec, "%31[^:]%n", Name, &Used) != 1 || (P = Find_Encode_Profile(Name)) == NULL)
+      return (FALSE);
+   *Profile = *P;
+   if (Spec[Used] == '\0')
+      return (TRUE);
+   if (sscanf(Spec + Used, ":%d%n", &Quality, &Rest) != 1 || Spec[Used + Rest] != '\0' ||
+       Quality < 1 || Quality > 100)
+      return (FALSE);
+   Profile->Quality = Quality;
+   return (TRUE);
+}
+
+/*              Set Encoder Profile
+
+This routine switches an encoder context to the settings of a profile.
+The settings are only rebuilt when the profile differs from the
+current one, so it can be called before every image. They are rebuilt
+from the defaults, with the standard Huffman tables put back, since
+Huffman optimization leaves its tables behind (and jpeg_set_defaults
+does not replace existing tables). */
+
+void Set_Encoder_Profile(Encoder *E, Encode_Profile *Profile) {
+   int                                 T;
+
+   if (E->Profile.Quality == Profile->Quality && E->Profile.FastDCT == Profile->FastDCT &&
+       E->Profile.Sampling == Profile->Sampling && E->Profile.Optimize == Profile->Optimize)
+      return;
+   if (setjmp(E->Err.Jump)) {
+      Codec_Failed((j_common_ptr) &(E->Info), "JPEG encoder");
+      exit(1);
+   }
+   jpeg_set_defaults(&(E->Info));
+   for (T = 0; T < NUM_HUFF_TBLS; T++) {
+      if (E->Info.dc_huff_tbl_ptrs[T])
+         *(E->Info.dc_huff_tbl_ptrs[T]) = E->StdDC[T];
+      if (E->Info.ac_huff_tbl_ptrs[T])
+         *(E->Info.ac_huff_tbl_ptrs[T]) = E->StdAC[T];
+   }
+   jpeg_set_quality(&(E->Info), Profile->Quality, TRUE);	/* limit to baseline-JPEG values */
+   E->Info.dct_method = Profile->FastDCT ? JDCT_IFAST : JDCT_ISLOW;
+   E->Info.comp_info[0].h_samp_factor = (Profile->Sampling == 444) ? 1 : 2;	/* luma, chroma is 1x1 */
+   E->Info.comp_info[0].v_samp_factor = (Profile->Sampling == 420) ? 2 : 1;
+   E->Info.optimize_coding = Profile->Optimize;
+   E->Profile = *Profile;
+}
+
+/*              Encode Image
+
+This routine encodes a frame buffer as a JPEG image onto an open stdio
+stream with an encoder context, leaving the stream open, and returns
+TRUE. On error, a message is printed, the encoder is reset and FALSE
+is returned. */
+
+int Encode_Image(Encoder *E, FILE *FP, FrmBuf *FB) {
    JSAMPROW 				RowPtr[1];
    int					RowStride;
 
-   cinfo.err = jpeg_std_error(&jerr);
-   jpeg_create_compress(&cinfo);
+   if (setjmp(E->Err.Jump)) {
+      Codec_Failed((j_common_ptr) &(E->Info), "JPEG encoder");
+      jpeg_abort_compress(&(E->Info));
+      return (FALSE);
+   }
+   jpeg_stdio_dest(&(E->Info), FP);
+   E->Info.image_width = FB->Width; 		/* image width and height, in pixels */
+   E->Info.image_height = FB->Height;
+   jpeg_start_compress(&(E->Info), TRUE);
+   RowStride = FB->Width * 3;			/* JSAMPLEs per row in image_buffer */
+   while (E->Info.next_scanline < E->Info.image_height) {
+      RowPtr[0] = (JSAMPROW) &(FB->Frm[E->Info.next_scanline * RowStride]);
+      (void) jpeg_write_scanlines(&(E->Info), RowPtr, 1);
+   }
+   jpeg_finish_compress(&(E->Info));
+   return (TRUE);
+}
+
+/*              Write Image
+
+This routine is a recoverable Store_Image: it encodes a frame buffer
+into a JPEG image file with an encoder context, returning TRUE. On
+error, a message is printed and FALSE is returned. */
+
+int Write_Image(Encoder *E, char *FileName, FrmBuf *FB) {
+   FILE					*FP;
+   int					OK;
+
    if ((FP = fopen(FileName, "wb")) == NULL) {
       fprintf(stderr, "can't open %s\n", FileName);
-      exit(1);
+      return (FALSE);
    }
-   jpeg_stdio_dest(&cinfo, FP);
-   cinfo.image_width = FB->Width; 		/* image width and height, in pixels */
-   cinfo.image_height = FB->Height;
-   cinfo.input_components = 3;			/* # of color components per pixel */
-   cinfo.in_color_space = JCS_RGB; 		/* colorspace of input image */
-   jpeg_set_defaults(&cinfo);
-   jpeg_set_quality(&cinfo, QUALITY, TRUE);	/* limit to baseline-JPEG values */
-   jpeg_start_compress(&cinfo, TRUE);
-   RowStride = FB->Width * 3;			/* JSAMPLEs per row in image_buffer */
-   while (cinfo.next_scanline < cinfo.image_height) {
-      RowPtr[0] = (JSAMPROW) &(FB->Frm[cinfo.next_scanline * RowStride]);
-      (void) jpeg_write_scanlines(&cinfo, RowPtr, 1);
+   OK = Encode_Image(E, FP, FB);
+   if (fclose(FP) != 0 && OK) {
+      fprintf(stderr, "can't write %s\n", FileName);
+      OK = FALSE;
    }
-   jpeg_finish_compress(&cinfo);
-   fclose(FP);
-   jpeg_destroy_compress(&cinfo);
+   return (OK);
 }
 
 /*              Copy Image
@@ -297,52 +959,39 @@ are preallocated. It is possible for the copied image to be offset
 within the destination frame. An Offset value of 0 is appropriate for
 copying for equal sized frame buffers. If the destination frame is
 larger than the source image, the offset defines a pane within the
-larger window using row/column ordering. */
+larger window using row/column ordering. Rows are copied whole, and a
+pane as wide as the window is a single block. */
 
 void Copy_Image(FrmBuf *Src, FrmBuf *Dst, int Offset) {
    int                  NumTilesX = Dst->Width /  Src->Width;       // number of tiles in row of window
    int                  Tx = (Offset % NumTilesX) * Src->Width;    // base X pixel offset
    int                  Ty = (Offset / NumTilesX) * Src->Height;   // base Y pixel offset
-   int                  X, Y, I, J;
-
-   for (Y = 0; Y < Src->Height; Y++)
-      for (X = 0; X < Src->Width; X++) {
-	 I = (Y * Src->Width + X) * 3;                 // pixel offset for source
-         J = ((Ty + Y) * Dst->Width + Tx + X) * 3;     // pixel offset for destination
-         Dst->Frm[J] = Src->Frm[I];
-         Dst->Frm[J+1] = Src->Frm[I+1];
-         Dst->Frm[J+2] = Src->Frm[I+2];
-      }
+   int                  Y;
+
+   if (Dst->Width == Src->Width) {        // full width panes are one block
+      memcpy(&Dst->Frm[Ty * Dst->Width * 3], Src->Frm, 3 * (size_t) Src->Width * Src->Height);
+      return;
+   }
+   for (Y = 0; Y < Src->Height; Y++)      // else a row at a time
+      memcpy(&Dst->Frm[((Ty + Y) * Dst->Width + Tx) * 3], &Src->Frm[Y * Src->Width * 3], 3 * Src->Width);
 }
 
-/*                 Read Header
+/*              Mask Image
 
-This depreciated routine returns an jpeg image header, returning its
-width and height. */
+This routine copies Src to Dst, blacking out each pixel whose mask
+byte is zero. Both frame buffers are preallocated with equal size; Src
+and Dst may be the same frame. */
 
-void Read_Header(char *FileName, int *Width, int *Height) {
-   struct jpeg_decompress_struct       cinfo;
-   struct jpeg_error_mgr               jerr;
-   FILE                                *FP;
+void Mask_Image(FrmBuf *Src, unsigned char *Mask, FrmBuf *Dst) {
+   int                  I;
 
-   cinfo.err = jpeg_std_error(&jerr);
-   jpeg_create_decompress(&cinfo);
-   FP = fopen(FileName, "rb");
-   if (FP == NULL) {
-      fprintf(stderr, "ERROR: %s cannot be opened\n", FileName);
-      exit(1);
-   }
-   jpeg_stdio_src(&cinfo, FP);
-   jpeg_read_header(&cinfo, TRUE);
-   jpeg_start_decompress(&cinfo);
-   *Width = cinfo.output_width;
-   *Height = cinfo.output_height;
-   if (cinfo.out_color_components != 3) {
-      fprintf(stderr, "ERROR: %d color components; wrong image type\n", cinfo.out_color_components);
-      exit(1);
-   }
-   jpeg_destroy_decompress(&cinfo);
-   fclose(FP);
+   for (I = 0; I < Src->Width * Src->Height; I++)
+      if (Mask[I]) {
+         Dst->Frm[3*I] = Src->Frm[3*I];
+         Dst->Frm[3*I+1] = Src->Frm[3*I+1];
+         Dst->Frm[3*I+2] = Src->Frm[3*I+2];
+      } else
+         Dst->Frm[3*I] = Dst->Frm[3*I+1] = Dst->Frm[3*I+2] = 0;
 }
 
 /*               New Point
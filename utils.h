@@ -18,8 +18,29 @@ typedef struct FrmBuf {
    int                 Height;
    int                 Width;
    struct FrmBuf       *Next;
+   struct FrmBuf       *Parent;        /* a view of this frame's rows, or NULL */
 } FrmBuf;
 
+typedef struct Frame_Scope {
+   FrmBuf              **Frames;     // frames freed when the scope is released
+   int                 NumFrames, MaxFrames;
+   unsigned char       *Arena;       // scratch memory, reused after each release
+   size_t              ArenaSize, ArenaUsed, HighWater;
+   void                **Spills;     // scratch that did not fit in the arena
+   int                 NumSpills, MaxSpills;
+} Frame_Scope;
+
+typedef struct Decoder Decoder;    // JPEG codec contexts (private to utils.c)
+typedef struct Encoder Encoder;
+
+typedef struct Encode_Profile {
+   char                *Name;
+   int                 Quality;      // 1-100
+   int                 FastDCT;      // fast integer DCT instead of the slow accurate one
+   int                 Sampling;     // chroma subsampling: 420, 422 or 444
+   int                 Optimize;     // optimized Huffman tables (smaller files, slower)
+} Encode_Profile;
+
 typedef struct Point {
    int X, Y;
    struct Point *Next;
@@ -41,16 +62,42 @@ typedef struct Point {
 #define SW              2    // south west quad position
 #define SE              3    // south east quad position
 #define FATLINE         1    // make lines thicker
+#define FRAMEBUCKETS   64    // free frame lists, one per frame size
+#define FRAMEALIGN     64    // frame pixel array alignment (cache line)
+#define HUGEFRAMES      0    // set to 1 to back large frames with huge pages
+#define HUGEPAGESIZE   (2 << 20)   // huge page size
 
 extern void Clear_Frame (FrmBuf *FB);
 extern FrmBuf *Alloc_Frame(int Width, int Height);
+extern FrmBuf *Alloc_Frame_Uncleared(int Width, int Height);
 extern FrmBuf *Create_Frame(char *FileName);
 extern FrmBuf *Duplicate_Frame(FrmBuf *Src);
 extern void Free_Frame(FrmBuf *FB);
+extern FrmBuf *View_Frame(FrmBuf *Parent, int Y, int Height);
+extern Frame_Scope *Create_Frame_Scope();
+extern FrmBuf *Scope_Frame(Frame_Scope *S, FrmBuf *FB);
+extern void *Scope_Alloc(Frame_Scope *S, size_t Bytes);
+extern void Release_Frame_Scope(Frame_Scope *S);
+extern void Free_Frame_Scope(Frame_Scope *S);
 extern void Load_Image(char *FileName, FrmBuf *FB);
 extern void Store_Image(char *FileName, FrmBuf *FB);
+extern Decoder *Create_Decoder();
+extern void Free_Decoder(Decoder *D);
+extern int Decode_Image(Decoder *D, char *FileName, FrmBuf *FB);
+extern FrmBuf *Decode_Frame(Decoder *D, char *FileName);
+extern int Decode_Memory(Decoder *D, unsigned char *Data, unsigned long Size, char *Name, FrmBuf *FB);
+extern int Read_Header(Decoder *D, char *FileName, int *Width, int *Height);
+extern void Set_Decoder_Scale(Decoder *D, int Scale, int Fast);
+extern int Scaled_Size(int Size, int Scale);
+extern Encoder *Create_Encoder(int Quality);
+extern void Free_Encoder(Encoder *E);
+extern Encode_Profile *Find_Encode_Profile(char *Name);
+extern int Parse_Encode_Profile(char *Spec, Encode_Profile *Profile);
+extern void Set_Encoder_Profile(Encoder *E, Encode_Profile *Profile);
+extern int Encode_Image(Encoder *E, FILE *FP, FrmBuf *FB);
+extern int Write_Image(Encoder *E, char *FileName, FrmBuf *FB);
 extern void Copy_Image(FrmBuf *Src, FrmBuf *Dst, int Offset);
-extern void Read_Header(char *FileName, int *Width, int *Height);
+extern void Mask_Image(FrmBuf *Src, unsigned char *Mask, FrmBuf *Dst);
 extern Point *New_Point(int X, int Y);
 extern Point *Add_Point(Point *Line, int X, int Y);
 extern void Free_Point (Point *Pt);
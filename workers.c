@@ -0,0 +1,185 @@
+/*                     Worker Pool
+
+This library provides a fixed pool of worker threads that split a
+range of work items (typically frame rows) into contiguous bands and
+process them in parallel.
+
+Part of the Virtual Blue-Screen program (P3-1).
+
+Documentation:
+
+A pool with N bands owns N-1 threads; the calling thread processes
+band 0 itself. Run_Bands divides Total items into N contiguous bands
+of near equal size and calls the band function once per band, then
+waits until all bands are done. A given band number is always run by
+the same thread, so per-band state (such as free lists) stays with one
+thread across calls.
+
+Key Usage Functions:
+
+Create_Workers(): Creates a pool with the specified number of bands.
+
+Run_Bands(): Runs a band function over a range of items and waits for
+completion.
+
+Free_Workers(): Stops the worker threads and deallocates the pool.
+
+Example:
+
+   Workers              *W;
+
+   W = Create_Workers(NumThreads);
+   for (...) {
+      ...
+      Run_Bands(W, Process_Rows, &Args, FB->Height);
+   }
+   Free_Workers(W);
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "workers.h"
+
+typedef struct          Worker {
+   Workers              *W;
+   int                  Band;
+}  Worker;
+
+/*              Band Range
+
+This routine computes the first and last (exclusive) items of a band. */
+
+static void Band_Range(Workers *W, int Band, int *First, int *Last) {
+
+   *First = (int) ((long long) W->Total * Band / W->NumBands);
+   *Last = (int) ((long long) W->Total * (Band + 1) / W->NumBands);
+}
+
+/*              Worker Thread
+
+This routine is the body of each worker thread. It waits for a new
+generation of work, runs its band, and reports completion. */
+
+static void *Worker_Thread(void *Arg) {
+
+   Worker               *Self = (Worker *) Arg;
+   Workers              *W = Self->W;
+   int                  Seen = 0, First, Last;
+
+   pthread_mutex_lock(&W->Lock);
+   for (;;) {
+      while (W->Generation == Seen && !W->Quit)
+         pthread_cond_wait(&W->Start, &W->Lock);
+      if (W->Quit)
+         break;
+      Seen = W->Generation;
+      Band_Range(W, Self->Band, &First, &Last);
+      pthread_mutex_unlock(&W->Lock);
+      if (First < Last)
+         W->Func(W->Arg, Self->Band, First, Last);
+      pthread_mutex_lock(&W->Lock);
+      W->Pending -= 1;
+      if (W->Pending == 0)
+         pthread_cond_signal(&W->Finish);
+   }
+   pthread_mutex_unlock(&W->Lock);
+   free(Self);
+   return (NULL);
+}
+
+/*              Create Workers
+
+This routine creates a worker pool with NumBands bands (1 to
+MAXBANDS), starting NumBands - 1 threads. If the pool cannot be
+created, an error message is printed and execution terminates. */
+
+Workers *Create_Workers(int NumBands) {
+
+   Workers              *W;
+   Worker               *Self;
+   int                  Band;
+
+   if (NumBands < 1)
+      NumBands = 1;
+   if (NumBands > MAXBANDS)
+      NumBands = MAXBANDS;
+   W = (Workers *) malloc(sizeof(Workers));
+   if (W == NULL) {
+      fprintf(stderr, "Unable to allocate worker pool\n");
+      exit (1);
+   }
+   W->NumBands = NumBands;
+   W->Generation = W->Pending = W->Quit = W->Total = 0;
+   W->Func = NULL;
+   W->Arg = NULL;
+   pthread_mutex_init(&W->Lock, NULL);
+   pthread_cond_init(&W->Start, NULL);
+   pthread_cond_init(&W->Finish, NULL);
+   W->Threads = (pthread_t *) malloc(NumBands * sizeof(pthread_t));
+   if (W->Threads == NULL) {
+      fprintf(stderr, "Unable to allocate worker pool\n");
+      exit (1);
+   }
+   for (Band = 1; Band < NumBands; Band++) {
+      Self = (Worker *) malloc(sizeof(Worker));
+      if (Self == NULL) {
+         fprintf(stderr, "Unable to allocate worker pool\n");
+         exit (1);
+      }
+      Self->W = W;
+      Self->Band = Band;
+      if (pthread_create(&(W->Threads[Band]), NULL, Worker_Thread, Self)) {
+         fprintf(stderr, "Unable to start worker thread\n");
+         exit (1);
+      }
+   }
+   return (W);
+}
+
+/*              Run Bands
+
+This routine splits Total items into bands and runs Func on each band
+in parallel. The calling thread runs band 0. It returns when every band
+is finished. */
+
+void Run_Bands(Workers *W, Band_Func Func, void *Arg, int Total) {
+
+   int                  First, Last;
+
+   pthread_mutex_lock(&W->Lock);
+   W->Func = Func;
+   W->Arg = Arg;
+   W->Total = Total;
+   W->Pending = W->NumBands - 1;
+   W->Generation += 1;
+   pthread_cond_broadcast(&W->Start);
+   pthread_mutex_unlock(&W->Lock);
+   Band_Range(W, 0, &First, &Last);
+   if (First < Last)
+      Func(Arg, 0, First, Last);
+   pthread_mutex_lock(&W->Lock);
+   while (W->Pending > 0)
+      pthread_cond_wait(&W->Finish, &W->Lock);
+   pthread_mutex_unlock(&W->Lock);
+}
+
+/*              Free Workers
+
+This routine stops the worker threads and deallocates the pool. */
+
+void Free_Workers(Workers *W) {
+
+   int                  Band;
+
+   pthread_mutex_lock(&W->Lock);
+   W->Quit = 1;
+   pthread_cond_broadcast(&W->Start);
+   pthread_mutex_unlock(&W->Lock);
+   for (Band = 1; Band < W->NumBands; Band++)
+      pthread_join(W->Threads[Band], NULL);
+   pthread_mutex_destroy(&W->Lock);
+   pthread_cond_destroy(&W->Start);
+   pthread_cond_destroy(&W->Finish);
+   free(W->Threads);
+   free(W);
+}
@@ -0,0 +1,26 @@
+/*                     Worker Pool
+
+This library provides a fixed pool of worker threads that split a
+range of work items (typically frame rows) into contiguous bands and
+process them in parallel.
+
+Part of the Virtual Blue-Screen program (P3-1).               */
+
+#include <pthread.h>
+
+typedef void (*Band_Func)(void *Arg, int Band, int First, int Last);
+
+typedef struct          Workers {
+   int                  NumBands, Generation, Pending, Quit, Total;
+   pthread_t            *Threads;
+   pthread_mutex_t      Lock;
+   pthread_cond_t       Start, Finish;
+   Band_Func            Func;
+   void                 *Arg;
+}  Workers;
+
+#define                 MAXBANDS 64
+
+extern Workers *Create_Workers(int NumBands);
+extern void Run_Bands(Workers *W, Band_Func Func, void *Arg, int Total);
+extern void Free_Workers(Workers *W);
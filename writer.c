@@ -0,0 +1,333 @@
+/*                     Frame Writer
+
+This library encodes and stores JPEG output frames on a pool of
+encoder threads, off the caller's critical path.
+
+Part of the Virtual Blue-Screen program (P3-1).
+
+Documentation:
+
+Write_Frame takes ownership of a frame buffer and queues it with its
+file name and encode profile. An encoder thread encodes it into memory
+with its own reusable JPEG encoder context, switched to the job's
+profile, then writes the file. Write_AVI_Frame queues a frame the same
+way, to be appended to a stream of a Motion JPEG AVI file instead.
+Frames are encoded in parallel, but files are written (and AVI frames
+appended) strictly in submission order, so the output fills exactly
+as it would with Store_Image or Store_AVI_Frame. At most Depth frames are queued or in flight; beyond
+that Write_Frame waits (backpressure).
+
+Jobs are allocated once, Depth of them, and reused, so queueing a
+frame allocates nothing. (Encoding still does: the JPEG library and
+the in-memory file each frame is encoded into allocate per image.)
+
+Stored frame buffers are handed back to the caller's thread and
+recycled with Free_Frame on the next call to Write_Frame, Flush_Writer
+or Free_Writer, so the free frame list is only touched by one thread.
+If a frame cannot be encoded or its file cannot be written, an error
+message is printed and execution terminates on the caller's next
+call, as Store_Image would have.
+
+Key Usage Functions:
+
+Create_Writer(): Creates a writer with a number of encoder threads and
+a queue depth.
+
+Write_Frame(): Queues a frame buffer for encoding and storing with an
+encode profile. The frame buffer must not be used by the caller
+afterwards. The profile must stay valid until the writer is flushed.
+
+Write_AVI_Frame(): Queues a frame buffer for encoding and appending to
+a stream of an AVI file. The writer must be flushed before the AVI
+file is closed.
+
+Flush_Writer(): Waits until every queued frame is stored.
+
+Free_Writer(): Flushes the writer, stops the encoder threads and
+deallocates the writer.
+
+Example:
+
+   Writer               *W;
+
+   W = Create_Writer(NumThreads, 2 * NumThreads);
+   for (...) {
+      ...
+      Write_Frame(W, FileName, Duplicate_Frame(FB), NULL);
+   }
+   Free_Writer(W);
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "utils.h"
+#include "avi.h"
+#include "writer.h"
+
+/*              Encoder Thread
+
+This routine is the body of each encoder thread. It takes the oldest
+queued job, encodes the frame into memory, waits for its turn and
+writes the file (or appends the frame to its AVI file), then hands the frame buffer back for recycling. */
+
+static void *Encoder_Thread(void *Arg) {
+
+   Writer               *W = (Writer *) Arg;
+   Encoder              *E = Create_Encoder(QUALITY);
+   Write_Job            *Job;
+   FILE                 *FP;
+   char                 *Data;
+   size_t               Size;
+   int                  Encoded, Stored;
+
+   pthread_mutex_lock(&W->Lock);
+   for (;;) {
+      while (!W->Quit && W->Head == NULL)
+         pthread_cond_wait(&W->Work, &W->Lock);
+      if (W->Head == NULL)
+         break;
+      Job = W->Head;
+      W->Head = Job->Next;
+      if (W->Head == NULL)
+         W->Tail = NULL;
+      pthread_mutex_unlock(&W->Lock);
+      Data = NULL;
+      Size = 0;
+      FP = open_memstream(&Data, &Size);
+      if (FP != NULL) {
+         Set_Encoder_Profile(E, Job->Profile ? Job->Profile : Find_Encode_Profile("default"));
+         Encoded = Encode_Image(E, FP, Job->FB);
+         fclose(FP);
+         if (!Encoded) {
+            free(Data);
+            Data = NULL;
+         }
+      }
+      pthread_mutex_lock(&W->Lock);
+      while (W->Stored != Job->Ticket)                  /* files are written in order */
+         pthread_cond_wait(&W->Turn, &W->Lock);
+      pthread_mutex_unlock(&W->Lock);
+      Stored = FALSE;
+      if (Data != NULL && Job->AVI != NULL)
+         Stored = Append_AVI_Frame(Job->AVI, Job->Stream, (unsigned char *) Data, Size);
+      else if (Data != NULL && (FP = fopen(Job->FileName, "wb")) != NULL) {
+         Stored = (fwrite(Data, 1, Size, FP) == Size);
+         Stored = (fclose(FP) == 0) && Stored;
+      }
+      free(Data);
+      pthread_mutex_lock(&W->Lock);
+      if (!Stored && W->Failed[0] == '\0')
+         strcpy(W->Failed, Job->FileName);
+      Job->FB->Next = W->Done;
+      W->Done = Job->FB;
+      W->Stored += 1;
+      W->Pending -= 1;
+      pthread_cond_broadcast(&W->Turn);
+      pthread_cond_broadcast(&W->Room);
+      Job->Next = W->Idle;
+      W->Idle = Job;
+   }
+   pthread_mutex_unlock(&W->Lock);
+   Free_Encoder(E);
+   return (NULL);
+}
+
+/*              Reap Frames
+
+This routine recycles the frame buffers of stored jobs with
+Free_Frame on the caller's thread. If a file could not be written, an
+error message is printed and execution terminates. */
+
+static void Reap_Frames(Writer *W) {
+
+   FrmBuf               *FB, *Next;
+
+   pthread_mutex_lock(&W->Lock);
+   FB = W->Done;
+   W->Done = NULL;
+   if (W->Failed[0] != '\0') {
+      fprintf(stderr, "can't write %s\n", W->Failed);
+      exit(1);
+   }
+   pthread_mutex_unlock(&W->Lock);
+   for (; FB != NULL; FB = Next) {
+      Next = FB->Next;
+      Free_Frame(FB);
+   }
+}
+
+/*              Create Writer
+
+This routine creates a writer with NumThreads encoder threads (1 to
+MAXWRITERS) and room for Depth queued frames (at least NumThreads). If
+the writer cannot be created, an error message is printed and
+execution terminates. */
+
+Writer *Create_Writer(int NumThreads, int Depth) {
+
+   Writer               *W;
+   int                  T;
+
+   if (NumThreads < 1)
+      NumThreads = 1;
+   if (NumThreads > MAXWRITERS)
+      NumThreads = MAXWRITERS;
+   if (Depth < NumThreads)
+      Depth = NumThreads;
+   W = (Writer *) malloc(sizeof(Writer));
+   if (W == NULL) {
+      fprintf(stderr, "Unable to allocate frame writer\n");
+      exit (1);
+   }
+   W->NumThreads = NumThreads;
+   W->Depth = Depth;
+   W->Submitted = W->Pending = W->Stored = W->Quit = 0;
+   W->Head = W->Tail = NULL;
+   W->Jobs = (Write_Job *) malloc(Depth * sizeof(Write_Job));
+   if (W->Jobs == NULL) {
+      fprintf(stderr, "Unable to allocate frame writer\n");
+      exit (1);
+   }
+   W->Idle = NULL;
+   for (T = 0; T < Depth; T++) {
+      W->Jobs[T].Next = W->Idle;
+      W->Idle = &(W->Jobs[T]);
+   }
+   W->Done = NULL;
+   W->Failed[0] = '\0';
+   pthread_mutex_init(&W->Lock, NULL);
+   pthread_cond_init(&W->Work, NULL);
+   pthread_cond_init(&W->Room, NULL);
+   pthread_cond_init(&W->Turn, NULL);
+   W->Threads = (pthread_t *) malloc(NumThreads * sizeof(pthread_t));
+   if (W->Threads == NULL) {
+      fprintf(stderr, "Unable to allocate frame writer\n");
+      exit (1);
+   }
+   for (T = 0; T < NumThreads; T++)
+      if (pthread_create(&(W->Threads[T]), NULL, Encoder_Thread, W)) {
+         fprintf(stderr, "Unable to start encoder thread\n");
+         exit (1);
+      }
+   return (W);
+}
+
+/*              Take Job
+
+This routine waits while the queue is full, then returns an unused job
+holding a frame buffer, an encode profile and a file name. If the name
+is too long, an error message is printed and execution terminates. */
+
+static Write_Job *Take_Job(Writer *W, char *FileName, FrmBuf *FB, Encode_Profile *Profile) {
+
+   Write_Job            *Job;
+
+   if (strlen(FileName) >= WRITERNAME) {
+      fprintf(stderr, "file name %s is too long for the frame writer\n", FileName);
+      exit (1);
+   }
+   Reap_Frames(W);
+   pthread_mutex_lock(&W->Lock);
+   while (W->Pending >= W->Depth)                       /* then a job is idle */
+      pthread_cond_wait(&W->Room, &W->Lock);
+   Job = W->Idle;
+   W->Idle = Job->Next;
+   pthread_mutex_unlock(&W->Lock);
+   strcpy(Job->FileName, FileName);
+   Job->FB = FB;
+   Job->Profile = Profile;
+   Job->Next = NULL;
+   return (Job);
+}
+
+/*              Queue Job
+
+This routine queues a job taken with Take_Job for the encoder
+threads. */
+
+static void Queue_Job(Writer *W, Write_Job *Job) {
+
+   pthread_mutex_lock(&W->Lock);
+   Job->Ticket = W->Submitted;
+   W->Submitted += 1;
+   W->Pending += 1;
+   if (W->Tail)
+      W->Tail->Next = Job;
+   else
+      W->Head = Job;
+   W->Tail = Job;
+   pthread_cond_signal(&W->Work);
+   pthread_mutex_unlock(&W->Lock);
+}
+
+/*              Write Frame
+
+This routine queues a frame buffer to be encoded with an encode profile
+(NULL for the default) and stored as a JPEG image file, waiting while
+the queue is full. The writer takes ownership of the frame buffer. */
+
+void Write_Frame(Writer *W, char *FileName, FrmBuf *FB, Encode_Profile *Profile) {
+
+   Write_Job            *Job;
+
+   Job = Take_Job(W, FileName, FB, Profile);
+   Job->AVI = NULL;
+   Job->Stream = 0;
+   Queue_Job(W, Job);
+}
+
+/*              Write AVI Frame
+
+This routine queues a frame buffer to be encoded with an encode profile
+(NULL for the default) and appended to a stream of an AVI file,
+waiting while the queue is full. The writer takes ownership of the
+frame buffer. */
+
+void Write_AVI_Frame(Writer *W, AVI *A, int Stream, FrmBuf *FB, Encode_Profile *Profile) {
+
+   Write_Job            *Job;
+
+   Job = Take_Job(W, A->Name, FB, Profile);
+   Job->AVI = A;
+   Job->Stream = Stream;
+   Queue_Job(W, Job);
+}
+
+/*              Flush Writer
+
+This routine waits until every queued frame is stored. */
+
+void Flush_Writer(Writer *W) {
+
+   pthread_mutex_lock(&W->Lock);
+   while (W->Pending > 0)
+      pthread_cond_wait(&W->Room, &W->Lock);
+   pthread_mutex_unlock(&W->Lock);
+   Reap_Frames(W);
+}
+
+/*              Free Writer
+
+This routine flushes the writer, stops the encoder threads and
+deallocates the writer. */
+
+void Free_Writer(Writer *W) {
+
+   int                  T;
+
+   Flush_Writer(W);
+   pthread_mutex_lock(&W->Lock);
+   W->Quit = 1;
+   pthread_cond_broadcast(&W->Work);
+   pthread_mutex_unlock(&W->Lock);
+   for (T = 0; T < W->NumThreads; T++)
+      pthread_join(W->Threads[T], NULL);
+   pthread_mutex_destroy(&W->Lock);
+   pthread_cond_destroy(&W->Work);
+   pthread_cond_destroy(&W->Room);
+   pthread_cond_destroy(&W->Turn);
+   free(W->Threads);
+   free(W->Jobs);
+   free(W);
+}
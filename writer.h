@@ -0,0 +1,39 @@
+/*                     Frame Writer
+
+This library encodes and stores JPEG output frames on a pool of
+encoder threads, off the caller's critical path.
+
+Part of the Virtual Blue-Screen program (P3-1).               */
+
+#include <pthread.h>
+
+#define                 MAXWRITERS 16
+#define                 WRITERNAME 1024           /* longest file name, with its terminator */
+
+typedef struct          Write_Job {
+   char                 FileName[WRITERNAME];
+   FrmBuf               *FB;
+   Encode_Profile       *Profile;                 /* NULL for the default profile */
+   AVI                  *AVI;                     /* appended to a stream of it, not a file */
+   int                  Stream;
+   int                  Ticket;                   /* submission order */
+   struct Write_Job     *Next;
+}  Write_Job;
+
+typedef struct          Writer {
+   int                  NumThreads, Depth;
+   int                  Submitted, Pending, Stored, Quit;
+   Write_Job            *Head, *Tail;             /* jobs waiting for an encoder */
+   Write_Job            *Jobs, *Idle;             /* Depth jobs, allocated once; the unused ones */
+   FrmBuf               *Done;                    /* stored frames, to be recycled */
+   char                 Failed[WRITERNAME];       /* first file that could not be written, or empty */
+   pthread_t            *Threads;
+   pthread_mutex_t      Lock;
+   pthread_cond_t       Work, Room, Turn;
+}  Writer;
+
+extern Writer *Create_Writer(int NumThreads, int Depth);
+extern void Write_Frame(Writer *W, char *FileName, FrmBuf *FB, Encode_Profile *Profile);
+extern void Write_AVI_Frame(Writer *W, AVI *A, int Stream, FrmBuf *FB, Encode_Profile *Profile);
+extern void Flush_Writer(Writer *W);
+extern void Free_Writer(Writer *W);